@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "math-toolkit.h"
+#include "animation.h"
+#include "raytracing.h"
+
+int animation_frames(const animation *anim)
+{
+    return anim->nkeys ? anim->keys[anim->nkeys - 1].frame + 1 : 0;
+}
+
+/* uniform Catmull-Rom between p1 and p2 at s in [0, 1] */
+static void catmull_rom(const point3 p0, const point3 p1, const point3 p2,
+                        const point3 p3, real s, point3 out)
+{
+    real s2 = s * s, s3 = s2 * s;
+    for (int i = 0; i < 3; i++)
+        out[i] = 0.5 * (2.0 * p1[i] + (p2[i] - p0[i]) * s +
+                        (2.0 * p0[i] - 5.0 * p1[i] + 4.0 * p2[i] - p3[i]) *
+                        s2 +
+                        (3.0 * p1[i] - p0[i] - 3.0 * p2[i] + p3[i]) * s3);
+}
+
+/* spherical interpolation between unit vectors a and b at s in [0, 1],
+ * exact when they are equal
+ * @return 0 if they are opposite, with no one arc between them
+ */
+static int slerp(const point3 a, const point3 b, real s, point3 out)
+{
+    if (!memcmp(a, b, sizeof(point3))) {
+        COPY_POINT3(out, a);
+        return 1;
+    }
+    real c = dot_product(a, b);
+    if (c < -1.0 + 1e-6)
+        return 0;
+    real angle = acos(c < 1.0 ? c : 1.0);
+    real wa = 1.0 - s, wb = s;
+    if (angle > 1e-6) {
+        wa = sin(wa * angle) / sin(angle);
+        wb = sin(wb * angle) / sin(angle);
+    }
+    for (int i = 0; i < 3; i++)
+        out[i] = wa * a[i] + wb * b[i];
+    normalize(out);
+    return 1;
+}
+
+void animation_view(const animation *anim, int frame, viewpoint *view)
+{
+    const keyframe *k = anim->keys;
+    int n = anim->nkeys, i = 0;
+
+    if (frame <= k[0].frame || n == 1) {
+        *view = k[0].view;
+        return;
+    }
+    if (frame >= k[n - 1].frame) {
+        *view = k[n - 1].view;
+        return;
+    }
+
+    /* k[i] <= frame < k[i + 1] */
+    while (k[i + 1].frame <= frame)
+        i++;
+    real s = (real) (frame - k[i].frame) / (k[i + 1].frame - k[i].frame);
+    const keyframe *k0 = &k[i > 0 ? i - 1 : i];
+    const keyframe *k3 = &k[i + 2 < n ? i + 2 : i + 1];
+
+    catmull_rom(k0->view.vrp, k[i].view.vrp, k[i + 1].view.vrp,
+                k3->view.vrp, s, view->vrp);
+    if (!slerp(k[i].view.vpn, k[i + 1].view.vpn, s, view->vpn) ||
+            !slerp(k[i].view.vup, k[i + 1].view.vup, s, view->vup) ||
+            !view_valid(view)) {
+        /* opposite keys, or vup swept through vpn: hold the nearer key */
+        const viewpoint *near = &k[s < 0.5 ? i : i + 1].view;
+        COPY_POINT3(view->vpn, near->vpn);
+        COPY_POINT3(view->vup, near->vup);
+    }
+}
+
+int animation_step(const animation *anim, scene *scn)
+{
+    if (!anim->nmotions)
+        return 0;
+    for (int i = 0; i < anim->nmotions; i++) {
+        const motion *m = &anim->motions[i];
+        int id = m->object;
+        if (id < 0 || id >= scene_primitive_count(scn)) {
+            fprintf(stderr, "motion of unknown object %d\n", id);
+            return -1;
+        }
+        scene_translate(scn, id, m->velocity);
+    }
+    return scene_refit(scn);
+}
+
+void animation_swept(const animation *anim, const scene *scn, int frames,
+                     aabb *box)
+{
+    int n = 0;
+
+    memset(box, 0, sizeof(*box));
+    for (int i = 0; i < anim->nmotions; i++) {
+        const motion *m = &anim->motions[i];
+        aabb b;
+        point3 shift;
+        if (m->object < 0 || m->object >= scene_primitive_count(scn))
+            continue;
+        scene_primitive_bounds(scn, m->object, &b);
+        if (!n++)
+            *box = b;
+        aabb_grow_point(box, b.min);
+        aabb_grow_point(box, b.max);
+        /* a straight line, so the box of its ends holds all of it */
+        multiply_vector(m->velocity, frames > 1 ? frames - 1 : 0, shift);
+        add_vector(b.min, shift, b.min);
+        add_vector(b.max, shift, b.max);
+        aabb_grow_point(box, b.min);
+        aabb_grow_point(box, b.max);
+    }
+}
+
+void animation_free(animation *anim)
+{
+    free(anim->keys);
+    free(anim->motions);
+    anim->keys = NULL;
+    anim->motions = NULL;
+    anim->nkeys = anim->nmotions = 0;
+}
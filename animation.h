@@ -0,0 +1,48 @@
+#ifndef __RAY_ANIMATION_H
+#define __RAY_ANIMATION_H
+
+#include "scene.h"
+
+/* camera pose reached at frame */
+typedef struct {
+    int frame;
+    viewpoint view;
+} keyframe;
+
+/* object moving in a straight line at constant speed */
+typedef struct {
+    int object;      /**< primitive id: rectangulars, then spheres */
+    point3 velocity; /**< displacement per frame */
+} motion;
+
+typedef struct {
+    keyframe *keys;  /**< sorted by frame */
+    int nkeys;
+    motion *motions;
+    int nmotions;
+} animation;
+
+/* @return number of frames up to and including the last keyframe */
+int animation_frames(const animation *anim);
+
+/* Camera at frame: vrp follows a Catmull-Rom spline through the
+ * keyframes, vpn and vup turn along the arc between the unit vectors of
+ * the keyframes, as animation_load() leaves them. Where there is no
+ * arc, or vup would pass through vpn, they hold those of the nearer key.
+ */
+void animation_view(const animation *anim, int frame, viewpoint *view);
+
+/* advance every moving object by one frame and refit the BVH
+ * @return 0 on success, -1 when out of memory or an id is out of range
+ */
+int animation_step(const animation *anim, scene *scn);
+
+/* box around all that the motions move through in frames frames from
+ * where the objects are now; all zero when nothing moves
+ */
+void animation_swept(const animation *anim, const scene *scn, int frames,
+                     aabb *box);
+
+void animation_free(animation *anim);
+
+#endif
@@ -0,0 +1,619 @@
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "raytracing.h"
+#include "scene_gen.h"
+#include "scene_io.h"
+
+/* Benchmark suite: renders a fixed set of scenes at fixed settings and
+ * reports one JSON object per case. Every case runs in its own process
+ * so that its peak RSS can be told apart from the others.
+ *
+ * Rendering time is compared against a stored baseline and the images
+ * against golden images, so a change can be shown both faster and
+ * correct. Both are refreshed with -u. A wrong image fails the run; a
+ * slowdown only does with -s, as single runs of wall-clock time vary
+ * by more than the tolerance on a busy machine.
+ */
+
+#define BENCH_DIR "bench"
+#define BASELINE_FILENAME BENCH_DIR "/baseline.json"
+#define GOLDEN_DIR BENCH_DIR "/golden"
+#define WORK_DIR BENCH_DIR "/out"
+
+#define BENCH_WIDTH 128
+#define BENCH_HEIGHT 128
+#define BENCH_REPEATS 3
+
+typedef struct {
+    const char *name;
+    const char *path; /**< scene file, or NULL to generate from params */
+    scene_params params;
+} bench_case;
+
+static const bench_case cases[] = {
+    { "stock", "models.inc", { 0 } },
+    { "spheres-1k", NULL, { 1000, 3, 2, 0.2, 0.05, 1 } },
+    { "spheres-10k", NULL, { 10000, 3, 2, 0.2, 0.05, 2 } },
+    { "glass", NULL, { 200, 3, 2, 0.2, 0.6, 3 } },
+    { "lights-16", NULL, { 200, 3, 16, 0.2, 0.05, 4 } },
+    { "rects-1k", NULL, { 50, 1000, 2, 0.2, 0.05, 5 } },
+};
+
+#define NCASES ((int) (sizeof(cases) / sizeof(cases[0])))
+
+/* object counts of the scene construction benchmark (-l) */
+static const int build_counts[] = { 1000, 10000, 100000, 1000000 };
+
+#define NBUILDS ((int) (sizeof(build_counts) / sizeof(build_counts[0])))
+
+/* what the child process measures and hands back through a pipe */
+typedef struct {
+    int ok;
+    int lights, rectangulars, spheres;
+    double load_s;
+    double build_ms;
+    double render_s;
+    ray_stats rays;
+    render_counters counters; /**< zero unless built with STATS */
+} bench_result;
+
+static color background = { 0.0, 0.1, 0.1 };
+
+static double now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1000000000.0;
+}
+
+static int write_ppm(const char *path, const uint8_t *pixels,
+                     int width, int height)
+{
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    fprintf(f, "P6\n%d %d\n%d\n", width, height, 255);
+    fwrite(pixels, 1, (size_t) width * height * 3, f);
+    return fclose(f);
+}
+
+/* @return the pixels of a binary PPM, or NULL */
+static uint8_t *read_ppm(const char *path, int *width, int *height)
+{
+    FILE *f = fopen(path, "rb");
+    int maxval;
+    if (!f)
+        return NULL;
+    if (fscanf(f, "P6 %d %d %d", width, height, &maxval) != 3 ||
+            maxval != 255 || fgetc(f) == EOF) {
+        fclose(f);
+        return NULL;
+    }
+    size_t size = (size_t) *width * *height * 3;
+    uint8_t *pixels = malloc(size);
+    if (pixels && fread(pixels, 1, size, f) != size) {
+        free(pixels);
+        pixels = NULL;
+    }
+    fclose(f);
+    return pixels;
+}
+
+/* runs in the child: load, render and save one case, keeping the best
+ * of repeats renders
+ */
+static void run_case(const char *scene_path,
+                     const char *image_path, int width, int height,
+                     int repeats, const render_options *base,
+                     bench_result *r)
+{
+    render_options options = *base;
+    scene scn;
+    viewpoint view;
+    double t = now();
+
+    memset(r, 0, sizeof(*r));
+    if (scene_load(&scn, &view, scene_path) < 0)
+        return;
+    r->load_s = now() - t;
+    r->lights = scn.lights.count;
+    r->rectangulars = scn.rectangulars.count;
+    r->spheres = scn.spheres.count;
+    r->build_ms = scn.accel.stats.build_ms;
+
+    uint8_t *pixels = malloc((size_t) width * height * 3);
+    if (!pixels)
+        return;
+    options.stats = &r->rays;
+    options.counters = &r->counters;
+    for (int i = 0; i < repeats; i++) {
+        memset(&r->rays, 0, sizeof(r->rays));
+        memset(&r->counters, 0, sizeof(r->counters));
+        t = now();
+        if (raytracing(pixels, background, &scn, &view, width, height,
+                       &options) < 0) {
+            free(pixels);
+            scene_free(&scn);
+            return;
+        }
+        t = now() - t;
+        if (i == 0 || t < r->render_s)
+            r->render_s = t;
+    }
+
+    r->ok = write_ppm(image_path, pixels, width, height) == 0;
+    free(pixels);
+    scene_free(&scn);
+}
+
+/* Time building a scene of n spheres the way the loaders do: append
+ * them to a list, compile that into the scene arrays and BVH, and free
+ * the list. Each stage keeps its best of repeats.
+ */
+static int build_case(FILE *out, int n, int repeats)
+{
+    double append_s = 0, compile_s = 0, delete_s = 0;
+    sphere s = {
+        .radius = 0.5,
+        .sphere_fill = { .fill_color = { 0.5, 0.5, 0.5 }, .Kd = 0.8 },
+    };
+
+    for (int i = 0; i < repeats; i++) {
+        sphere_node spheres = NULL;
+        uint32_t rng = 1;
+        scene scn;
+
+        double t = now();
+        for (int k = 0; k < n; k++) {
+            for (int c = 0; c < 3; c++) {
+                rng = rng * 1664525u + 1013904223u;
+                s.center[c] = (rng >> 8) / (double) (1 << 24) * 100.0;
+            }
+            if (append_sphere(&s, &spheres) < 0) {
+                fprintf(stderr, "build-%d: out of memory\n", n);
+                delete_sphere_list(&spheres);
+                return -1;
+            }
+        }
+        double t1 = now();
+        if (scene_compile(&scn, NULL, NULL, spheres, NULL) < 0) {
+            fprintf(stderr, "build-%d: out of memory\n", n);
+            delete_sphere_list(&spheres);
+            return -1;
+        }
+        double t2 = now();
+        delete_sphere_list(&spheres);
+        double t3 = now();
+        scene_free(&scn);
+
+        if (i == 0 || t1 - t < append_s)
+            append_s = t1 - t;
+        if (i == 0 || t2 - t1 < compile_s)
+            compile_s = t2 - t1;
+        if (i == 0 || t3 - t2 < delete_s)
+            delete_s = t3 - t2;
+    }
+
+    char line[256];
+    snprintf(line, sizeof(line), "{\"name\": \"build-%d\", "
+             "\"objects\": %d, \"append_s\": %.6f, "
+             "\"append_ns_per_object\": %.1f, "
+             "\"compile_s\": %.6f, \"delete_s\": %.6f}", n, n, append_s,
+             append_s * 1e9 / n, compile_s, delete_s);
+    printf("%s\n", line);
+    if (out)
+        fprintf(out, "%s\n", line);
+    return 0;
+}
+
+/* fork, run the case and collect its result and peak RSS in KiB
+ * @return 0 on success, -1 on error
+ */
+static int measure_case(const char *scene_path,
+                        const char *image_path, int width, int height,
+                        int repeats, const render_options *options,
+                        bench_result *r,
+                        long *peak_rss)
+{
+    int fd[2];
+    if (pipe(fd) < 0) {
+        perror("pipe");
+        return -1;
+    }
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        close(fd[0]);
+        run_case(scene_path, image_path, width, height, repeats, options,
+                 r);
+        _exit(write(fd[1], r, sizeof(*r)) == sizeof(*r) ? 0 : 1);
+    }
+
+    close(fd[1]);
+    ssize_t n = read(fd[0], r, sizeof(*r));
+    close(fd[0]);
+
+    struct rusage usage;
+    int status;
+    while (wait4(pid, &status, 0, &usage) < 0)
+        if (errno != EINTR) {
+            perror("wait4");
+            return -1;
+        }
+    *peak_rss = usage.ru_maxrss;
+    if (n != sizeof(*r) || !WIFEXITED(status) || WEXITSTATUS(status))
+        return -1;
+    return r->ok ? 0 : -1;
+}
+
+/* @return the number following "key": in a JSON line, or NAN */
+static double json_number(const char *line, const char *key)
+{
+    char pattern[64];
+    snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+    const char *p = strstr(line, pattern);
+    return p ? strtod(p + strlen(pattern), NULL) : NAN;
+}
+
+/* render time of a case in the baseline file, or NAN */
+static double baseline_time(const char *path, const char *name)
+{
+    FILE *f = fopen(path, "r");
+    char line[2048], pattern[64];
+    double t = NAN;
+    if (!f)
+        return NAN;
+    snprintf(pattern, sizeof(pattern), "\"name\": \"%s\"", name);
+    while (fgets(line, sizeof(line), f))
+        if (strstr(line, pattern)) {
+            t = json_number(line, "render_s");
+            break;
+        }
+    fclose(f);
+    return t;
+}
+
+/* count pixels differing from the golden image by more than tolerance
+ * @return the count, or -1 if the images cannot be compared
+ */
+static long compare_images(const char *image_path, const char *golden_path,
+                           int tolerance, int *max_diff)
+{
+    int w0, h0, w1, h1;
+    uint8_t *a = read_ppm(image_path, &w0, &h0);
+    uint8_t *b = read_ppm(golden_path, &w1, &h1);
+    long bad = -1;
+
+    *max_diff = 0;
+    if (a && b && w0 == w1 && h0 == h1) {
+        bad = 0;
+        for (size_t i = 0; i < (size_t) w0 * h0; i++) {
+            int worst = 0;
+            for (int k = 0; k < 3; k++) {
+                int d = abs(a[i * 3 + k] - b[i * 3 + k]);
+                if (d > worst) worst = d;
+            }
+            if (worst > *max_diff) *max_diff = worst;
+            if (worst > tolerance) bad++;
+        }
+    }
+    free(a);
+    free(b);
+    return bad;
+}
+
+static int copy_file(const char *from, const char *to)
+{
+    FILE *in = fopen(from, "rb"), *out = in ? fopen(to, "wb") : NULL;
+    char buf[65536];
+    size_t n;
+    int ret = 0;
+    if (!in || !out) {
+        perror(in ? to : from);
+        if (in) fclose(in);
+        return -1;
+    }
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0)
+        if (fwrite(buf, 1, n, out) != n)
+            ret = -1;
+    fclose(in);
+    return fclose(out) ? -1 : ret;
+}
+
+static void print_rate(FILE *f, const char *name, uint64_t rays, double s)
+{
+    fprintf(f, "\"%s\": %.0f", name, s > 0 ? rays / s : 0.0);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-c case] [-r WxH] [-n repeats] [-t threads] "
+            "[-O order] [-P isa] [-F] "
+            "[-o file] [-x tolerance] [-p pixel_tolerance] "
+            "[-b bad_pixels] [-s] [-u] [-l]\n"
+            "  -c case       run only this case (may repeat)\n"
+            "  -r WxH        resolution (default: %dx%d)\n"
+            "  -n repeats    renders per case, the fastest counts "
+            "(default: %d)\n"
+            "  -t threads    worker threads (default: 1)\n"
+            "  -O order      scanline (default), tiles, morton or hilbert\n"
+            "  -P isa        primary ray packets (default: auto)\n"
+            "  -F            wavefront rendering\n"
+            "  -o file       also write the JSON results to file\n"
+            "  -x tolerance  allowed slowdown against %s "
+            "(default: 0.15)\n"
+            "  -p tolerance  allowed per-channel difference against "
+            "%s (default: 2)\n"
+            "  -b fraction   allowed fraction of differing pixels "
+            "(default: 0.001)\n"
+            "  -s            fail on a slowdown too, not only on a wrong "
+            "image\n"
+            "  -u            record the results as the new baseline and "
+            "golden images\n"
+            "  -l            time scene construction from 1k to 1M objects "
+            "instead\n",
+            prog, BENCH_WIDTH, BENCH_HEIGHT, BENCH_REPEATS, BASELINE_FILENAME,
+            GOLDEN_DIR);
+}
+
+int main(int argc, char *argv[])
+{
+    render_options options = {
+        .nthreads = 1,
+        .tile_size = DEFAULT_TILE_SIZE,
+        .packets = PACKET_AUTO,
+    };
+    int width = BENCH_WIDTH, height = BENCH_HEIGHT;
+    double tolerance = 0.15, bad_fraction = 0.001;
+    int pixel_tolerance = 2, update = 0, repeats = BENCH_REPEATS;
+    int build = 0, strict = 0;
+    const char *only[NCASES];
+    int nonly = 0;
+    const char *out_path = NULL;
+    FILE *out = NULL, *baseline = NULL;
+    int opt, order, packets, failed = 0;
+
+    while ((opt = getopt(argc, argv, "c:r:n:t:O:P:Fo:x:p:b:sulh")) != -1) {
+        switch (opt) {
+        case 'c':
+            if (nonly < NCASES)
+                only[nonly++] = optarg;
+            break;
+        case 'r':
+            if (sscanf(optarg, "%dx%d", &width, &height) != 2 ||
+                    width < 2 || height < 2) {
+                fprintf(stderr, "bad resolution %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'n':
+            repeats = atoi(optarg);
+            break;
+        case 't':
+            options.nthreads = atoi(optarg);
+            break;
+        case 'O':
+            if ((order = traversal_order_parse(optarg)) < 0) {
+                fprintf(stderr, "unknown traversal order %s\n", optarg);
+                return -1;
+            }
+            options.order = order;
+            break;
+        case 'P':
+            if ((packets = packet_isa_parse(optarg)) < 0) {
+                fprintf(stderr, "unknown packet isa %s\n", optarg);
+                return -1;
+            }
+            options.packets = packets;
+            break;
+        case 'F':
+            options.wavefront = 1;
+            break;
+        case 'o':
+            out_path = optarg;
+            break;
+        case 'x':
+            tolerance = atof(optarg);
+            break;
+        case 'p':
+            pixel_tolerance = atoi(optarg);
+            break;
+        case 'b':
+            bad_fraction = atof(optarg);
+            break;
+        case 's':
+            strict = 1;
+            break;
+        case 'u':
+            update = 1;
+            break;
+        case 'l':
+            build = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : -1;
+        }
+    }
+    if (options.nthreads < 1)
+        options.nthreads = 1;
+    if (repeats < 1)
+        repeats = 1;
+
+    if (build) {
+        if (out_path && !(out = fopen(out_path, "w"))) {
+            perror(out_path);
+            return -1;
+        }
+        for (int i = 0; i < NBUILDS; i++)
+            failed |= build_case(out, build_counts[i], repeats) < 0;
+        if (out)
+            fclose(out);
+        return failed;
+    }
+
+    mkdir(BENCH_DIR, 0777);
+    mkdir(WORK_DIR, 0777);
+    mkdir(GOLDEN_DIR, 0777);
+    if (out_path && !(out = fopen(out_path, "w"))) {
+        perror(out_path);
+        return -1;
+    }
+    if (update && !(baseline = fopen(BASELINE_FILENAME ".new", "w"))) {
+        perror(BASELINE_FILENAME);
+        return -1;
+    }
+
+    const char *isa = packet_isa_name(options.packets == PACKET_OFF ?
+                                      PACKET_OFF :
+                                      packet_select(options.packets));
+    for (int i = 0; i < NCASES; i++) {
+        const bench_case *c = &cases[i];
+        char scene_path[256], image_path[256], golden_path[256];
+        int selected = !nonly;
+        for (int k = 0; k < nonly; k++)
+            selected |= !strcmp(only[k], c->name);
+        if (!selected)
+            continue;
+
+        if (c->path)
+            snprintf(scene_path, sizeof(scene_path), "%s", c->path);
+        else {
+            snprintf(scene_path, sizeof(scene_path), WORK_DIR "/%s.txt",
+                     c->name);
+            FILE *f = fopen(scene_path, "w");
+            if (!f) {
+                perror(scene_path);
+                return -1;
+            }
+            scene_generate(f, &c->params);
+            fclose(f);
+        }
+        snprintf(image_path, sizeof(image_path), WORK_DIR "/%s.ppm",
+                 c->name);
+        snprintf(golden_path, sizeof(golden_path), GOLDEN_DIR "/%s.ppm",
+                 c->name);
+
+        bench_result r;
+        long rss = 0;
+        if (measure_case(scene_path, image_path, width, height, repeats,
+                         &options, &r, &rss) < 0) {
+            fprintf(stderr, "%s: failed\n", c->name);
+            failed = 1;
+            continue;
+        }
+
+        /* correctness against the golden image */
+        int max_diff = 0;
+        long bad = -1;
+        const char *image = "skipped";
+        if (update)
+            image = copy_file(image_path, golden_path) ? "error" : "updated";
+        else if (width == BENCH_WIDTH && height == BENCH_HEIGHT) {
+            bad = compare_images(image_path, golden_path, pixel_tolerance,
+                                 &max_diff);
+            if (bad < 0)
+                image = "missing";
+            else
+                image = bad > bad_fraction * width * height ?
+                        "mismatch" : "match";
+        }
+        if (!strcmp(image, "mismatch") || !strcmp(image, "missing") ||
+                !strcmp(image, "error"))
+            failed = 1;
+
+        /* speed against the baseline */
+        double base = update ? NAN : baseline_time(BASELINE_FILENAME,
+                                                   c->name);
+        const char *speed = "none";
+        if (!isnan(base)) {
+            int slower = r.render_s > base * (1.0 + tolerance);
+            speed = slower ? "regression" : "ok";
+            if (slower && strict)
+                failed = 1;
+            else if (slower)
+                fprintf(stderr, "%s: %.3f sec against %.3f in the "
+                        "baseline, rerun to confirm\n", c->name,
+                        r.render_s, base);
+        }
+
+        uint64_t total = r.rays.primary + r.rays.reflection +
+                         r.rays.refraction + r.rays.shadow;
+        char line[2048];
+        FILE *mem = fmemopen(line, sizeof(line), "w");
+        fprintf(mem, "{\"name\": \"%s\", \"width\": %d, \"height\": %d, "
+                "\"threads\": %d, \"packets\": \"%s\", \"order\": \"%s\", "
+                "\"wavefront\": %s, \"lights\": %d, \"rectangulars\": %d, "
+                "\"spheres\": %d, "
+                "\"load_s\": %.6f, \"build_ms\": %.3f, \"render_s\": %.6f, "
+                "\"rays\": {\"primary\": %llu, \"reflection\": %llu, "
+                "\"refraction\": %llu, \"shadow\": %llu}, "
+                "\"rays_per_s\": {", c->name, width, height,
+                options.nthreads, isa, traversal_order_name(options.order),
+                options.wavefront ? "true" : "false",
+                r.lights, r.rectangulars, r.spheres,
+                r.load_s, r.build_ms, r.render_s,
+                (unsigned long long) r.rays.primary,
+                (unsigned long long) r.rays.reflection,
+                (unsigned long long) r.rays.refraction,
+                (unsigned long long) r.rays.shadow);
+        print_rate(mem, "primary", r.rays.primary, r.render_s);
+        fprintf(mem, ", ");
+        print_rate(mem, "reflection", r.rays.reflection, r.render_s);
+        fprintf(mem, ", ");
+        print_rate(mem, "refraction", r.rays.refraction, r.render_s);
+        fprintf(mem, ", ");
+        print_rate(mem, "shadow", r.rays.shadow, r.render_s);
+        fprintf(mem, ", ");
+        print_rate(mem, "total", total, r.render_s);
+        fprintf(mem, "}, \"peak_rss_kb\": %ld", rss);
+        if (RAY_STATS) {
+            fprintf(mem, ", \"counters\": ");
+            stats_print_json(mem, &r.counters);
+        }
+        fflush(mem);
+        if (baseline)
+            fprintf(baseline, "%s}\n", line);
+        if (!isnan(base))
+            fprintf(mem, ", \"baseline_s\": %.6f, \"speedup\": %.3f",
+                    base, base / r.render_s);
+        fprintf(mem, ", \"speed\": \"%s\", \"image\": \"%s\"", speed, image);
+        if (bad >= 0)
+            fprintf(mem, ", \"bad_pixels\": %ld, \"max_diff\": %d",
+                    bad, max_diff);
+        fprintf(mem, "}");
+        fclose(mem);
+
+        printf("%s\n", line);
+        if (out)
+            fprintf(out, "%s\n", line);
+    }
+
+    if (out)
+        fclose(out);
+    if (baseline) {
+        fclose(baseline);
+        if (rename(BASELINE_FILENAME ".new", BASELINE_FILENAME) < 0) {
+            perror(BASELINE_FILENAME);
+            failed = 1;
+        }
+    }
+    return failed;
+}
@@ -0,0 +1,313 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "bvh.h"
+
+#define BVH_BINS 16
+#define BVH_LEAF_SIZE 4
+#define BVH_MAX_DEPTH 64
+/* relative cost of a primitive test against a node traversal step */
+#define BVH_TRAVERSAL_COST 1.0
+#define BVH_INTERSECT_COST 1.0
+/* keep flat rectangulars from producing zero-volume boxes */
+#define BVH_PADDING 1e-6
+
+/* per-primitive data only needed while building */
+typedef struct {
+    aabb box;
+    point3 centroid;
+} build_ref;
+
+typedef struct {
+    bvh *tree;
+    build_ref *refs;
+    int used;
+} builder;
+
+static void aabb_empty(aabb *b)
+{
+    for (int i = 0; i < 3; i++) {
+        b->min[i] = INFINITY;
+        b->max[i] = -INFINITY;
+    }
+}
+
+static void aabb_grow(aabb *b, const aabb *o)
+{
+    aabb_grow_point(b, o->min);
+    aabb_grow_point(b, o->max);
+}
+
+static double aabb_area(const aabb *b)
+{
+    double dx = b->max[0] - b->min[0];
+    double dy = b->max[1] - b->min[1];
+    double dz = b->max[2] - b->min[2];
+    if (dx < 0 || dy < 0 || dz < 0)
+        return 0.0;
+    return 2.0 * (dx * dy + dy * dz + dz * dx);
+}
+
+static void primitive_ref(const aabb *box, build_ref *ref)
+{
+    ref->box = *box;
+    for (int i = 0; i < 3; i++) {
+        double pad = BVH_PADDING * fmax(1.0, fabs(ref->box.max[i]));
+        ref->box.min[i] -= pad;
+        ref->box.max[i] += pad;
+        ref->centroid[i] = 0.5 * (ref->box.min[i] + ref->box.max[i]);
+    }
+}
+
+static void swap_prims(builder *b, int i, int j)
+{
+    int p = b->tree->prims[i];
+    b->tree->prims[i] = b->tree->prims[j];
+    b->tree->prims[j] = p;
+    build_ref r = b->refs[i];
+    b->refs[i] = b->refs[j];
+    b->refs[j] = r;
+}
+
+/* Find the cheapest binned SAH split of [start, end).
+ * @return split position, or -1 if a leaf is cheaper
+ */
+static int sah_split(builder *b, int start, int end, const aabb *bounds)
+{
+    int count = end - start;
+    aabb centroids;
+    aabb_empty(&centroids);
+    for (int i = start; i < end; i++)
+        aabb_grow_point(&centroids, b->refs[i].centroid);
+
+    double best_cost = BVH_INTERSECT_COST * count;
+    int best_axis = -1, best_bin = 0;
+
+    for (int axis = 0; axis < 3; axis++) {
+        double lo = centroids.min[axis], hi = centroids.max[axis];
+        if (hi <= lo)
+            continue;
+
+        aabb bin_box[BVH_BINS];
+        int bin_count[BVH_BINS] = { 0 };
+        for (int k = 0; k < BVH_BINS; k++)
+            aabb_empty(&bin_box[k]);
+
+        double scale = BVH_BINS / (hi - lo);
+        for (int i = start; i < end; i++) {
+            int k = (b->refs[i].centroid[axis] - lo) * scale;
+            if (k >= BVH_BINS) k = BVH_BINS - 1;
+            bin_count[k]++;
+            aabb_grow(&bin_box[k], &b->refs[i].box);
+        }
+
+        /* sweep from the right, then evaluate while sweeping left */
+        double right_area[BVH_BINS];
+        int right_count[BVH_BINS];
+        aabb acc;
+        aabb_empty(&acc);
+        int n = 0;
+        for (int k = BVH_BINS - 1; k > 0; k--) {
+            aabb_grow(&acc, &bin_box[k]);
+            n += bin_count[k];
+            right_area[k] = aabb_area(&acc);
+            right_count[k] = n;
+        }
+
+        aabb_empty(&acc);
+        n = 0;
+        double inv_area = 1.0 / aabb_area(bounds);
+        for (int k = 1; k < BVH_BINS; k++) {
+            aabb_grow(&acc, &bin_box[k - 1]);
+            n += bin_count[k - 1];
+            if (!n || !right_count[k])
+                continue;
+            double cost = BVH_TRAVERSAL_COST +
+                          BVH_INTERSECT_COST * inv_area *
+                          (aabb_area(&acc) * n +
+                           right_area[k] * right_count[k]);
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_bin = k;
+            }
+        }
+    }
+
+    if (best_axis < 0)
+        return -1;
+
+    double lo = centroids.min[best_axis];
+    double scale = BVH_BINS / (centroids.max[best_axis] - lo);
+    int i = start, j = end - 1;
+    while (i <= j) {
+        int k = (b->refs[i].centroid[best_axis] - lo) * scale;
+        if (k >= BVH_BINS) k = BVH_BINS - 1;
+        if (k < best_bin)
+            i++;
+        else
+            swap_prims(b, i, j--);
+    }
+    return i;
+}
+
+static int build_node(builder *b, int start, int end, int depth)
+{
+    int idx = b->used++;
+    bvh_node *node = &b->tree->nodes[idx];
+    aabb bounds;
+
+    aabb_empty(&bounds);
+    for (int i = start; i < end; i++)
+        aabb_grow(&bounds, &b->refs[i].box);
+    COPY_POINT3(node->min, bounds.min);
+    COPY_POINT3(node->max, bounds.max);
+
+    if (depth > b->tree->stats.depth)
+        b->tree->stats.depth = depth;
+
+    int mid = -1;
+    if (end - start > BVH_LEAF_SIZE && depth < BVH_MAX_DEPTH)
+        mid = sah_split(b, start, end, &bounds);
+    if (mid < 0 && end - start > BVH_LEAF_SIZE && depth < BVH_MAX_DEPTH) {
+        /* SAH found no useful split but the leaf is too big: halve it */
+        mid = (start + end) / 2;
+    }
+
+    if (mid < 0) {
+        node->start = start;
+        node->count = end - start;
+        b->tree->stats.leaves++;
+        return idx;
+    }
+
+    /* nodes are preallocated, so node stays valid while recursing */
+    node->count = 0;
+    build_node(b, start, mid, depth + 1);
+    node->start = build_node(b, mid, end, depth + 1);
+    return idx;
+}
+
+static double diff_in_ms(struct timespec t1, struct timespec t2)
+{
+    return (t2.tv_sec - t1.tv_sec) * 1000.0 +
+           (t2.tv_nsec - t1.tv_nsec) / 1000000.0;
+}
+
+int bvh_build(bvh *tree, const aabb *boxes, int n)
+{
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    memset(tree, 0, sizeof(*tree));
+
+    /* a binary tree over n >= 1 primitives has at most 2n - 1 nodes */
+    tree->nodes = malloc(sizeof(bvh_node) * (n ? 2 * n - 1 : 1));
+    tree->prims = malloc(sizeof(int) * (n ? n : 1));
+    build_ref *refs = malloc(sizeof(build_ref) * (n ? n : 1));
+    if (!tree->nodes || !tree->prims || !refs) {
+        free(refs);
+        bvh_free(tree);
+        return -1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        tree->prims[i] = i;
+        primitive_ref(&boxes[i], &refs[i]);
+    }
+
+    builder b = { .tree = tree, .refs = refs, .used = 0 };
+    build_node(&b, 0, n, 1);
+    free(refs);
+
+    /* leaves hold several primitives, so most of the worst case is unused;
+     * give it back, which matters for meshes of millions of triangles
+     */
+    bvh_node *nodes = realloc(tree->nodes, sizeof(bvh_node) * b.used);
+    if (nodes)
+        tree->nodes = nodes;
+
+    tree->stats.nodes = b.used;
+    tree->stats.primitives = n;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    tree->stats.build_ms = diff_in_ms(start, end);
+    return 0;
+}
+
+void bvh_refit(bvh *tree, const aabb *boxes)
+{
+    /* children always come after their parent, so walking backwards
+     * sees them first
+     */
+    for (int idx = tree->stats.nodes - 1; idx >= 0; idx--) {
+        bvh_node *node = &tree->nodes[idx];
+        aabb bounds;
+
+        aabb_empty(&bounds);
+        if (node->count) {
+            for (int i = node->start; i < node->start + node->count; i++) {
+                build_ref ref;
+                primitive_ref(&boxes[tree->prims[i]], &ref);
+                aabb_grow(&bounds, &ref.box);
+            }
+        } else {
+            const bvh_node *left = node + 1;
+            const bvh_node *right = &tree->nodes[node->start];
+            aabb_grow_point(&bounds, left->min);
+            aabb_grow_point(&bounds, left->max);
+            aabb_grow_point(&bounds, right->min);
+            aabb_grow_point(&bounds, right->max);
+        }
+        COPY_POINT3(node->min, bounds.min);
+        COPY_POINT3(node->max, bounds.max);
+    }
+}
+
+int bvh_check(const bvh *tree, int nids)
+{
+    int nodes = tree->stats.nodes, prims = tree->stats.primitives;
+
+    if (nodes < 0 || prims < 0 || (prims && !nodes))
+        return -1;
+    /* the lone empty leaf bvh_build() makes for an empty scene */
+    if (!prims && nodes == 1)
+        return 0;
+    for (int i = 0; i < prims; i++)
+        if (tree->prims[i] < 0 || tree->prims[i] >= nids)
+            return -1;
+
+    /* children come after their parents, so depths settle in one pass */
+    int *depth = calloc(nodes ? nodes : 1, sizeof(int));
+    if (!depth)
+        return -1;
+    int ret = 0;
+    for (int i = 0; i < nodes && !ret; i++) {
+        const bvh_node *node = &tree->nodes[i];
+        if (node->count) {
+            ret = node->count < 0 || node->start < 0 ||
+                  node->start > prims - node->count ? -1 : 0;
+            continue;
+        }
+        if (i + 1 >= nodes || node->start <= i || node->start >= nodes ||
+                depth[i] + 2 >= BVH_STACK_SIZE) {
+            ret = -1;
+            continue;
+        }
+        if (depth[i + 1] < depth[i] + 1)
+            depth[i + 1] = depth[i] + 1;
+        if (depth[node->start] < depth[i] + 1)
+            depth[node->start] = depth[i] + 1;
+    }
+    free(depth);
+    return ret;
+}
+
+void bvh_free(bvh *tree)
+{
+    free(tree->nodes);
+    free(tree->prims);
+    tree->nodes = NULL;
+    tree->prims = NULL;
+}
@@ -0,0 +1,93 @@
+#ifndef __RAY_BVH_H
+#define __RAY_BVH_H
+
+#include <tgmath.h>
+
+#include "primitives.h"
+
+typedef struct {
+    point3 min, max;
+} aabb;
+
+/* deep enough for any tree bvh_build() produces */
+#define BVH_STACK_SIZE 128
+
+/* Nodes are stored depth first: the left child of an inner node is the
+ * node right after it, the right child is at index start.
+ */
+typedef struct {
+    point3 min, max;
+    int start; /**< right child, or first primitive of a leaf */
+    int count; /**< number of primitives, 0 for inner nodes */
+} bvh_node;
+
+typedef struct {
+    int nodes;
+    int leaves;
+    int depth;
+    int primitives;
+    double build_ms;
+} bvh_stats;
+
+typedef struct {
+    bvh_node *nodes;
+    int *prims; /**< primitive ids, leaves refer to ranges of this */
+    bvh_stats stats;
+} bvh;
+
+/* build a SAH tree over count primitives, boxes[id] bounding primitive id
+ * @return 0 on success, -1 when out of memory
+ */
+int bvh_build(bvh *tree, const aabb *boxes, int count);
+
+/* Recompute the node boxes after primitives moved, keeping the tree. It
+ * stays correct however far they move, but slows down as the boxes of
+ * siblings come to overlap.
+ */
+void bvh_refit(bvh *tree, const aabb *boxes);
+
+void bvh_free(bvh *tree);
+
+/* Check a tree that did not come from bvh_build(), such as one read
+ * from a file: children and primitive ranges in range, children after
+ * their parents, ids below nids, and no deeper than the traversal
+ * stacks allow.
+ * @return 0 if it is safe to traverse, -1 if not or out of memory
+ */
+int bvh_check(const bvh *tree, int nids);
+
+static inline void aabb_grow_point(aabb *b, const point3 p)
+{
+    for (int i = 0; i < 3; i++) {
+        b->min[i] = fmin(b->min[i], p[i]);
+        b->max[i] = fmax(b->max[i], p[i]);
+    }
+}
+
+/* @param inv_d component-wise reciprocal of the ray direction
+ * @param t1 farthest distance of interest
+ * @return entry distance of the ray into the node, or INFINITY on a miss
+ */
+static inline real bvh_node_hit(const bvh_node *node, const point3 e,
+                                const point3 inv_d, real t1)
+{
+    real tmin = 0.0, tmax = t1;
+    for (int i = 0; i < 3; i++) {
+        real ta = (node->min[i] - e[i]) * inv_d[i];
+        real tb = (node->max[i] - e[i]) * inv_d[i];
+        /* fmin/fmax drop the NaN of a ray lying in a slab plane */
+        tmin = fmax(tmin, fmin(ta, tb));
+        tmax = fmin(tmax, fmax(ta, tb));
+    }
+    return (tmin <= tmax) ? tmin : INFINITY;
+}
+
+static inline int bvh_node_contains(const bvh_node *node, const point3 p)
+{
+    for (int i = 0; i < 3; i++)
+        if (p[i] < node->min[i] || p[i] > node->max[i])
+            return 0;
+    return 1;
+}
+
+#endif
@@ -0,0 +1,748 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "cluster.h"
+#include "net.h"
+
+#define CLUSTER_MAGIC 0x52415943 /* "RAYC" */
+#define CLUSTER_VERSION 3
+
+/* tiles sent to a worker ahead of its results */
+#define CLUSTER_INFLIGHT 2
+
+/* workers a tile may be out on at once */
+#define CLUSTER_COPIES 2
+
+#define CLUSTER_MAX_WORKERS 64
+
+/* seconds between the messages of a worker still rendering a tile, well
+ * inside CLUSTER_TIMEOUT
+ */
+#define CLUSTER_HEARTBEAT 5
+
+enum {
+    MSG_HELLO,  /**< worker: cluster_hello */
+    MSG_SETUP,  /**< coordinator: cluster_setup */
+    MSG_TILE,   /**< coordinator: cluster_tile */
+    MSG_RESULT, /**< worker: cluster_result, then the pixels */
+    MSG_DONE,   /**< coordinator: no payload, the image is complete */
+    MSG_BUSY,   /**< worker: no payload, still rendering */
+};
+
+/* what a worker is and has loaded, checked against the coordinator */
+typedef struct {
+    uint32_t magic, version, real_size;
+    int32_t lights, rectangulars, spheres, meshes, triangles;
+    int32_t threads;
+} cluster_hello;
+
+typedef struct {
+    viewpoint view;
+    color background;
+    int32_t width, height;
+    int32_t max_samples, max_bounces, roulette, light_samples;
+    real contrast, min_weight, light_cutoff;
+} cluster_setup;
+
+typedef struct {
+    int32_t id;
+    tile t;
+} cluster_tile;
+
+typedef struct {
+    int32_t id;
+    double seconds; /**< spent rendering the tile */
+    ray_stats rays;
+} cluster_result;
+
+static void hello_init(cluster_hello *h, const scene *scn, int threads)
+{
+    memset(h, 0, sizeof(*h));
+    h->magic = CLUSTER_MAGIC;
+    h->version = CLUSTER_VERSION;
+    h->real_size = sizeof(real);
+    h->lights = scn->lights.count;
+    h->rectangulars = scn->rectangulars.count;
+    h->spheres = scn->spheres.count;
+    h->meshes = scn->meshes.count;
+    for (int i = 0; i < scn->meshes.count; i++)
+        h->triangles += scn->meshes.items[i].ntriangles;
+    h->threads = threads;
+}
+
+/* tiles the coordinator sent ahead, and whether it said it is done */
+typedef struct {
+    cluster_tile pending[CLUSTER_INFLIGHT];
+    int npending;
+    int done;
+} work_queue;
+
+/* read one message into q, waiting for it
+ * @return 0 on success, -1 when the connection is lost or the message bad
+ */
+static int receive_work(int fd, work_queue *q)
+{
+    message_header h;
+
+    if (read_full(fd, &h, sizeof(h)) < 0)
+        return -1;
+    if (h.type == MSG_DONE && !h.size) {
+        q->done = 1;
+        return 0;
+    }
+    if (h.type != MSG_TILE || h.size != sizeof(cluster_tile) ||
+            q->npending == CLUSTER_INFLIGHT)
+        return -1;
+    return read_full(fd, &q->pending[q->npending++], sizeof(cluster_tile));
+}
+
+/* read the messages that have already arrived */
+static int receive_ready(int fd, work_queue *q)
+{
+    struct pollfd p = { .fd = fd, .events = POLLIN };
+
+    while (!q->done && poll(&p, 1, 0) > 0)
+        if (receive_work(fd, q) < 0)
+            return -1;
+    return 0;
+}
+
+/* a thread saying MSG_BUSY every CLUSTER_HEARTBEAT seconds while the
+ * worker renders, so that slow tiles are not taken for lost workers
+ */
+typedef struct {
+    int fd;
+    int rendering, stop;
+    pthread_mutex_t lock; /**< held while the thread sends */
+    pthread_cond_t wake;
+    pthread_t thread;
+} heartbeat;
+
+static void *heartbeat_main(void *arg)
+{
+    heartbeat *hb = arg;
+    struct timespec until;
+
+    pthread_mutex_lock(&hb->lock);
+    while (!hb->stop) {
+        clock_gettime(CLOCK_MONOTONIC, &until);
+        until.tv_sec += CLUSTER_HEARTBEAT;
+        if (pthread_cond_timedwait(&hb->wake, &hb->lock, &until) ==
+                ETIMEDOUT && hb->rendering)
+            send_message(hb->fd, MSG_BUSY, NULL, 0, NULL, 0);
+    }
+    pthread_mutex_unlock(&hb->lock);
+    return NULL;
+}
+
+/* @return 0 on success, -1 if the thread could not be started */
+static int heartbeat_start(heartbeat *hb, int fd)
+{
+    pthread_condattr_t attr;
+
+    hb->fd = fd;
+    hb->rendering = hb->stop = 0;
+    pthread_mutex_init(&hb->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&hb->wake, &attr);
+    pthread_condattr_destroy(&attr);
+    if (pthread_create(&hb->thread, NULL, heartbeat_main, hb)) {
+        pthread_cond_destroy(&hb->wake);
+        pthread_mutex_destroy(&hb->lock);
+        return -1;
+    }
+    return 0;
+}
+
+/* once it returns, the thread sends nothing more until set again */
+static void heartbeat_set(heartbeat *hb, int rendering)
+{
+    pthread_mutex_lock(&hb->lock);
+    hb->rendering = rendering;
+    pthread_mutex_unlock(&hb->lock);
+}
+
+static void heartbeat_stop(heartbeat *hb)
+{
+    pthread_mutex_lock(&hb->lock);
+    hb->stop = 1;
+    pthread_cond_signal(&hb->wake);
+    pthread_mutex_unlock(&hb->lock);
+    pthread_join(hb->thread, NULL);
+    pthread_cond_destroy(&hb->wake);
+    pthread_mutex_destroy(&hb->lock);
+}
+
+int cluster_work(const char *address, const scene *scn,
+                 const render_options *options, FILE *log)
+{
+    heartbeat hb;
+    cluster_hello hello;
+    cluster_setup setup;
+    work_queue q = { .npending = 0 };
+    uint8_t *pixels = NULL;
+    size_t capacity = 0;
+    int tiles = 0;
+    double busy = 0;
+
+    int fd = connect_to(address, CLUSTER_TIMEOUT);
+    if (fd < 0)
+        return -1;
+    hello_init(&hello, scn, options->nthreads);
+    if (send_message(fd, MSG_HELLO, &hello, sizeof(hello), NULL, 0) < 0 ||
+            recv_message(fd, MSG_SETUP, &setup, sizeof(setup)) < 0) {
+        fprintf(stderr, "%s: rejected by the coordinator\n", address);
+        close(fd);
+        return -1;
+    }
+    if (heartbeat_start(&hb, fd) < 0) {
+        fprintf(stderr, "%s: cannot start a thread\n", address);
+        close(fd);
+        return -1;
+    }
+
+    render_options tile_options = *options;
+    tile_options.max_samples = setup.max_samples;
+    tile_options.contrast = setup.contrast;
+    tile_options.max_bounces = setup.max_bounces;
+    tile_options.min_weight = setup.min_weight;
+    tile_options.roulette = setup.roulette;
+    tile_options.light_cutoff = setup.light_cutoff;
+    tile_options.light_samples = setup.light_samples;
+
+    while (!q.done) {
+        if ((q.npending ? receive_ready(fd, &q) :
+                          receive_work(fd, &q)) < 0)
+            break;
+        if (q.done || !q.npending)
+            continue;
+
+        cluster_tile job = q.pending[0];
+        memmove(&q.pending[0], &q.pending[1],
+                --q.npending * sizeof(cluster_tile));
+        const tile *t = &job.t;
+        if (t->x < 0 || t->y < 0 || t->width < 1 || t->height < 1 ||
+                t->x + t->width > setup.width ||
+                t->y + t->height > setup.height)
+            break;
+
+        size_t size = (size_t) t->width * t->height * 3;
+        if (size > capacity) {
+            free(pixels);
+            if (!(pixels = malloc(size)))
+                break;
+            capacity = size;
+        }
+
+        cluster_result result = { .id = job.id };
+        double start = monotonic_seconds();
+        tile_options.stats = &result.rays;
+        heartbeat_set(&hb, 1);
+        int rendered = raytracing_tile(pixels, setup.background, scn,
+                                       &setup.view, setup.width,
+                                       setup.height, t, &tile_options);
+        heartbeat_set(&hb, 0);
+        /* out of memory: leave the tile to the coordinator's others */
+        if (rendered < 0) {
+            fprintf(stderr, "%s: out of memory\n", address);
+            break;
+        }
+        result.seconds = monotonic_seconds() - start;
+
+        /* the coordinator finishes without waiting for copies of tiles
+         * it already has, so do not count that as losing it
+         */
+        if (receive_ready(fd, &q) < 0 || q.done)
+            break;
+        if (send_message(fd, MSG_RESULT, &result, sizeof(result),
+                         pixels, size) < 0) {
+            receive_ready(fd, &q);
+            break;
+        }
+
+        busy += result.seconds;
+        tiles++;
+        if (options->stats) {
+            options->stats->primary += result.rays.primary;
+            options->stats->reflection += result.rays.reflection;
+            options->stats->refraction += result.rays.refraction;
+            options->stats->shadow += result.rays.shadow;
+        }
+    }
+    if (!q.done)
+        fprintf(stderr, "%s: lost the coordinator\n", address);
+    if (log)
+        fprintf(log, "# Worker: %d tiles, %lf sec rendering\n", tiles,
+                busy);
+    heartbeat_stop(&hb);
+    free(pixels);
+    close(fd);
+    return q.done ? 0 : -1;
+}
+
+typedef struct {
+    int fd; /**< -1 once gone */
+    int number; /**< in order of connection, for the log */
+    int threads;
+    int inflight[CLUSTER_INFLIGHT]; /**< tile ids */
+    int ninflight;
+    double last_heard; /**< while tiles are out on it */
+    int tiles;  /**< first results */
+    int lost;   /**< results another worker had already delivered */
+    long pixels;
+    double busy;
+} remote_worker;
+
+/* a connection whose hello has not all arrived yet */
+typedef struct {
+    int fd;
+    double since; /**< when it was accepted */
+    size_t got;   /**< bytes of greeting read so far */
+    uint8_t greeting[sizeof(message_header) + sizeof(cluster_hello)];
+} pending_worker;
+
+typedef struct {
+    int copies; /**< workers it is out on */
+    int done;
+    double sent; /**< when it last went out */
+} tile_state;
+
+typedef struct {
+    const tile *tiles;
+    tile_state *state;
+    int ntiles, remaining;
+    int cursor; /**< no tile before it is waiting for its first worker */
+    int handed_again; /**< tiles taken back from lost workers */
+    remote_worker workers[CLUSTER_MAX_WORKERS];
+    int nworkers, connected;
+    pending_worker pending[CLUSTER_MAX_WORKERS];
+    int npending;
+    uint8_t *pixels, *buffer;
+    cluster_setup setup;
+    cluster_hello expected;
+    ray_stats *stats;
+    FILE *log;
+} coordinator;
+
+static void drop_worker(coordinator *c, remote_worker *w, const char *why)
+{
+    for (int i = 0; i < w->ninflight; i++) {
+        tile_state *s = &c->state[w->inflight[i]];
+        if (--s->copies == 0 && !s->done) {
+            c->handed_again++;
+            if (w->inflight[i] < c->cursor)
+                c->cursor = w->inflight[i];
+        }
+    }
+    if (c->log)
+        fprintf(c->log, "# Worker %d lost: %s, %d tile(s) taken back\n",
+                w->number, why, w->ninflight);
+    w->ninflight = 0;
+    close(w->fd);
+    w->fd = -1;
+    c->connected--;
+}
+
+static int holds(const remote_worker *w, int id)
+{
+    for (int i = 0; i < w->ninflight; i++)
+        if (w->inflight[i] == id)
+            return 1;
+    return 0;
+}
+
+/* the next tile for w: one nobody has, or for an idle worker the tile
+ * out longest on a single other worker
+ * @return tile id, -1 for none
+ */
+static int next_tile(coordinator *c, const remote_worker *w)
+{
+    for (; c->cursor < c->ntiles; c->cursor++) {
+        const tile_state *s = &c->state[c->cursor];
+        if (!s->done && !s->copies)
+            return c->cursor++;
+    }
+    if (w->ninflight)
+        return -1;
+
+    int best = -1;
+    for (int i = 0; i < c->ntiles; i++) {
+        const tile_state *s = &c->state[i];
+        if (!s->done && s->copies < CLUSTER_COPIES && !holds(w, i) &&
+                (best < 0 || s->sent < c->state[best].sent))
+            best = i;
+    }
+    return best;
+}
+
+static void fill_worker(coordinator *c, remote_worker *w, double now)
+{
+    while (w->fd >= 0 && w->ninflight < CLUSTER_INFLIGHT) {
+        int id = next_tile(c, w);
+        if (id < 0)
+            return;
+        cluster_tile job = { .id = id, .t = c->tiles[id] };
+        if (send_message(w->fd, MSG_TILE, &job, sizeof(job), NULL, 0) < 0) {
+            /* not out on w yet, so only the cursor needs undoing */
+            if (!c->state[id].copies && id < c->cursor)
+                c->cursor = id;
+            drop_worker(c, w, "send failed");
+            return;
+        }
+        if (!w->ninflight)
+            w->last_heard = now;
+        w->inflight[w->ninflight++] = id;
+        c->state[id].copies++;
+        c->state[id].sent = now;
+    }
+}
+
+static void accept_worker(coordinator *c, int listen_fd, double now)
+{
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+
+    int fd = accept(listen_fd, (struct sockaddr *) &addr, &len);
+    if (fd < 0)
+        return;
+    set_nodelay(fd, addr.ss_family);
+    set_timeout(fd, CLUSTER_TIMEOUT);
+    c->pending[c->npending++] = (pending_worker) { .fd = fd, .since = now };
+}
+
+/* read what has arrived of p's hello, without waiting for more, and
+ * take p on as a worker once all of it is there
+ * @return 1 once p is a worker or closed, 0 while its hello is incomplete
+ */
+static int greet_worker(coordinator *c, pending_worker *p)
+{
+    message_header h;
+    cluster_hello hello;
+
+    ssize_t n = recv(p->fd, p->greeting + p->got,
+                     sizeof(p->greeting) - p->got, MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+                  errno == EINTR))
+        return 0;
+    if (n > 0 && (p->got += n) < sizeof(p->greeting))
+        return 0;
+
+    memcpy(&h, p->greeting, sizeof(h));
+    memcpy(&hello, p->greeting + sizeof(h), sizeof(hello));
+    if (n <= 0 || h.type != MSG_HELLO || h.size != sizeof(hello) ||
+            hello.magic != c->expected.magic ||
+            hello.version != c->expected.version ||
+            hello.real_size != c->expected.real_size ||
+            memcmp(&hello.lights, &c->expected.lights,
+                   offsetof(cluster_hello, threads) -
+                   offsetof(cluster_hello, lights))) {
+        if (c->log)
+            fprintf(c->log, "# Refused a worker: not the same build and "
+                    "scene\n");
+        close(p->fd);
+        return 1;
+    }
+    if (c->nworkers == CLUSTER_MAX_WORKERS ||
+            send_message(p->fd, MSG_SETUP, &c->setup, sizeof(c->setup),
+                         NULL, 0) < 0) {
+        close(p->fd);
+        return 1;
+    }
+
+    remote_worker *w = &c->workers[c->nworkers];
+    memset(w, 0, sizeof(*w));
+    w->fd = p->fd;
+    w->number = ++c->nworkers;
+    w->threads = hello.threads;
+    c->connected++;
+    return 1;
+}
+
+static void receive_result(coordinator *c, remote_worker *w, double now)
+{
+    message_header h;
+    cluster_result result;
+    int slot;
+
+    if (read_full(w->fd, &h, sizeof(h)) < 0) {
+        drop_worker(c, w, "disconnected");
+        return;
+    }
+    if (h.type == MSG_BUSY && !h.size) {
+        w->last_heard = now;
+        return;
+    }
+    if (h.type != MSG_RESULT || h.size < sizeof(result) ||
+            read_full(w->fd, &result, sizeof(result)) < 0) {
+        drop_worker(c, w, "bad message");
+        return;
+    }
+    for (slot = 0; slot < w->ninflight; slot++)
+        if (w->inflight[slot] == result.id)
+            break;
+    if (slot == w->ninflight) {
+        drop_worker(c, w, "result for a tile it was not given");
+        return;
+    }
+
+    const tile *t = &c->tiles[result.id];
+    size_t row = (size_t) t->width * 3;
+    if (h.size != sizeof(result) + row * t->height ||
+            read_full(w->fd, c->buffer, row * t->height) < 0) {
+        drop_worker(c, w, "bad result");
+        return;
+    }
+
+    w->inflight[slot] = w->inflight[--w->ninflight];
+    w->last_heard = now;
+    w->busy += result.seconds;
+    tile_state *s = &c->state[result.id];
+    s->copies--;
+    if (s->done) {
+        w->lost++;
+    } else {
+        for (int j = 0; j < t->height; j++)
+            memcpy(c->pixels + ((size_t) (t->y + j) * c->setup.width +
+                                t->x) * 3, c->buffer + j * row, row);
+        s->done = 1;
+        c->remaining--;
+        w->tiles++;
+        w->pixels += (long) t->width * t->height;
+    }
+    if (c->stats) {
+        c->stats->primary += result.rays.primary;
+        c->stats->reflection += result.rays.reflection;
+        c->stats->refraction += result.rays.refraction;
+        c->stats->shadow += result.rays.shadow;
+    }
+}
+
+static void report(const coordinator *c, double seconds)
+{
+    double busy_sum = 0, busy_max = 0;
+    long pixels_max = 0;
+    int lost = 0, served = 0;
+
+    if (!c->log)
+        return;
+    for (int i = 0; i < c->nworkers; i++) {
+        const remote_worker *w = &c->workers[i];
+        if (!w->tiles && !w->lost)
+            continue;
+        served++;
+        busy_sum += w->busy;
+        busy_max = w->busy > busy_max ? w->busy : busy_max;
+        pixels_max = w->pixels > pixels_max ? w->pixels : pixels_max;
+        lost += w->lost;
+        fprintf(c->log, "# Worker %d (%d threads): %d tiles, %.1f%% of the "
+                "image, busy %lf sec, %.0f pixels/s", w->number, w->threads,
+                w->tiles, 100.0 * w->pixels /
+                ((double) c->setup.width * c->setup.height), w->busy,
+                w->busy > 0 ? w->pixels / w->busy : 0.0);
+        if (w->lost)
+            fprintf(c->log, ", %d duplicate(s) beaten", w->lost);
+        fprintf(c->log, "\n");
+    }
+    fprintf(c->log, "# Cluster: %d tiles on %d worker(s) in %lf sec, "
+            "%d taken back from lost workers, %d duplicate(s) wasted\n",
+            c->ntiles, served, seconds, c->handed_again, lost);
+    if (served)
+        fprintf(c->log, "# Load balance: busy max/mean %.2f, pixels "
+                "max/mean %.2f\n", busy_max / (busy_sum / served),
+                pixels_max / ((double) c->setup.width * c->setup.height /
+                              served));
+}
+
+/* start the local workers as children of the coordinator
+ * @return 0 on success, -1 if fork failed
+ */
+static int fork_workers(const char *address, const scene *scn,
+                        const render_options *options, int n, pid_t *pids)
+{
+    render_options local = *options;
+
+    local.nthreads = options->nthreads / n > 1 ? options->nthreads / n : 1;
+    local.tile_size = CLUSTER_SUBTILE_SIZE;
+    local.stats = NULL;
+    local.counters = NULL;
+
+    /* or the children write out whatever is buffered again */
+    fflush(NULL);
+    for (int i = 0; i < n; i++) {
+        pids[i] = fork();
+        if (pids[i] < 0) {
+            perror("fork");
+            return -1;
+        }
+        if (!pids[i])
+            _exit(cluster_work(address, scn, &local, NULL) < 0 ? 1 : 0);
+    }
+    return 0;
+}
+
+static void reap_workers(pid_t *pids, int n, int kill_them)
+{
+    for (int i = 0; i < n; i++) {
+        if (pids[i] <= 0)
+            continue;
+        if (kill_them)
+            kill(pids[i], SIGTERM);
+        waitpid(pids[i], NULL, 0);
+    }
+}
+
+int cluster_coordinate(uint8_t *pixels, color background_color,
+                       const scene *scn, const viewpoint *view,
+                       int width, int height,
+                       const render_options *options,
+                       const cluster_options *cluster)
+{
+    coordinator *c = calloc(1, sizeof(coordinator));
+    tile *tiles = NULL;
+    pid_t *pids = NULL;
+    int ret = -1, listen_fd;
+    int tile_size = cluster->tile_size > 0 ?
+                    cluster->tile_size : CLUSTER_TILE_SIZE;
+
+    if (!c)
+        return -1;
+    c->ntiles = tile_split(&tiles, width, height, tile_size);
+    c->tiles = tiles;
+    c->remaining = c->ntiles;
+    c->state = calloc(c->ntiles, sizeof(tile_state));
+    c->buffer = malloc((size_t) tile_size * tile_size * 3);
+    c->pixels = pixels;
+    c->stats = options->stats;
+    c->log = cluster->log;
+    if (cluster->local_workers > 0)
+        pids = calloc(cluster->local_workers, sizeof(pid_t));
+    if (!c->ntiles || !c->state || !c->buffer ||
+            (cluster->local_workers > 0 && !pids)) {
+        fprintf(stderr, "out of memory\n");
+        goto out;
+    }
+
+    hello_init(&c->expected, scn, 0);
+    c->setup.view = *view;
+    COPY_COLOR(c->setup.background, background_color);
+    c->setup.width = width;
+    c->setup.height = height;
+    c->setup.max_samples = options->max_samples;
+    c->setup.contrast = options->contrast;
+    c->setup.max_bounces = options->max_bounces;
+    c->setup.min_weight = options->min_weight;
+    c->setup.roulette = options->roulette;
+    c->setup.light_cutoff = options->light_cutoff;
+    c->setup.light_samples = options->light_samples;
+
+    if ((listen_fd = listen_on(cluster->address, CLUSTER_MAX_WORKERS)) < 0)
+        goto out;
+    if (c->log)
+        fprintf(c->log, "# Coordinating %d tiles of %dx%d on %s\n",
+                c->ntiles, tile_size, tile_size, cluster->address);
+    if (cluster->local_workers > 0 &&
+            fork_workers(cluster->address, scn, options,
+                         cluster->local_workers, pids) < 0)
+        goto done;
+
+    double start = monotonic_seconds(), alone_since = start;
+    while (c->remaining) {
+        struct pollfd fds[2 * CLUSTER_MAX_WORKERS + 1];
+        remote_worker *polled[CLUSTER_MAX_WORKERS];
+        int nfds = 1;
+
+        fds[0].fd = listen_fd;
+        /* no room for another: leave it in the backlog */
+        fds[0].events = c->npending < CLUSTER_MAX_WORKERS ? POLLIN : 0;
+        for (int i = 0; i < c->nworkers; i++) {
+            if (c->workers[i].fd < 0)
+                continue;
+            polled[nfds - 1] = &c->workers[i];
+            fds[nfds].fd = c->workers[i].fd;
+            fds[nfds].events = POLLIN;
+            nfds++;
+        }
+        int first_pending = nfds;
+        for (int i = 0; i < c->npending; i++) {
+            fds[nfds].fd = c->pending[i].fd;
+            fds[nfds].events = POLLIN;
+            nfds++;
+        }
+        if (poll(fds, nfds, 1000) < 0 && errno != EINTR) {
+            perror("poll");
+            goto done;
+        }
+
+        double now = monotonic_seconds();
+        for (int i = 1; i < first_pending; i++)
+            if (fds[i].revents)
+                receive_result(c, polled[i - 1], now);
+        /* backwards, as a settled one is replaced by the last */
+        for (int i = c->npending - 1; i >= 0; i--) {
+            pending_worker *p = &c->pending[i];
+            int settled = fds[first_pending + i].revents ?
+                          greet_worker(c, p) : 0;
+            if (!settled && now - p->since > CLUSTER_TIMEOUT) {
+                if (c->log)
+                    fprintf(c->log, "# Refused a worker: no hello\n");
+                close(p->fd);
+                settled = 1;
+            }
+            if (settled)
+                *p = c->pending[--c->npending];
+        }
+        if (fds[0].revents & POLLIN)
+            accept_worker(c, listen_fd, now);
+
+        for (int i = 0; i < c->nworkers; i++) {
+            remote_worker *w = &c->workers[i];
+            if (w->fd >= 0 && w->ninflight &&
+                    now - w->last_heard > CLUSTER_TIMEOUT)
+                drop_worker(c, w, "timed out");
+            fill_worker(c, w, now);
+        }
+        if (c->connected)
+            alone_since = now;
+        else if (now - alone_since > CLUSTER_TIMEOUT) {
+            fprintf(stderr, "%s: no workers left, %d tiles unrendered\n",
+                    cluster->address, c->remaining);
+            goto done;
+        }
+    }
+    ret = 0;
+    report(c, monotonic_seconds() - start);
+
+done:
+    for (int i = 0; i < c->nworkers; i++) {
+        if (c->workers[i].fd < 0)
+            continue;
+        if (!ret)
+            send_message(c->workers[i].fd, MSG_DONE, NULL, 0, NULL, 0);
+        close(c->workers[i].fd);
+    }
+    for (int i = 0; i < c->npending; i++)
+        close(c->pending[i].fd);
+    close(listen_fd);
+    if (!strncmp(cluster->address, "unix:", 5))
+        unlink(cluster->address + 5);
+    if (pids)
+        reap_workers(pids, cluster->local_workers, ret < 0);
+out:
+    free(pids);
+    free(c->buffer);
+    free(c->state);
+    free(tiles);
+    free(c);
+    return ret;
+}
@@ -0,0 +1,61 @@
+#ifndef __RAY_CLUSTER_H
+#define __RAY_CLUSTER_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "raytracing.h"
+
+/* Rendering over several processes. A coordinator listens on an address,
+ * either unix:PATH or [HOST]:PORT, and worker processes that loaded the
+ * same scene connect to it. The coordinator sends them the camera and
+ * render settings, then tiles, a few at a time so that none sits idle
+ * waiting for the next, and copies the pixels that come back into the
+ * image. Workers say they are busy every few seconds while rendering a
+ * tile, so tiles of a worker that disconnects or stays silent for
+ * CLUSTER_TIMEOUT are handed out again; once no tile is left unassigned,
+ * idle workers also get copies of tiles still out on slower ones and the
+ * first result wins. The image is the one raytracing() renders.
+ *
+ * Messages are raw structs, so every process must be the same build on
+ * machines of the same byte order, as for binary scenes.
+ */
+
+/* seconds without a message before a busy worker is given up on, before
+ * a connection that has not said hello is closed, and before a
+ * coordinator with work left and no workers gives up
+ */
+#define CLUSTER_TIMEOUT 30.0
+
+/* default edge of the tiles handed out, and of the pieces a worker
+ * splits them into for its threads
+ */
+#define CLUSTER_TILE_SIZE 64
+#define CLUSTER_SUBTILE_SIZE 16
+
+typedef struct {
+    const char *address;
+    int local_workers; /**< worker processes to fork on this machine */
+    int tile_size;     /**< edge of the tiles handed out */
+    FILE *log;         /**< per-worker throughput and load balance */
+} cluster_options;
+
+/* Render the image with whichever workers connect; options->nthreads
+ * is split between the local workers, which split their tiles into
+ * CLUSTER_SUBTILE_SIZE pieces.
+ * @return 0 on success, -1 on error (reported on stderr)
+ */
+int cluster_coordinate(uint8_t *pixels, color background_color,
+                       const scene *scn, const viewpoint *view,
+                       int width, int height,
+                       const render_options *options,
+                       const cluster_options *cluster);
+
+/* Connect to the coordinator at address, retrying for CLUSTER_TIMEOUT,
+ * and render the tiles it sends until it is done.
+ * @return 0 on success, -1 on error (reported on stderr)
+ */
+int cluster_work(const char *address, const scene *scn,
+                 const render_options *options, FILE *log);
+
+#endif
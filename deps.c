@@ -0,0 +1,184 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "deps.h"
+
+#define CELLS (DEPS_GRID_SIDE * DEPS_GRID_SIDE * DEPS_GRID_SIDE)
+
+/* bit of the rays that left the grid, after those of the cells */
+#define OUTSIDE CELLS
+
+static inline void set_bit(uint64_t *bits, int i)
+{
+    bits[i >> 6] |= (uint64_t) 1 << (i & 63);
+}
+
+static inline int cell_index(const int c[3])
+{
+    return (c[2] * DEPS_GRID_SIDE + c[1]) * DEPS_GRID_SIDE + c[0];
+}
+
+/* @return the cell along axis k holding coordinate p, clamped */
+static int cell_of(const tile_deps *d, int k, real p)
+{
+    real x = floor((p - d->bounds.min[k]) * d->inv_cell[k]);
+    if (!(x >= 0))
+        return 0;
+    return x >= DEPS_GRID_SIDE - 1 ? DEPS_GRID_SIDE - 1 : (int) x;
+}
+
+int deps_init(tile_deps *d, const aabb *bounds, int width, int height,
+              int tile_size)
+{
+    real extent = 0;
+
+    memset(d, 0, sizeof(*d));
+    d->width = width;
+    d->height = height;
+    d->tile_size = tile_size;
+    d->cols = (width + tile_size - 1) / tile_size;
+    d->rows = (height + tile_size - 1) / tile_size;
+    for (int k = 0; k < 3; k++)
+        extent = fmax(extent, bounds->max[k] - bounds->min[k]);
+    /* pad the bounds so that flat scenes get cells of some depth */
+    real pad = extent * 1e-3 + 1e-6;
+    for (int k = 0; k < 3; k++) {
+        d->bounds.min[k] = bounds->min[k] - pad;
+        d->bounds.max[k] = bounds->max[k] + pad;
+        d->inv_cell[k] = DEPS_GRID_SIDE /
+                         (d->bounds.max[k] - d->bounds.min[k]);
+    }
+    d->words = (CELLS + 1 + 63) / 64;
+    d->bits = calloc((size_t) d->cols * d->rows * d->words,
+                     sizeof(uint64_t));
+    return d->bits ? 0 : -1;
+}
+
+uint64_t *deps_tile_begin(tile_deps *d, int x, int y)
+{
+    int tile = (y / d->tile_size) * d->cols + x / d->tile_size;
+    uint64_t *bits = d->bits + (size_t) tile * d->words;
+
+    memset(bits, 0, sizeof(uint64_t) * d->words);
+    return bits;
+}
+
+/* Mark the part of the segment inside the grid cell by cell, walking
+ * from one cell boundary to the next (Amanatides and Woo).
+ */
+void deps_mark(const tile_deps *d, uint64_t *bits, const point3 a,
+               const point3 b)
+{
+    real t0 = 0.0, t1 = 1.0;
+    point3 dir;
+
+    for (int k = 0; k < 3; k++) {
+        dir[k] = b[k] - a[k];
+        if (dir[k] == 0) {
+            if (a[k] < d->bounds.min[k] || a[k] > d->bounds.max[k])
+                t0 = INFINITY;
+            continue;
+        }
+        real ta = (d->bounds.min[k] - a[k]) / dir[k];
+        real tb = (d->bounds.max[k] - a[k]) / dir[k];
+        t0 = fmax(t0, fmin(ta, tb));
+        t1 = fmin(t1, fmax(ta, tb));
+    }
+    if (t0 > 0.0 || t1 < 1.0)
+        set_bit(bits, OUTSIDE);
+    if (t0 > t1)
+        return;
+
+    static const int stride[3] = {
+        1, DEPS_GRID_SIDE, DEPS_GRID_SIDE * DEPS_GRID_SIDE
+    };
+    int c[3], last[3], step[3], jump[3];
+    real next[3], delta[3];
+    for (int k = 0; k < 3; k++) {
+        c[k] = cell_of(d, k, a[k] + t0 * dir[k]);
+        last[k] = cell_of(d, k, a[k] + t1 * dir[k]);
+        step[k] = dir[k] > 0 ? 1 : dir[k] < 0 ? -1 : 0;
+        jump[k] = step[k] * stride[k];
+        if (!step[k]) {
+            next[k] = delta[k] = INFINITY;
+            continue;
+        }
+        real edge = d->bounds.min[k] +
+                    (c[k] + (step[k] > 0)) / d->inv_cell[k];
+        next[k] = (edge - a[k]) / dir[k];
+        delta[k] = step[k] / (d->inv_cell[k] * dir[k]);
+    }
+
+    /* the hot loop of -I: step the index of the cell along with c, and
+     * stop on reaching last, as each axis only moves toward it
+     */
+    int i = cell_index(c), end = cell_index(last);
+    for (;;) {
+        bits[i >> 6] |= (uint64_t) 1 << (i & 63);
+        if (i == end)
+            return;
+        int k = next[0] < next[1] ? (next[0] < next[2] ? 0 : 2) :
+                                    (next[1] < next[2] ? 1 : 2);
+        if (next[k] > t1)
+            break;
+        c[k] += step[k];
+        if (c[k] < 0 || c[k] >= DEPS_GRID_SIDE)
+            break;
+        i += jump[k];
+        next[k] += delta[k];
+    }
+    /* rounding may stop the walk a cell short */
+    set_bit(bits, end);
+}
+
+int deps_dirty(const tile_deps *d, const aabb *boxes, int nboxes,
+               char *dirty)
+{
+    uint64_t *mask = calloc(d->words, sizeof(uint64_t));
+    int n = 0;
+
+    if (!mask)
+        return -1;
+    for (int i = 0; i < nboxes; i++) {
+        const aabb *box = &boxes[i];
+        int lo[3], hi[3], inside = 1, c[3];
+        for (int k = 0; k < 3; k++) {
+            /* a hundredth of a cell for hits rounded onto the surface */
+            real margin = 0.01 / d->inv_cell[k];
+            real min = box->min[k] - margin, max = box->max[k] + margin;
+            if (min < d->bounds.min[k] || max > d->bounds.max[k])
+                set_bit(mask, OUTSIDE);
+            if (max < d->bounds.min[k] || min > d->bounds.max[k])
+                inside = 0;
+            lo[k] = cell_of(d, k, min);
+            hi[k] = cell_of(d, k, max);
+        }
+        if (!inside)
+            continue;
+        for (c[2] = lo[2]; c[2] <= hi[2]; c[2]++)
+            for (c[1] = lo[1]; c[1] <= hi[1]; c[1]++)
+                for (c[0] = lo[0]; c[0] <= hi[0]; c[0]++)
+                    set_bit(mask, cell_index(c));
+    }
+
+    for (int t = 0; t < d->cols * d->rows; t++) {
+        const uint64_t *bits = d->bits + (size_t) t * d->words;
+        dirty[t] = 0;
+        for (int w = 0; w < d->words && !dirty[t]; w++)
+            dirty[t] = (bits[w] & mask[w]) != 0;
+        n += dirty[t];
+    }
+    free(mask);
+    return n;
+}
+
+size_t deps_size(const tile_deps *d)
+{
+    return (size_t) d->cols * d->rows * d->words * sizeof(uint64_t);
+}
+
+void deps_free(tile_deps *d)
+{
+    free(d->bits);
+    d->bits = NULL;
+}
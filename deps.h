@@ -0,0 +1,51 @@
+#ifndef __RAY_DEPS_H
+#define __RAY_DEPS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bvh.h"
+
+/* cells along each axis of the grid rays are tracked in */
+#define DEPS_GRID_SIDE 32
+
+/* What the pixels of each tile of an image depend on: the cells of a
+ * coarse grid over the scene that the tile's rays passed through, each
+ * ray up to where it stopped, plus one bit for rays that left the grid.
+ * Primary, reflection, refraction and shadow rays all count, so an
+ * object can only change a tile whose rays crossed its bounds.
+ */
+typedef struct {
+    int width, height, tile_size;
+    int cols, rows;        /**< tiles across and down */
+    aabb bounds;           /**< of the grid */
+    point3 inv_cell;       /**< cells per unit length, by axis */
+    int words;             /**< 64-bit words per tile */
+    uint64_t *bits;        /**< per tile, row-major */
+} tile_deps;
+
+/* @return 0 on success, -1 when out of memory */
+int deps_init(tile_deps *d, const aabb *bounds, int width, int height,
+              int tile_size);
+
+/* @return the bits of the tile whose top left pixel is (x, y), cleared */
+uint64_t *deps_tile_begin(tile_deps *d, int x, int y);
+
+/* note that a ray went from a to b in a tile with these bits */
+void deps_mark(const tile_deps *d, uint64_t *bits, const point3 a,
+               const point3 b);
+
+/* Flag the tiles whose rays crossed any of the boxes, such as the
+ * bounds of objects before and after an edit.
+ * @param dirty one per tile, set to 0 or 1
+ * @return number of tiles flagged, -1 when out of memory
+ */
+int deps_dirty(const tile_deps *d, const aabb *boxes, int nboxes,
+               char *dirty);
+
+/* @return bytes held by d */
+size_t deps_size(const tile_deps *d);
+
+void deps_free(tile_deps *d);
+
+#endif
@@ -0,0 +1,89 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "heatmap.h"
+
+static const char *metric_names[] = { "rays", "tests", "cycles" };
+
+/* colours the scale runs through, evenly spaced */
+static const uint8_t ramp[][3] = {
+    { 0, 0, 0 }, { 0, 0, 255 }, { 255, 0, 0 }, { 255, 255, 0 },
+    { 255, 255, 255 },
+};
+
+#define RAMP_STEPS (sizeof(ramp) / sizeof(ramp[0]) - 1)
+
+const char *heat_metric_name(heat_metric metric)
+{
+    return metric_names[metric];
+}
+
+int heat_metric_parse(const char *name)
+{
+    for (int i = 0; i <= HEAT_CYCLES; i++)
+        if (!strcmp(name, metric_names[i]))
+            return i;
+    return -1;
+}
+
+static uint64_t metric_of(const pixel_cost *c, heat_metric metric)
+{
+    return metric == HEAT_RAYS ? c->rays :
+           metric == HEAT_TESTS ? c->tests : c->cycles;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+int heatmap_write(FILE *out, const pixel_cost *costs, int width,
+                  int height, heat_metric metric)
+{
+    size_t n = (size_t) width * height;
+    uint64_t *sorted = malloc(sizeof(uint64_t) * n);
+    uint8_t *row = malloc((size_t) width * 3);
+
+    if (!sorted || !row) {
+        free(sorted);
+        free(row);
+        return -1;
+    }
+    for (size_t k = 0; k < n; k++)
+        sorted[k] = metric_of(&costs[k], metric);
+    qsort(sorted, n, sizeof(uint64_t), compare_u64);
+    uint64_t top = n ? sorted[(n - 1) * 99 / 100] : 0;
+    free(sorted);
+
+    fprintf(out, "P6\n%d %d\n%d\n", width, height, 255);
+    for (int j = 0; j < height; j++) {
+        for (int i = 0; i < width; i++) {
+            uint64_t v = metric_of(&costs[(size_t) j * width + i], metric);
+            double x = top ? (double) (v < top ? v : top) / top : 0.0;
+            int step = x * RAMP_STEPS;
+            if (step == RAMP_STEPS)
+                step--;
+            double f = x * RAMP_STEPS - step;
+            for (int k = 0; k < 3; k++)
+                row[i * 3 + k] = ramp[step][k] +
+                                 f * (ramp[step + 1][k] - ramp[step][k]);
+        }
+        fwrite(row, 1, (size_t) width * 3, out);
+    }
+    free(row);
+    return 0;
+}
+
+void heatmap_write_data(FILE *out, const pixel_cost *costs, int width,
+                        int height)
+{
+    fprintf(out, "# x y rays tests cycles\n");
+    for (int j = 0; j < height; j++)
+        for (int i = 0; i < width; i++) {
+            const pixel_cost *c = &costs[(size_t) j * width + i];
+            fprintf(out, "%d %d %u %u %llu\n", i, j, c->rays, c->tests,
+                    (unsigned long long) c->cycles);
+        }
+}
@@ -0,0 +1,36 @@
+#ifndef __RAY_HEATMAP_H
+#define __RAY_HEATMAP_H
+
+#include <stdio.h>
+
+#include "raytracing.h"
+
+/* False-colour pictures of what each pixel cost to render, from black
+ * through blue, red and yellow to white, to find the expensive parts of
+ * a scene. The scale ends at the 99th percentile of the metric, so a
+ * few pixels held up by the system do not wash out the rest; pixels
+ * above it are white.
+ */
+
+typedef enum {
+    HEAT_RAYS,
+    HEAT_TESTS,  /**< needs a build with RAY_STATS */
+    HEAT_CYCLES,
+} heat_metric;
+
+const char *heat_metric_name(heat_metric metric);
+
+/* @return the metric called name, -1 if there is none */
+int heat_metric_parse(const char *name);
+
+/* write the costs of a width x height image as a PPM heatmap of metric
+ * @return 0 on success, -1 when out of memory
+ */
+int heatmap_write(FILE *out, const pixel_cost *costs, int width,
+                  int height, heat_metric metric);
+
+/* write the costs as text, a line of x y rays tests cycles per pixel */
+void heatmap_write_data(FILE *out, const pixel_cost *costs, int width,
+                        int height);
+
+#endif
@@ -1,48 +1,34 @@
 #ifndef _RAY_IDX_STACK_H
 #define _RAY_IDX_STACK_H
 
-#define MAX_STACK_SIZE 16
-
-typedef struct {
-    double idx;
-    void *obj;
+/* Media a ray is inside, innermost on top. An element lives in the hit
+ * of the ray tree that entered the medium and points at the ones below,
+ * so both branches of a hit share their parent's stack without copying
+ * it, and it grows with the bounce limit instead of overflowing.
+ */
+typedef struct idx_stack_element {
+    real idx;
+    int obj; /**< primitive id of the medium, -1 for air */
+    const struct idx_stack_element *below;
 } idx_stack_element;
 
-#define AIR_ELEMENT (idx_stack_element) { .obj = NULL, .idx = 1.0 }
-
-typedef struct {
-    idx_stack_element data[MAX_STACK_SIZE];
-    int top;
-} idx_stack;
-
-static inline void idx_stack_init(idx_stack *stk)
-{
-    stk->top = 0;
-}
-
-static inline void idx_stack_push(idx_stack *stk, idx_stack_element element)
-{
-    if (stk->top < MAX_STACK_SIZE)
-        stk->data[stk->top++] = element;
-}
-
-static inline int idx_stack_empty(idx_stack *stk)
-{
-    return !stk->top;
-}
+static const idx_stack_element idx_stack_air = {
+    .idx = 1.0, .obj = -1, .below = NULL
+};
 
-static inline idx_stack_element idx_stack_pop(idx_stack *stk)
+/* @param element storage for the new top, outliving the stacks on it */
+static inline const idx_stack_element *
+idx_stack_push(const idx_stack_element *top, idx_stack_element *element)
 {
-    if (!idx_stack_empty(stk))
-        return stk->data[--stk->top];
-    return AIR_ELEMENT;
+    element->below = top;
+    return element;
 }
 
-static inline idx_stack_element idx_stack_top(idx_stack *stk)
+/* air stays at the bottom */
+static inline const idx_stack_element *
+idx_stack_pop(const idx_stack_element *top)
 {
-    if (!idx_stack_empty(stk))
-        return stk->data[stk->top-1];
-    return AIR_ELEMENT;
+    return top->below ? top->below : top;
 }
 
 #endif
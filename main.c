@@ -1,21 +1,34 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "primitives.h"
 #include "raytracing.h"
+#include "scene_io.h"
+#include "ppm_stream.h"
+#include "cluster.h"
+#include "server.h"
+#include "heatmap.h"
 
 #define OUT_FILENAME "out.ppm"
 
 #define ROWS 512
 #define COLS 512
 
-static void write_to_ppm(FILE *outfile, uint8_t *pixels,
+/* band buffers in flight when streaming */
+#define STREAM_BANDS 4
+
+/* frame buffers of an animation: one written while the next renders */
+#define ANIMATION_BUFFERS 2
+
+static void write_to_ppm(FILE *outfile, const uint8_t *pixels,
                          int width, int height)
 {
     fprintf(outfile, "P6\n%d %d\n%d\n", width, height, 255);
-    fwrite(pixels, 1, height * width * 3, outfile);
+    fwrite(pixels, 1, (size_t) height * width * 3, outfile);
 }
 
 static double diff_in_second(struct timespec t1, struct timespec t2)
@@ -31,38 +44,749 @@ static double diff_in_second(struct timespec t1, struct timespec t2)
     return (diff.tv_sec + diff.tv_nsec / 1000000000.0);
 }
 
-int main()
+/* where the passes of a progressive render go */
+typedef struct {
+    FILE *out, *log;
+    int width, height;
+    struct timespec start;
+} preview_output;
+
+static void write_pass(const uint8_t *pixels, int pass, int block,
+                       int final, void *arg)
+{
+    preview_output *p = arg;
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    fprintf(p->log, "# Pass %d: %s, %lf sec\n", pass + 1,
+            final ? "full resolution" : block == 8 ? "8x8 blocks" :
+            block == 4 ? "4x4 blocks" : "2x2 blocks",
+            diff_in_second(p->start, now));
+    if (final)
+        return;
+    /* overwrite the previous pass in place; a pipe gets one image after
+     * another
+     */
+    fseek(p->out, 0, SEEK_SET);
+    write_to_ppm(p->out, pixels, p->width, p->height);
+    fflush(p->out);
+}
+
+/* Write the costs next to the image at out_path, as NAME-heat.ppm for
+ * metric and NAME-heat.txt, NAME being out_path less any .ppm suffix.
+ * @return 0 on success, -1 on error (reported on stderr)
+ */
+static int write_heatmap(const char *out_path, const pixel_cost *costs,
+                         int width, int height, heat_metric metric,
+                         FILE *log)
 {
-    uint8_t *pixels;
+    size_t len = strlen(out_path);
+    char *path = malloc(len + sizeof("-heat.ppm"));
+    int ret = 0;
+    FILE *f;
+
+    if (!path)
+        return -1;
+    if (len >= 4 && !strcmp(out_path + len - 4, ".ppm"))
+        len -= 4;
+    memcpy(path, out_path, len);
+
+    strcpy(path + len, "-heat.ppm");
+    if (!(f = fopen(path, "wb"))) {
+        perror(path);
+        free(path);
+        return -1;
+    }
+    if (heatmap_write(f, costs, width, height, metric) < 0) {
+        fprintf(stderr, "out of memory\n");
+        ret = -1;
+    }
+    fclose(f);
+    if (!ret)
+        fprintf(log, "# Heatmap of %s per pixel in %s\n",
+                heat_metric_name(metric), path);
+
+    strcpy(path + len, "-heat.txt");
+    if (!ret && !(f = fopen(path, "w"))) {
+        perror(path);
+        ret = -1;
+    } else if (!ret) {
+        heatmap_write_data(f, costs, width, height);
+        fclose(f);
+    }
+    free(path);
+    return ret;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-s scene] [-r WxH] [-o file] [-S] [-t threads] "
+            "[-T tile_size] [-O order] [-P isa] [-F] [-A max_samples] "
+            "[-c contrast] [-B bounces] [-w weight] [-R] [-l cutoff] "
+            "[-k lights] [-p budget] [-a animation] [-I] [-n frames] "
+            "[-D address] [-L workers] [-W address] [-X address] "
+            "[-G lights] [-H metric] [-J file]\n"
+            "  -s scene      text or binary scene file loaded at run time "
+            "(default: built-in models.inc)\n"
+            "  -r WxH        resolution (default: %dx%d)\n"
+            "  -o file       output PPM, - for stdout (default: %s); "
+            "for animations a\n"
+            "                printf pattern such as frame%%04d.ppm gives "
+            "a file per frame\n"
+            "  -S            stream rows to the output while rendering "
+            "instead of keeping the whole image\n"
+            "  -t threads    worker threads, 1 renders serially "
+            "(default: online CPUs)\n"
+            "  -T tile_size  tile edge in pixels (default: %d)\n"
+            "  -O order      tiles and the pixels in them: scanline "
+            "(default), tiles,\n"
+            "                morton or hilbert\n"
+            "  -P isa        primary ray packets: off, scalar, sse2, avx2 "
+            "or auto (default)\n"
+            "  -F            wavefront: trace and shade a generation of rays "
+            "of a batch of\n"
+            "                pixels at a time; the same image, not with "
+            "-A, -R, -k or -H\n"
+            "  -A samples    adaptive anti-aliasing with up to this many "
+            "samples per pixel\n"
+            "                (default: a fixed grid of 4)\n"
+            "  -c contrast   channel difference, 0 to 1, that makes "
+            "adaptive sampling refine\n"
+            "                (default: %g)\n"
+            "  -B bounces    depth of the tree of reflection and refraction "
+            "rays (default: %d)\n"
+            "  -w weight     drop secondary rays contributing less than "
+            "this to their sample\n"
+            "  -R            drop them by Russian roulette instead, "
+            "keeping the image unbiased\n"
+            "  -l cutoff     many-light mode: lights fall off with distance "
+            "squared and are\n"
+            "                skipped where they fall below cutoff, e.g. "
+            "0.01\n"
+            "  -k lights     many-light mode: shade this many lights per "
+            "hit, picked by\n"
+            "                contribution\n"
+            "  -p budget     render progressively, writing every pass, "
+            "and stop after\n"
+            "                budget seconds (0: no limit)\n"
+            "  -a animation  render the keyframes and motions of this "
+            "file, writing each\n"
+            "                frame while the next one renders\n"
+            "  -I            with -a, while the camera holds still render "
+            "again only the\n"
+            "                tiles whose rays crossed a moving object\n"
+            "  -n frames     number of frames to render (default: up to "
+            "the last keyframe)\n"
+            "  -D address    coordinate worker processes listening on "
+            "unix:PATH or [HOST]:PORT,\n"
+            "                handing out tiles of -T pixels (default: %d)\n"
+            "  -L workers    with -D, fork this many local workers sharing "
+            "the threads\n"
+            "  -W address    render tiles for the coordinator at address, "
+            "which sets the\n"
+            "                resolution and rendering options\n"
+            "  -X address    keep the scene loaded and serve render requests "
+            "on address\n"
+            "                until interrupted\n"
+            "  -G lights     render keeping the primary hits, then shade "
+            "them again with\n"
+            "                the lights of this file and write that image\n"
+            "  -H metric     also write what each pixel cost, rays, tests "
+            "or cycles, as a\n"
+            "                false-colour PPM next to the output, "
+            "NAME-heat.ppm, and all three\n"
+            "                as text in NAME-heat.txt; tests need a STATS "
+            "build\n"
+            "  -J file       write ray counts and, in STATS builds, the "
+            "hot-path counters as JSON\n",
+            prog, ROWS, COLS, OUT_FILENAME, DEFAULT_TILE_SIZE,
+            DEFAULT_CONTRAST, MAX_REFLECTION_BOUNCES, CLUSTER_TILE_SIZE);
+}
+
+int main(int argc, char *argv[])
+{
+    uint8_t *pixels = NULL;
     light_node lights = NULL;
     rectangular_node rectangulars = NULL;
     sphere_node spheres = NULL;
     color background = { 0.0, 0.1, 0.1 };
     struct timespec start, end;
+    render_options options = {
+        .nthreads = sysconf(_SC_NPROCESSORS_ONLN),
+        .packets = PACKET_AUTO,
+    };
+    ray_stats rays = { 0 };
+    render_counters counters = { { 0 } };
+    const char *json_path = NULL;
+    const char *scene_path = NULL;
+    const char *anim_path = NULL;
+    const char *out_path = OUT_FILENAME;
+    const char *work_address = NULL;
+    const char *serve_address = NULL;
+    const char *relight_path = NULL;
+    light_node relit = NULL; /* the lights of relight_path */
+    int heat = -1; /* metric of the heatmap, -1 for none */
+    cluster_options cluster = { 0 };
+    int width = ROWS, height = COLS;
+    int streaming = 0;
+    int incremental = 0;
+    int frames = 0; /* 0: up to the last keyframe */
+    animation anim = { 0 };
+    double budget = -1.0; /* negative: not progressive */
+    FILE *outfile, *log = stdout;
+    scene scn;
+    viewpoint camera;
+    struct timespec load_start, load_end;
+    int opt, order, packets;
 
+    while ((opt = getopt(argc, argv, "s:r:o:St:T:O:P:FA:c:B:w:Rl:k:"
+                         "p:a:In:D:L:W:X:G:H:J:h")) != -1) {
+        switch (opt) {
+        case 's':
+            scene_path = optarg;
+            break;
+        case 'r':
+            if (sscanf(optarg, "%dx%d", &width, &height) != 2 ||
+                    width < 2 || height < 2) {
+                fprintf(stderr, "bad resolution %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'o':
+            out_path = optarg;
+            break;
+        case 'S':
+            streaming = 1;
+            break;
+        case 't':
+            options.nthreads = atoi(optarg);
+            break;
+        case 'T':
+            options.tile_size = atoi(optarg);
+            break;
+        case 'O':
+            if ((order = traversal_order_parse(optarg)) < 0) {
+                fprintf(stderr, "unknown traversal order %s\n", optarg);
+                return -1;
+            }
+            options.order = order;
+            break;
+        case 'P':
+            if ((packets = packet_isa_parse(optarg)) < 0) {
+                fprintf(stderr, "unknown packet isa %s\n", optarg);
+                return -1;
+            }
+            options.packets = packets;
+            break;
+        case 'F':
+            options.wavefront = 1;
+            break;
+        case 'A':
+            options.max_samples = atoi(optarg);
+            break;
+        case 'c':
+            options.contrast = atof(optarg);
+            break;
+        case 'B':
+            options.max_bounces = atoi(optarg);
+            break;
+        case 'w':
+            options.min_weight = atof(optarg);
+            break;
+        case 'R':
+            options.roulette = 1;
+            break;
+        case 'l':
+            options.light_cutoff = atof(optarg);
+            break;
+        case 'k':
+            options.light_samples = atoi(optarg);
+            break;
+        case 'p':
+            budget = atof(optarg);
+            break;
+        case 'a':
+            anim_path = optarg;
+            break;
+        case 'I':
+            incremental = 1;
+            break;
+        case 'n':
+            frames = atoi(optarg);
+            if (frames < 1) {
+                fprintf(stderr, "bad frame count %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'D':
+            cluster.address = optarg;
+            break;
+        case 'L':
+            cluster.local_workers = atoi(optarg);
+            break;
+        case 'W':
+            work_address = optarg;
+            break;
+        case 'X':
+            serve_address = optarg;
+            break;
+        case 'G':
+            relight_path = optarg;
+            break;
+        case 'H':
+            if ((heat = heat_metric_parse(optarg)) < 0) {
+                fprintf(stderr, "unknown heatmap metric %s\n", optarg);
+                return -1;
+            }
+            if (heat == HEAT_TESTS && !RAY_STATS) {
+                fprintf(stderr, "-H tests needs a STATS build\n");
+                return -1;
+            }
+            break;
+        case 'J':
+            json_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : -1;
+        }
+    }
+    if (options.nthreads < 1)
+        options.nthreads = 1;
+    if (streaming && budget >= 0) {
+        fprintf(stderr, "-S and -p cannot be combined\n");
+        return -1;
+    }
+    if (anim_path && (streaming || budget >= 0)) {
+        fprintf(stderr, "-a cannot be combined with -S or -p\n");
+        return -1;
+    }
+    if ((cluster.address || work_address) &&
+            (streaming || budget >= 0 || anim_path)) {
+        fprintf(stderr, "-D and -W cannot be combined with -S, -p or -a\n");
+        return -1;
+    }
+    if (cluster.address && work_address) {
+        fprintf(stderr, "-D and -W cannot be combined\n");
+        return -1;
+    }
+    if (serve_address && (streaming || budget >= 0 || anim_path ||
+                          cluster.address || work_address)) {
+        fprintf(stderr, "-X cannot be combined with -S, -p, -a, -D or -W\n");
+        return -1;
+    }
+    if (relight_path && (streaming || budget >= 0 || anim_path ||
+                         cluster.address || work_address || serve_address ||
+                         options.max_samples > 0)) {
+        fprintf(stderr, "-G cannot be combined with -S, -p, -a, -D, -W, "
+                "-X or -A\n");
+        return -1;
+    }
+    if (options.wavefront && (options.max_samples > 0 || options.roulette ||
+                              options.light_samples > 0 || heat >= 0)) {
+        fprintf(stderr, "-F cannot be combined with -A, -R, -k or -H\n");
+        return -1;
+    }
+    if (heat >= 0 && (streaming || budget >= 0 || anim_path ||
+                      cluster.address || work_address || serve_address ||
+                      relight_path || !strcmp(out_path, "-"))) {
+        fprintf(stderr, "-H cannot be combined with -S, -p, -a, -D, -W, "
+                "-X, -G or -o -\n");
+        return -1;
+    }
+    if (incremental && !anim_path) {
+        fprintf(stderr, "-I needs -a\n");
+        return -1;
+    }
+    if (cluster.local_workers && !cluster.address) {
+        fprintf(stderr, "-L needs -D\n");
+        return -1;
+    }
+    if (anim_path) {
+        if (animation_load(&anim, anim_path) < 0)
+            return -1;
+        if (!frames)
+            frames = animation_frames(&anim);
+    } else
+        frames = 1;
+    if (relight_path && lights_load(&relit, relight_path) < 0)
+        return -1;
+    /* a coordinator hands out big tiles that workers split further */
+    cluster.tile_size = options.tile_size > 0 ?
+                        options.tile_size : CLUSTER_TILE_SIZE;
+    if (options.tile_size < 1)
+        options.tile_size = work_address ?
+                            CLUSTER_SUBTILE_SIZE : DEFAULT_TILE_SIZE;
+
+    clock_gettime(CLOCK_REALTIME, &load_start);
+    if (scene_path) {
+        memset(&camera, 0, sizeof(camera));
+        if (scene_load(&scn, &camera, scene_path) < 0)
+            exit(-1);
+    } else {
 #include "use-models.h"
+        camera = view;
 
-    /* allocate by the given resolution */
-    pixels = malloc(sizeof(unsigned char) * ROWS * COLS * 3);
-    if (!pixels) exit(-1);
-
-    printf("# Rendering scene\n");
-    /* do the ray tracing with the given geometry */
-    clock_gettime(CLOCK_REALTIME, &start);
-    raytracing(pixels, background,
-               rectangulars, spheres, lights, &view, ROWS, COLS);
-    clock_gettime(CLOCK_REALTIME, &end);
-    {
-        FILE *outfile = fopen(OUT_FILENAME, "wb");
-        write_to_ppm(outfile, pixels, ROWS, COLS);
-        fclose(outfile);
+        /* the lists are only the authoring format, render from packed
+         * arrays
+         */
+        if (scene_compile(&scn, lights, rectangulars, spheres, NULL) < 0)
+            exit(-1);
+        delete_rectangular_list(&rectangulars);
+        delete_sphere_list(&spheres);
+        delete_light_list(&lights);
+    }
+    clock_gettime(CLOCK_REALTIME, &load_end);
+    if (relight_path) {
+        int n = 0;
+        for (light_node l = relit; l; l = l->next)
+            n++;
+        if (n != scn.lights.count) {
+            fprintf(stderr, "%s: not as many lights as the scene\n",
+                    relight_path);
+            exit(-1);
+        }
+    }
+
+    /* per-frame files are opened by the stream */
+    const char *frame_pattern = anim_path && strchr(out_path, '%') ?
+                                out_path : NULL;
+    if (frame_pattern || work_address || serve_address) {
+        outfile = NULL;
+    } else if (!strcmp(out_path, "-")) {
+        /* the image goes to stdout, so keep it clean of messages */
+        outfile = stdout;
+        log = stderr;
+    } else if (!(outfile = fopen(out_path, "wb"))) {
+        perror(out_path);
+        return -1;
+    }
+    int triangles = 0;
+    for (int i = 0; i < scn.meshes.count; i++)
+        triangles += scn.meshes.items[i].ntriangles;
+    fprintf(log, "# Scene ready in %lf sec: %d lights, %d rectangulars, "
+           "%d spheres, %d meshes (%d triangles)\n",
+           diff_in_second(load_start, load_end), scn.lights.count,
+           scn.rectangulars.count, scn.spheres.count, scn.meshes.count,
+           triangles);
+
+    const bvh_stats *stats = &scn.accel.stats;
+    fprintf(log, "# BVH: %d primitives, %d nodes, %d leaves, depth %d, "
+           "built in %.3f ms\n", stats->primitives, stats->nodes,
+           stats->leaves, stats->depth, stats->build_ms);
+
+    if (work_address) {
+        /* the coordinator decides what gets rendered and writes it */
+        int ret = cluster_work(work_address, &scn, &options, log);
+        scene_free(&scn);
+        return ret;
+    }
+    if (serve_address) {
+        int ret = server_run(serve_address, background, &scn, &camera,
+                             width, height, &options, log);
+        scene_free(&scn);
+        return ret;
+    }
+
+    fprintf(log, "# Rendering %dx%d with %d thread(s), %s packets%s",
+            width, height, options.nthreads,
+            packet_isa_name(options.packets == PACKET_OFF ?
+                            PACKET_OFF : packet_select(options.packets)),
+            streaming ? ", streaming" : budget >= 0 ? ", progressive" :
+            cluster.address ? ", distributed" : "");
+    if (options.order != ORDER_SCANLINE)
+        fprintf(log, ", %s order", traversal_order_name(options.order));
+    if (options.wavefront)
+        fprintf(log, ", wavefront");
+    if (options.max_samples > 0)
+        fprintf(log, ", adaptive up to %d spp", options.max_samples);
+    if (options.max_bounces > 0)
+        fprintf(log, ", %d bounces", options.max_bounces);
+    if (options.min_weight > 0)
+        fprintf(log, ", %s below %g", options.roulette ? "roulette" :
+                "pruning", options.min_weight);
+    if (options.light_cutoff > 0 || options.light_samples > 0) {
+        fprintf(log, ", many lights");
+        if (options.light_cutoff > 0)
+            fprintf(log, " above %g", options.light_cutoff);
+        if (options.light_samples > 0)
+            fprintf(log, ", %d per hit", options.light_samples);
+    }
+    if (anim_path)
+        fprintf(log, ", %d frames", frames);
+    fprintf(log, "\n");
+
+    options.stats = &rays;
+    options.counters = &counters;
+    int ret = 0;
+    if (anim_path) {
+        /* one buffer is written out while the next frame renders into
+         * the other; the scene and its BVH are refitted in place
+         */
+        ppm_stream *stream = frame_pattern ?
+            ppm_stream_open_frames(frame_pattern, width, height, height,
+                                   ANIMATION_BUFFERS) :
+            ppm_stream_open(outfile, width, height, height,
+                            ANIMATION_BUFFERS);
+        if (!stream) exit(-1);
+
+        /* incremental: the last frame, where its tiles' rays went, and
+         * the bounds of each moving object before and after its step.
+         * Rays are only tracked through the box the objects move in, and
+         * only on frames the next one can update; the first frame is
+         * left untracked to compare the updates with.
+         */
+        size_t frame_size = (size_t) width * height * 3;
+        tile_deps deps = { .bits = NULL };
+        viewpoint tracked_view;
+        int ntiles = 0, redone = 0, nfull = 0, nupdates = 0, nplain = 0;
+        double full_trace = 0, update_trace = 0, plain_trace = 0;
+        aabb *changed = NULL, swept;
+        if (incremental) {
+            pixels = malloc(frame_size);
+            changed = malloc(sizeof(aabb) * 2 * (anim.nmotions + 1));
+            if (!pixels || !changed) exit(-1);
+            animation_swept(&anim, &scn, frames, &swept);
+        }
+
+        double setup = 0, trace = 0, stall = 0;
+        clock_gettime(CLOCK_REALTIME, &start);
+        for (int f = 0; f < frames && ret == 0; f++) {
+            struct timespec t0, t1, t2, t3;
+            int n = -1, track = 0;
+            clock_gettime(CLOCK_REALTIME, &t0);
+            uint8_t *frame_pixels = ppm_stream_acquire(stream);
+            clock_gettime(CLOCK_REALTIME, &t1);
+            animation_view(&anim, f, &camera);
+            for (int m = 0; incremental && m < anim.nmotions; m++) {
+                int id = anim.motions[m].object;
+                if (id >= 0 && id < scene_primitive_count(&scn))
+                    scene_primitive_bounds(&scn, id, &changed[2 * m]);
+            }
+            if (f > 0 && animation_step(&anim, &scn) < 0)
+                ret = -1;
+            for (int m = 0; incremental && ret == 0 &&
+                            m < anim.nmotions; m++)
+                scene_primitive_bounds(&scn, anim.motions[m].object,
+                                       &changed[2 * m + 1]);
+            if (incremental && nplain && f + 1 < frames) {
+                viewpoint next;
+                animation_view(&anim, f + 1, &next);
+                track = !memcmp(&next, &camera, sizeof(camera));
+            }
+            clock_gettime(CLOCK_REALTIME, &t2);
+            if (deps.bits &&
+                    !memcmp(&camera, &tracked_view, sizeof(camera))) {
+                n = raytracing_update(pixels, &deps, changed,
+                                      2 * anim.nmotions, background, &scn,
+                                      &camera, &options);
+                if (n < 0) exit(-1);
+                memcpy(frame_pixels, pixels, frame_size);
+            } else if (track) {
+                deps_free(&deps);
+                if (raytracing_track(pixels, &deps, background, &scn,
+                                     &camera, width, height, &swept,
+                                     &options) < 0)
+                    exit(-1);
+                tracked_view = camera;
+                ntiles = deps.cols * deps.rows;
+                memcpy(frame_pixels, pixels, frame_size);
+            } else {
+                /* pixels no longer hold the last frame */
+                deps_free(&deps);
+                if (raytracing(frame_pixels, background, &scn, &camera,
+                               width, height, &options) < 0)
+                    exit(-1);
+            }
+            clock_gettime(CLOCK_REALTIME, &t3);
+            ppm_stream_submit(stream, height);
+
+            stall += diff_in_second(t0, t1);
+            setup += diff_in_second(t1, t2);
+            trace += diff_in_second(t2, t3);
+            fprintf(log, "# Frame %d: setup %lf, trace %lf, output wait "
+                    "%lf sec", f, diff_in_second(t1, t2),
+                    diff_in_second(t2, t3), diff_in_second(t0, t1));
+            if (n >= 0) {
+                fprintf(log, ", %d of %d tiles", n, ntiles);
+                redone += n;
+                nupdates++;
+                update_trace += diff_in_second(t2, t3);
+            } else if (track) {
+                fprintf(log, ", all %d tiles tracked", ntiles);
+                nfull++;
+                full_trace += diff_in_second(t2, t3);
+            } else if (incremental) {
+                fprintf(log, ", untracked");
+                nplain++;
+                plain_trace += diff_in_second(t2, t3);
+            }
+            fprintf(log, "\n");
+        }
+        /* updates come after an untracked frame and a tracked one */
+        if (nupdates)
+            fprintf(log, "# Incremental frames: %d, %.1f%% of the tiles "
+                    "redone, trace %lf sec against %lf for an untracked "
+                    "full frame, %.2fx; tracked full frames %lf sec\n",
+                    nupdates, 100.0 * redone / ((double) ntiles * nupdates),
+                    update_trace / nupdates, plain_trace / nplain,
+                    (plain_trace / nplain) / (update_trace / nupdates),
+                    full_trace / nfull);
+        if (incremental)
+            fprintf(log, "# Ray tracking grid: %dx%dx%d cells, %.1f MiB\n",
+                    DEPS_GRID_SIDE, DEPS_GRID_SIDE, DEPS_GRID_SIDE,
+                    deps_size(&deps) / (1024.0 * 1024.0));
+        deps_free(&deps);
+        free(changed);
+        double write = ppm_stream_write_seconds(stream);
+        if (ppm_stream_close(stream) < 0)
+            ret = -1;
+        clock_gettime(CLOCK_REALTIME, &end);
+        fprintf(log, "# %d frames in %lf sec, %.2f fps; per frame: setup "
+                "%lf, trace %lf, write %lf, output wait %lf sec\n",
+                frames, diff_in_second(start, end),
+                frames / diff_in_second(start, end), setup / frames,
+                trace / frames, write / frames, stall / frames);
+    } else if (streaming) {
+        /* render band after band of rows while a thread writes them out,
+         * so memory stays bounded by STREAM_BANDS bands
+         */
+        int band = options.tile_size;
+        ppm_stream *stream = ppm_stream_open(outfile, width, height, band,
+                                             STREAM_BANDS);
+        if (!stream) exit(-1);
+
+        clock_gettime(CLOCK_REALTIME, &start);
+        for (int y = 0; y < height; y += band) {
+            int rows = (y + band > height) ? height - y : band;
+            uint8_t *rows_pixels = ppm_stream_acquire(stream);
+            if (raytracing_rows(rows_pixels, background, &scn, &camera,
+                                width, height, y, y + rows, &options) < 0)
+                exit(-1);
+            ppm_stream_submit(stream, rows);
+        }
+        ret = ppm_stream_close(stream);
+        clock_gettime(CLOCK_REALTIME, &end);
+    } else if (cluster.address) {
+        pixels = malloc(sizeof(unsigned char) * width * height * 3);
+        if (!pixels) exit(-1);
+
+        cluster.log = log;
+        clock_gettime(CLOCK_REALTIME, &start);
+        ret = cluster_coordinate(pixels, background, &scn, &camera, width,
+                                 height, &options, &cluster);
+        clock_gettime(CLOCK_REALTIME, &end);
+        if (ret == 0)
+            write_to_ppm(outfile, pixels, width, height);
+    } else if (budget >= 0) {
+        pixels = malloc(sizeof(unsigned char) * width * height * 3);
+        if (!pixels) exit(-1);
+
+        preview_output preview = {
+            .out = outfile, .log = log, .width = width, .height = height
+        };
+        progressive_options progressive = {
+            .budget = budget, .pass_done = write_pass, .arg = &preview
+        };
+        clock_gettime(CLOCK_REALTIME, &start);
+        preview.start = start;
+        int finished = raytracing_progressive(pixels, background, &scn,
+                                              &camera, width, height,
+                                              &options, &progressive);
+        if (finished < 0)
+            exit(-1);
+        if (!finished)
+            fprintf(log, "# Budget of %lf sec ran out, the image is "
+                    "a preview\n", budget);
+        clock_gettime(CLOCK_REALTIME, &end);
+        fseek(outfile, 0, SEEK_SET);
+        write_to_ppm(outfile, pixels, width, height);
+    } else if (relight_path) {
+        gbuffer gb;
+        pixels = malloc(sizeof(unsigned char) * width * height * 3);
+        if (!pixels) exit(-1);
+
+        clock_gettime(CLOCK_REALTIME, &start);
+        if (raytracing_record(pixels, &gb, background, &scn, &camera,
+                              width, height, &options) < 0) {
+            fprintf(stderr, "out of memory\n");
+            exit(-1);
+        }
+        clock_gettime(CLOCK_REALTIME, &end);
+        fprintf(log, "# Recorded the primary hits in %lf sec, "
+                "G-buffer of %.1f MiB\n", diff_in_second(start, end),
+                gbuffer_size(&gb) / (1024.0 * 1024.0));
+        /* counted against the scene's on loading */
+        scene_set_lights(&scn, relit);
+        delete_light_list(&relit);
+
+        clock_gettime(CLOCK_REALTIME, &start);
+        if (raytracing_relight(pixels, background, &scn, &gb,
+                               &options) < 0)
+            exit(-1);
+        clock_gettime(CLOCK_REALTIME, &end);
+        fprintf(log, "# Relit in %lf sec\n", diff_in_second(start, end));
+        write_to_ppm(outfile, pixels, width, height);
+        gbuffer_free(&gb);
+    } else {
+        /* allocate by the given resolution */
+        pixels = malloc(sizeof(unsigned char) * width * height * 3);
+        if (!pixels) exit(-1);
+
+        if (heat >= 0 && !(options.costs = calloc((size_t) width * height,
+                                                  sizeof(pixel_cost))))
+            exit(-1);
+
+        /* do the ray tracing with the given geometry */
+        clock_gettime(CLOCK_REALTIME, &start);
+        if (raytracing(pixels, background, &scn, &camera, width, height,
+                       &options) < 0)
+            exit(-1);
+        clock_gettime(CLOCK_REALTIME, &end);
+        write_to_ppm(outfile, pixels, width, height);
+        if (heat >= 0 && write_heatmap(out_path, options.costs, width,
+                                       height, heat, log) < 0)
+            ret = -1;
+        free(options.costs);
     }
+    if (outfile && outfile != stdout)
+        fclose(outfile);
 
-    delete_rectangular_list(&rectangulars);
-    delete_sphere_list(&spheres);
-    delete_light_list(&lights);
+    animation_free(&anim);
+    scene_free(&scn);
     free(pixels);
-    printf("Done!\n");
-    printf("Execution time of raytracing() : %lf sec\n", diff_in_second(start, end));
-    return 0;
+    fprintf(log, "# Rays: %llu primary, %llu reflection, %llu refraction, "
+            "%llu shadow\n", (unsigned long long) rays.primary,
+            (unsigned long long) rays.reflection,
+            (unsigned long long) rays.refraction,
+            (unsigned long long) rays.shadow);
+    /* adaptive tiles retrace a ring of pixels around them, so this is
+     * more than the samples kept
+     */
+    fprintf(log, "# Primary rays: %.2f per pixel\n",
+            (double) rays.primary / ((double) width * height * frames));
+    if (RAY_STATS)
+        stats_print(log, &counters);
+    if (json_path) {
+        FILE *json = fopen(json_path, "w");
+        if (!json) {
+            perror(json_path);
+            return -1;
+        }
+        fprintf(json, "{\"rays\": {\"primary\": %llu, \"reflection\": %llu, "
+                "\"refraction\": %llu, \"shadow\": %llu}, \"render_s\": %lf, "
+                "\"counters\": ", (unsigned long long) rays.primary,
+                (unsigned long long) rays.reflection,
+                (unsigned long long) rays.refraction,
+                (unsigned long long) rays.shadow,
+                diff_in_second(start, end));
+        stats_print_json(json, &counters);
+        fprintf(json, "}\n");
+        fclose(json);
+    }
+    fprintf(log, "Done!\n");
+    fprintf(log, "Execution time of raytracing() : %lf sec\n",
+            diff_in_second(start, end));
+    return ret;
 }
@@ -1,14 +1,16 @@
 #ifndef __RAY_MATH_TOOLKIT_H
 #define __RAY_MATH_TOOLKIT_H
 
-#include <math.h>
+#include <tgmath.h>
 #include <stdio.h>
 #include <assert.h>
 
+#include "primitives.h"
+
 static inline
-void normalize(double *v)
+void normalize(real *v)
 {
-    double d = sqrt(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+    real d = sqrt(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
     assert(d != 0.0 && "Error calculating normal");
 
     v[0] /= d;
@@ -17,41 +19,41 @@ void normalize(double *v)
 }
 
 static inline
-double length(const double *v)
+real length(const real *v)
 {
     return sqrt(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
 }
 
 static inline
-void add_vector(const double *a, const double *b, double *out)
+void add_vector(const real *a, const real *b, real *out)
 {
     for (int i = 0; i < 3; i++)
         out[i] = a[i] + b[i];
 }
 
 static inline
-void subtract_vector(const double *a, const double *b, double *out)
+void subtract_vector(const real *a, const real *b, real *out)
 {
     for (int i = 0; i < 3; i++)
         out[i] = a[i] - b[i];
 }
 
 static inline
-void multiply_vectors(const double *a, const double *b, double *out)
+void multiply_vectors(const real *a, const real *b, real *out)
 {
     for (int i = 0; i < 3; i++)
         out[i] = a[i] * b[i];
 }
 
 static inline
-void multiply_vector(const double *a, double b, double *out)
+void multiply_vector(const real *a, real b, real *out)
 {
     for (int i = 0; i < 3; i++)
         out[i] = a[i] * b;
 }
 
 static inline
-void cross_product(const double *v1, const double *v2, double *out)
+void cross_product(const real *v1, const real *v2, real *out)
 {
     out[0] = v1[1] * v2[2] - v1[2] * v2[1];
     out[1] = v1[2] * v2[0] - v1[0] * v2[2];
@@ -59,26 +61,26 @@ void cross_product(const double *v1, const double *v2, double *out)
 }
 
 static inline
-double dot_product(const double *v1, const double *v2)
+real dot_product(const real *v1, const real *v2)
 {
-    double dp = 0.0;
+    real dp = 0.0;
     for (int i = 0; i < 3; i++)
         dp += v1[i] * v2[i];
     return dp;
 }
 
 static inline
-void scalar_triple_product(const double *u, const double *v, const double *w,
-                           double *out)
+void scalar_triple_product(const real *u, const real *v, const real *w,
+                           real *out)
 {
     cross_product(v, w, out);
     multiply_vectors(u, out, out);
 }
 
 static inline
-double scalar_triple(const double *u, const double *v, const double *w)
+real scalar_triple(const real *u, const real *v, const real *w)
 {
-    double tmp[3];
+    real tmp[3];
     cross_product(w, u, tmp);
     return dot_product(v, tmp);
 }
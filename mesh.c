@@ -0,0 +1,397 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "math-toolkit.h"
+#include "mesh.h"
+
+/* determinant below which a ray counts as parallel to a triangle; it
+ * scales with the triangle's area, so it has to stay far below the
+ * REAL_EPSILON of the rectangulars for small triangles to show
+ */
+#define MESH_DET_EPSILON 1e-12
+
+/* make room for n + 1 elements of size bytes
+ * @return 0 on success, -1 when out of memory
+ */
+static int grow(void **buf, int *cap, int n, size_t size)
+{
+    if (n < *cap)
+        return 0;
+    int new_cap = *cap ? *cap * 2 : 1024;
+    void *p = realloc(*buf, size * new_cap);
+    if (!p)
+        return -1;
+    *buf = p;
+    *cap = new_cap;
+    return 0;
+}
+
+/* @return 0-based index of the OBJ index at *s, which is 1-based or,
+ *         when negative, relative to the count read so far; -1 if bad
+ */
+static int parse_index(char **s, int count)
+{
+    char *end;
+    long i = strtol(*s, &end, 10);
+    if (end == *s || i == 0)
+        return -1;
+    *s = end;
+    i = (i > 0) ? i - 1 : count + i;
+    return (i >= 0 && i < count) ? i : -1;
+}
+
+typedef struct {
+    int vertices, normals, triangles, triangle_normals;
+    int out_of_memory;
+} mesh_capacity;
+
+/* add the fan of triangles of one f record
+ * @return 0 on success, -1 on error
+ */
+static int parse_face(triangle_mesh *m, mesh_capacity *cap, char *s)
+{
+    int first[2], prev[2], corners = 0;
+
+    for (;;) {
+        while (*s == ' ' || *s == '\t')
+            s++;
+        if (!*s || *s == '\n' || *s == '\r')
+            break;
+
+        int corner[2] = { parse_index(&s, m->nvertices), -1 };
+        if (corner[0] < 0)
+            return -1;
+        if (*s == '/') {
+            s++;
+            /* the texture coordinate is not used */
+            if (*s != '/')
+                strtol(s, &s, 10);
+            if (*s == '/') {
+                s++;
+                corner[1] = parse_index(&s, m->nnormals);
+                if (corner[1] < 0)
+                    return -1;
+            }
+        }
+
+        if (corners == 0)
+            memcpy(first, corner, sizeof(first));
+        else if (corners >= 2) {
+            if (grow((void **) &m->triangles, &cap->triangles,
+                     m->ntriangles, sizeof(*m->triangles)) < 0 ||
+                    grow((void **) &m->triangle_normals,
+                         &cap->triangle_normals, m->ntriangles,
+                         sizeof(*m->triangle_normals)) < 0) {
+                cap->out_of_memory = 1;
+                return -1;
+            }
+            int *t = m->triangles[m->ntriangles];
+            int *tn = m->triangle_normals[m->ntriangles];
+            t[0] = first[0];
+            t[1] = prev[0];
+            t[2] = corner[0];
+            /* a corner without a normal makes the triangle flat */
+            tn[0] = first[1];
+            tn[1] = prev[1];
+            tn[2] = corner[1];
+            if (tn[0] < 0 || tn[1] < 0 || tn[2] < 0)
+                tn[0] = tn[1] = tn[2] = -1;
+            m->ntriangles++;
+        }
+        memcpy(prev, corner, sizeof(prev));
+        corners++;
+    }
+    return corners >= 3 ? 0 : -1;
+}
+
+int mesh_load_obj(triangle_mesh *m, const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+
+    memset(m, 0, sizeof(*m));
+    mesh_capacity cap = { 0 };
+    char *line = NULL;
+    size_t size = 0;
+    int lineno = 0, ret = 0;
+
+    while (getline(&line, &size, f) >= 0) {
+        lineno++;
+        char *s = line;
+        while (*s == ' ' || *s == '\t')
+            s++;
+
+        if (s[0] == 'v' && (s[1] == ' ' || s[1] == '\t')) {
+            if (grow((void **) &m->vertices, &cap.vertices, m->nvertices,
+                     sizeof(point3)) < 0) {
+                cap.out_of_memory = 1;
+                ret = -1;
+                break;
+            }
+            real *v = m->vertices[m->nvertices++];
+            s += 2;
+            for (int k = 0; k < 3; k++)
+                v[k] = strtod(s, &s);
+        } else if (s[0] == 'v' && s[1] == 'n' &&
+                   (s[2] == ' ' || s[2] == '\t')) {
+            if (grow((void **) &m->normals, &cap.normals, m->nnormals,
+                     sizeof(point3)) < 0) {
+                cap.out_of_memory = 1;
+                ret = -1;
+                break;
+            }
+            real *n = m->normals[m->nnormals++];
+            s += 3;
+            for (int k = 0; k < 3; k++)
+                n[k] = strtod(s, &s);
+            if (length(n) > 0.0)
+                normalize(n);
+        } else if (s[0] == 'f' && (s[1] == ' ' || s[1] == '\t')) {
+            if (parse_face(m, &cap, s + 2) < 0) {
+                if (!cap.out_of_memory)
+                    fprintf(stderr, "%s:%d: bad face\n", path, lineno);
+                ret = -1;
+                break;
+            }
+        }
+    }
+    if (ret == 0 && ferror(f)) {
+        perror(path);
+        ret = -1;
+    } else if (ret == 0 && !m->ntriangles) {
+        fprintf(stderr, "%s: no faces\n", path);
+        ret = -1;
+    } else if (cap.out_of_memory)
+        fprintf(stderr, "%s: out of memory\n", path);
+    free(line);
+    fclose(f);
+
+    if (ret < 0) {
+        mesh_free(m);
+        return -1;
+    }
+    if (!m->nnormals) {
+        free(m->triangle_normals);
+        m->triangle_normals = NULL;
+    }
+    return 0;
+}
+
+void mesh_transform(triangle_mesh *m, real scale, const point3 offset)
+{
+    for (int i = 0; i < m->nvertices; i++) {
+        multiply_vector(m->vertices[i], scale, m->vertices[i]);
+        add_vector(m->vertices[i], offset, m->vertices[i]);
+    }
+}
+
+static aabb *triangle_boxes(const triangle_mesh *m)
+{
+    aabb *boxes = malloc(sizeof(aabb) * m->ntriangles);
+    if (!boxes)
+        return NULL;
+    for (int i = 0; i < m->ntriangles; i++) {
+        const int *t = m->triangles[i];
+        COPY_POINT3(boxes[i].min, m->vertices[t[0]]);
+        COPY_POINT3(boxes[i].max, m->vertices[t[0]]);
+        aabb_grow_point(&boxes[i], m->vertices[t[1]]);
+        aabb_grow_point(&boxes[i], m->vertices[t[2]]);
+    }
+    return boxes;
+}
+
+int mesh_build(triangle_mesh *m)
+{
+    aabb *boxes = triangle_boxes(m);
+    if (!boxes)
+        return -1;
+    bvh_free(&m->accel);
+    int ret = bvh_build(&m->accel, boxes, m->ntriangles);
+    free(boxes);
+    return ret;
+}
+
+void mesh_translate(triangle_mesh *m, const point3 offset)
+{
+    for (int i = 0; i < m->nvertices; i++)
+        add_vector(m->vertices[i], offset, m->vertices[i]);
+    /* rounding is monotonic, so the boxes still hold their triangles */
+    for (int i = 0; i < m->accel.stats.nodes; i++) {
+        add_vector(m->accel.nodes[i].min, offset, m->accel.nodes[i].min);
+        add_vector(m->accel.nodes[i].max, offset, m->accel.nodes[i].max);
+    }
+}
+
+void mesh_bounds(const triangle_mesh *m, aabb *box)
+{
+    COPY_POINT3(box->min, m->accel.nodes[0].min);
+    COPY_POINT3(box->max, m->accel.nodes[0].max);
+}
+
+/* two-sided Moller-Trumbore
+ * @param u, v barycentric coordinates of the hit towards corners 1 and 2
+ * @return 1 means hit, otherwise 0
+ */
+static int triangle_hit(const triangle_mesh *m, int tri, const point3 e,
+                        const point3 d, real *t, real *u, real *v)
+{
+    const int *c = m->triangles[tri];
+    point3 e1, e2, p, s, q;
+
+    subtract_vector(m->vertices[c[1]], m->vertices[c[0]], e1);
+    subtract_vector(m->vertices[c[2]], m->vertices[c[0]], e2);
+    cross_product(d, e2, p);
+    real det = dot_product(e1, p);
+    if (fabs(det) < MESH_DET_EPSILON)
+        return 0;
+    real inv_det = 1.0 / det;
+
+    subtract_vector(e, m->vertices[c[0]], s);
+    *u = inv_det * dot_product(s, p);
+    if (*u < 0.0 || *u > 1.0)
+        return 0;
+    cross_product(s, e1, q);
+    *v = inv_det * dot_product(d, q);
+    if (*v < 0.0 || *u + *v > 1.0)
+        return 0;
+    *t = inv_det * dot_product(e2, q);
+    return *t >= REAL_EPSILON;
+}
+
+int mesh_intersect(const triangle_mesh *m, const point3 e, const point3 d,
+                   real t1, intersection *ip, real *t)
+{
+    const bvh *accel = &m->accel;
+    point3 inv_d;
+    int best = -1;
+    real best_u = 0.0, best_v = 0.0;
+
+    for (int i = 0; i < 3; i++)
+        inv_d[i] = 1.0 / d[i];
+
+    struct {
+        int node;
+        real t;
+    } stack[BVH_STACK_SIZE];
+    int top = 0;
+
+    stack[top].node = 0;
+    stack[top++].t = bvh_node_hit(&accel->nodes[0], e, inv_d, t1);
+    while (top) {
+        top--;
+        if (stack[top].t > t1)
+            continue;
+        const bvh_node *node = &accel->nodes[stack[top].node];
+
+        if (!node->count) {
+            /* nearer child on top */
+            int left = node - accel->nodes + 1, right = node->start;
+            real tl = bvh_node_hit(&accel->nodes[left], e, inv_d, t1);
+            real tr = bvh_node_hit(&accel->nodes[right], e, inv_d, t1);
+            if (tl > tr) {
+                int tmp = left;
+                left = right;
+                right = tmp;
+                real tt = tl;
+                tl = tr;
+                tr = tt;
+            }
+            if (tr <= t1) {
+                stack[top].node = right;
+                stack[top++].t = tr;
+            }
+            if (tl <= t1) {
+                stack[top].node = left;
+                stack[top++].t = tl;
+            }
+            continue;
+        }
+
+        for (int i = node->start; i < node->start + node->count; i++) {
+            int tri = accel->prims[i];
+            real tt, u, v;
+            if (triangle_hit(m, tri, e, d, &tt, &u, &v) && tt <= t1) {
+                t1 = tt;
+                best = tri;
+                best_u = u;
+                best_v = v;
+            }
+        }
+    }
+    if (best < 0)
+        return 0;
+
+    *t = t1;
+    multiply_vector(d, t1, ip->point);
+    add_vector(e, ip->point, ip->point);
+
+    const int *c = m->triangles[best];
+    ip->normal[0] = ip->normal[1] = ip->normal[2] = 0.0;
+    if (m->triangle_normals && m->triangle_normals[best][0] >= 0) {
+        /* interpolate the vertex normals */
+        const int *cn = m->triangle_normals[best];
+        point3 n1, n2;
+        multiply_vector(m->normals[cn[0]], 1.0 - best_u - best_v,
+                        ip->normal);
+        multiply_vector(m->normals[cn[1]], best_u, n1);
+        multiply_vector(m->normals[cn[2]], best_v, n2);
+        add_vector(ip->normal, n1, ip->normal);
+        add_vector(ip->normal, n2, ip->normal);
+    }
+    if (length(ip->normal) == 0.0) {
+        point3 e1, e2;
+        subtract_vector(m->vertices[c[1]], m->vertices[c[0]], e1);
+        subtract_vector(m->vertices[c[2]], m->vertices[c[0]], e2);
+        cross_product(e1, e2, ip->normal);
+    }
+    normalize(ip->normal);
+    if (dot_product(ip->normal, d) > 0.0)
+        multiply_vector(ip->normal, -1, ip->normal);
+    return 1;
+}
+
+int mesh_occluded(const triangle_mesh *m, const point3 e, const point3 d,
+                  real t1)
+{
+    const bvh *accel = &m->accel;
+    point3 inv_d;
+
+    for (int i = 0; i < 3; i++)
+        inv_d[i] = 1.0 / d[i];
+
+    int stack[BVH_STACK_SIZE], top = 0;
+    stack[top++] = 0;
+    while (top) {
+        const bvh_node *node = &accel->nodes[stack[--top]];
+        if (bvh_node_hit(node, e, inv_d, t1) > t1)
+            continue;
+
+        if (!node->count) {
+            stack[top++] = node->start;
+            stack[top++] = node - accel->nodes + 1;
+            continue;
+        }
+
+        for (int i = node->start; i < node->start + node->count; i++) {
+            real t, u, v;
+            if (triangle_hit(m, accel->prims[i], e, d, &t, &u, &v) &&
+                    t < t1)
+                return 1;
+        }
+    }
+    return 0;
+}
+
+void mesh_free(triangle_mesh *m)
+{
+    free(m->vertices);
+    free(m->normals);
+    free(m->triangles);
+    free(m->triangle_normals);
+    bvh_free(&m->accel);
+    memset(m, 0, sizeof(*m));
+}
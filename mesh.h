@@ -0,0 +1,56 @@
+#ifndef __RAY_MESH_H
+#define __RAY_MESH_H
+
+#include "primitives.h"
+#include "bvh.h"
+
+/* Indexed triangles over shared vertex and normal buffers, with a BVH of
+ * their own. The scene sees a whole mesh as one primitive and only
+ * descends into this tree for rays that reach its bounds.
+ */
+typedef struct triangle_mesh {
+    int nvertices, nnormals, ntriangles;
+    point3 *vertices;
+    point3 *normals;           /**< NULL: flat shading */
+    int (*triangles)[3];       /**< indices into vertices */
+    int (*triangle_normals)[3]; /**< indices into normals, with normals */
+    bvh accel;                 /**< over the triangles */
+} triangle_mesh;
+
+/* Read the v, vn and f records of a Wavefront OBJ file; faces with more
+ * than three corners are split into fans, everything else is ignored.
+ * @return 0 on success, -1 on error (reported on stderr)
+ */
+int mesh_load_obj(triangle_mesh *m, const char *path);
+
+/* scale the mesh about the origin, then move it by offset; call
+ * mesh_build() afterwards
+ */
+void mesh_transform(triangle_mesh *m, real scale, const point3 offset);
+
+/* (re)build the BVH after the vertices are final
+ * @return 0 on success, -1 when out of memory
+ */
+int mesh_build(triangle_mesh *m);
+
+/* move a built mesh, its BVH along with it */
+void mesh_translate(triangle_mesh *m, const point3 offset);
+
+void mesh_bounds(const triangle_mesh *m, aabb *box);
+
+/* nearest hit of the ray e + t d with t up to t1, both sides counting;
+ * the normal faces the ray
+ * @return 1 means hit, otherwise 0
+ */
+int mesh_intersect(const triangle_mesh *m, const point3 e, const point3 d,
+                   real t1, intersection *ip, real *t);
+
+/* any hit closer than t1, for shadow rays
+ * @return 1 means hit, otherwise 0
+ */
+int mesh_occluded(const triangle_mesh *m, const point3 e, const point3 d,
+                  real t1);
+
+void mesh_free(triangle_mesh *m);
+
+#endif
@@ -0,0 +1,226 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "net.h"
+
+double monotonic_seconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1000000000.0;
+}
+
+int write_full(int fd, const void *buf, size_t size)
+{
+    const char *p = buf;
+
+    while (size) {
+        ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+int read_full(int fd, void *buf, size_t size)
+{
+    char *p = buf;
+
+    while (size) {
+        ssize_t n = recv(fd, p, size, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+int send_message(int fd, uint32_t type, const void *a, size_t asize,
+                 const void *b, size_t bsize)
+{
+    message_header h = { .type = type, .size = asize + bsize };
+
+    if (write_full(fd, &h, sizeof(h)) < 0 ||
+            (asize && write_full(fd, a, asize) < 0) ||
+            (bsize && write_full(fd, b, bsize) < 0))
+        return -1;
+    return 0;
+}
+
+int recv_message(int fd, uint32_t type, void *payload, size_t size)
+{
+    message_header h;
+
+    if (read_full(fd, &h, sizeof(h)) < 0 || h.type != type ||
+            h.size != size)
+        return -1;
+    return read_full(fd, payload, size);
+}
+
+static struct timeval to_timeval(double seconds)
+{
+    return (struct timeval) {
+        .tv_sec = (time_t) seconds,
+        .tv_usec = (seconds - (time_t) seconds) * 1000000
+    };
+}
+
+void set_timeout(int fd, double seconds)
+{
+    struct timeval tv = to_timeval(seconds);
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+void set_send_timeout(int fd, double seconds)
+{
+    struct timeval tv = to_timeval(seconds);
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+void set_nodelay(int fd, int family)
+{
+    int one = 1;
+    if (family != AF_UNIX)
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+/* Turn unix:PATH or [HOST]:PORT into a socket address; an empty host
+ * means any interface when listening and this machine when connecting,
+ * in the family listening picks, which need not be the one of the
+ * machine's first loopback address.
+ * @return 0 on success, -1 on error (reported on stderr)
+ */
+static int resolve(const char *address, int passive,
+                   struct sockaddr_storage *addr, socklen_t *len)
+{
+    memset(addr, 0, sizeof(*addr));
+    if (!strncmp(address, "unix:", 5)) {
+        struct sockaddr_un *un = (struct sockaddr_un *) addr;
+        if (strlen(address + 5) >= sizeof(un->sun_path)) {
+            fprintf(stderr, "%s: socket path too long\n", address);
+            return -1;
+        }
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, address + 5);
+        *len = sizeof(*un);
+        return 0;
+    }
+
+    const char *colon = strrchr(address, ':');
+    if (!colon) {
+        fprintf(stderr, "%s: expected unix:PATH or [HOST]:PORT\n",
+                address);
+        return -1;
+    }
+    char host[256];
+    int host_len = colon - address;
+    if (host_len >= (int) sizeof(host)) {
+        fprintf(stderr, "%s: host name too long\n", address);
+        return -1;
+    }
+    memcpy(host, address, host_len);
+    host[host_len] = '\0';
+
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+        .ai_flags = passive ? AI_PASSIVE : 0,
+    }, *res;
+    int err = 0;
+    if (!host_len && !passive) {
+        hints.ai_flags = AI_PASSIVE;
+        if (!(err = getaddrinfo(NULL, colon + 1, &hints, &res))) {
+            hints.ai_family = res->ai_family;
+            freeaddrinfo(res);
+        }
+        hints.ai_flags = 0;
+    }
+    if (!err)
+        err = getaddrinfo(host_len ? host : NULL, colon + 1, &hints, &res);
+    if (err) {
+        fprintf(stderr, "%s: %s\n", address, gai_strerror(err));
+        return -1;
+    }
+    memcpy(addr, res->ai_addr, res->ai_addrlen);
+    *len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return 0;
+}
+
+int listen_on(const char *address, int backlog)
+{
+    struct sockaddr_storage addr;
+    socklen_t len;
+    int one = 1;
+
+    if (resolve(address, 1, &addr, &len) < 0)
+        return -1;
+    if (addr.ss_family == AF_UNIX) {
+        /* a socket left behind by an earlier run */
+        const char *path = ((struct sockaddr_un *) &addr)->sun_path;
+        struct stat st;
+        if (!stat(path, &st) && S_ISSOCK(st.st_mode))
+            unlink(path);
+    }
+
+    int fd = socket(addr.ss_family, SOCK_STREAM, 0);
+    if (fd < 0 ||
+            (addr.ss_family != AF_UNIX &&
+             setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one,
+                        sizeof(one)) < 0) ||
+            bind(fd, (struct sockaddr *) &addr, len) < 0 ||
+            listen(fd, backlog) < 0) {
+        perror(address);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int connect_to(const char *address, double timeout)
+{
+    struct sockaddr_storage addr;
+    socklen_t len;
+    double deadline = monotonic_seconds() + timeout;
+
+    if (resolve(address, 0, &addr, &len) < 0)
+        return -1;
+    for (;;) {
+        int fd = socket(addr.ss_family, SOCK_STREAM, 0);
+        if (fd < 0) {
+            perror(address);
+            return -1;
+        }
+        if (!connect(fd, (struct sockaddr *) &addr, len)) {
+            set_nodelay(fd, addr.ss_family);
+            return fd;
+        }
+        int err = errno;
+        close(fd);
+        if ((err != ECONNREFUSED && err != ENOENT) ||
+                monotonic_seconds() > deadline) {
+            errno = err;
+            perror(address);
+            return -1;
+        }
+        usleep(100000);
+    }
+}
@@ -0,0 +1,57 @@
+#ifndef __RAY_NET_H
+#define __RAY_NET_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Stream sockets on unix:PATH or [HOST]:PORT addresses, carrying
+ * messages of a header and a raw payload, for the processes that render
+ * together or serve renders.
+ */
+
+typedef struct {
+    uint32_t type;
+    uint32_t size; /**< bytes of payload that follow */
+} message_header;
+
+double monotonic_seconds(void);
+
+/* @return 0 on success, -1 on error */
+int write_full(int fd, const void *buf, size_t size);
+
+/* @return 0 on success, -1 on error, timeout or end of stream */
+int read_full(int fd, void *buf, size_t size);
+
+/* send a message whose payload is a followed by b
+ * @return 0 on success, -1 on error
+ */
+int send_message(int fd, uint32_t type, const void *a, size_t asize,
+                 const void *b, size_t bsize);
+
+/* read a message expected to carry exactly size bytes of payload
+ * @return 0 on success, -1 on error or any other message
+ */
+int recv_message(int fd, uint32_t type, void *payload, size_t size);
+
+/* give up on reads and writes blocked for longer than seconds */
+void set_timeout(int fd, double seconds);
+
+/* the same for writes only, for peers that may idle between messages */
+void set_send_timeout(int fd, double seconds);
+
+/* send small messages right away on TCP sockets of family */
+void set_nodelay(int fd, int family);
+
+/* Listen on unix:PATH or [HOST]:PORT; an empty host means any interface.
+ * A unix socket left behind by an earlier run is replaced.
+ * @return the socket, -1 on error (reported on stderr)
+ */
+int listen_on(const char *address, int backlog);
+
+/* connect, retrying for timeout seconds while nobody listens yet; an
+ * empty host means this machine
+ * @return the socket, -1 on error (reported on stderr)
+ */
+int connect_to(const char *address, double timeout);
+
+#endif
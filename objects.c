@@ -1,28 +1,86 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <stddef.h>
 
 #include "primitives.h"
 #include "objects.h"
 
+/* nodes in the first chunk of a list */
+#define OBJECT_CHUNK_NODES 16
+
+/* Header in front of the nodes of a chunk. The first chunk of a list
+ * also tracks the newest chunk and the last node, and since the head of
+ * the list is its first node the header is found from the list alone.
+ */
+typedef union object_chunk {
+    struct {
+        union object_chunk *older;
+        union object_chunk *newest; /**< first chunk only */
+        void *tail;                 /**< first chunk only */
+        size_t used, capacity;      /**< in nodes */
+    } h;
+    long double align; /**< nodes follow at the strictest alignment */
+} object_chunk;
+
+/* add a node of node_size bytes whose next pointer is at next_offset
+ * @return the node, NULL when out of memory
+ */
+static void *list_append(void **head, size_t node_size, size_t next_offset)
+{
+    object_chunk *first = *head ? (object_chunk *) *head - 1 : NULL;
+    object_chunk *c = first ? first->h.newest : NULL;
+
+    if (!c || c->h.used == c->h.capacity) {
+        size_t capacity = c ? c->h.capacity * 2 : OBJECT_CHUNK_NODES;
+        object_chunk *fresh = malloc(sizeof(object_chunk) +
+                                     capacity * node_size);
+        if (!fresh)
+            return NULL;
+        fresh->h.older = c;
+        fresh->h.used = 0;
+        fresh->h.capacity = capacity;
+        if (!first)
+            first = fresh;
+        first->h.newest = c = fresh;
+    }
+
+    void *node = (char *) (c + 1) + c->h.used++ * node_size;
+    *(void **) ((char *) node + next_offset) = NULL;
+    if (*head)
+        *(void **) ((char *) first->h.tail + next_offset) = node;
+    else
+        *head = node;
+    first->h.tail = node;
+    return node;
+}
+
+static void list_free(void *head)
+{
+    if (!head)
+        return;
+    object_chunk *c = ((object_chunk *) head - 1)->h.newest;
+    while (c) {
+        object_chunk *older = c->h.older;
+        free(c);
+        c = older;
+    }
+}
+
 #define FUNC_BEGIN(name) \
-    void append_##name (const name *X, name##_node *list) { \
-        name##_node newNode = malloc(sizeof(struct __##name##_node));
+    int append_##name(const name *X, name##_node *list) { \
+        void *head = *list; \
+        name##_node newNode = list_append(&head, \
+            sizeof(struct __##name##_node), \
+            offsetof(struct __##name##_node, next)); \
+        if (!newNode) \
+            return -1; \
+        *list = head;
 
 #define FUNC_END(name) \
-        newNode->next = NULL; \
-        if (!*list) { *list = newNode; } \
-        else { \
-            name##_node tmp; \
-            for (tmp = *list; tmp->next; tmp = tmp->next) ; \
-            tmp->next = newNode; \
-        } \
+        return 0; \
     } \
     void delete_##name##_list(name##_node *list) { \
-	name##_node pos = *list; \
-        while (pos) { \
-            name##_node tmp = pos->next; \
-            free(pos); pos = tmp; \
-        } \
+        list_free(*list); \
         *list = NULL; \
     }
 
@@ -47,4 +105,9 @@ FUNC_BEGIN(sphere)
     COPY_POINT3(newNode->element.center, X->center);
     FUNC_END(sphere)
 
+FUNC_BEGIN(mesh)
+    COPY_OBJECT_FILL(newNode->element.mesh_fill, X->mesh_fill);
+    newNode->element.geometry = X->geometry;
+FUNC_END(mesh)
+
 // *INDENT-ON*
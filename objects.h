@@ -1,6 +1,13 @@
 #ifndef __RAY_OBJECTS_H
 #define __RAY_OBJECTS_H
 
+/* Lists of scene objects. A list keeps its nodes in a few chunks of
+ * doubling size, so append_*() is O(1) and delete_*_list() frees them
+ * all at once. Nodes must be added with append_*() only; the first one
+ * carries the bookkeeping of the whole list.
+ *
+ * append_*() returns 0 on success and -1 when out of memory.
+ */
 #define DECLARE_OBJECT(name) \
     struct __##name##_node; \
     typedef struct __##name##_node *name##_node; \
@@ -8,12 +15,13 @@
         name element; \
         name##_node next; \
     }; \
-    void append_##name(const name *X, name##_node *list); \
+    int append_##name(const name *X, name##_node *list); \
     void delete_##name##_list(name##_node *list);
 
 DECLARE_OBJECT(light)
 DECLARE_OBJECT(rectangular)
 DECLARE_OBJECT(sphere)
+DECLARE_OBJECT(mesh)
 
 #undef DECLARE_OBJECT
 
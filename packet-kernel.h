@@ -0,0 +1,196 @@
+/* Packet intersection kernels, included by packet.c once per instruction
+ * set. The includer defines VEC and VMASK types plus the v* operations
+ * on them, VWIDTH lanes per vector, and KERNEL(name) for the suffix.
+ *
+ * Each kernel repeats the scalar arithmetic of raytracing.c operation by
+ * operation (including the rounding through float in the sphere test),
+ * so every lane gets bit-for-bit the distances a single ray would.
+ */
+
+/* Merge candidate distances t into lanes [k, k + VWIDTH). Ties in t go
+ * to the lower primitive id, as in ray_hit_object().
+ */
+static inline void KERNEL(packet_update)(ray_packet *p, int k, VEC t,
+        VMASK miss, int id)
+{
+    int mask = vmovemask(vandnot(miss, vle(t, vload(p->t + k))));
+    if (!mask)
+        return;
+
+    real tv[VWIDTH] __attribute__((aligned(32)));
+    vstore(tv, t);
+    for (int i = 0; i < VWIDTH; i++) {
+        if (!(mask & (1 << i)))
+            continue;
+        if (tv[i] < p->t[k + i] ||
+                (tv[i] == p->t[k + i] && id < p->hit[k + i])) {
+            p->t[k + i] = tv[i];
+            p->hit[k + i] = id;
+        }
+    }
+}
+
+/* @return lane mask of rays entering the node before their nearest hit */
+static int KERNEL(packet_node)(const ray_packet *p, const bvh_node *node,
+                               real *tentry)
+{
+    int mask = 0;
+    const VEC minx = vset1(node->min[0]), maxx = vset1(node->max[0]);
+    const VEC miny = vset1(node->min[1]), maxy = vset1(node->max[1]);
+    const VEC minz = vset1(node->min[2]), maxz = vset1(node->max[2]);
+
+    for (int k = 0; k < PACKET_SIZE; k += VWIDTH) {
+        VEC tmin = vset1(0.0), tmax = vload(p->t + k);
+        VEC ta, tb, o, inv;
+
+        o = vload(p->ox + k);
+        inv = vload(p->ix + k);
+        ta = vmul(vsub(minx, o), inv);
+        tb = vmul(vsub(maxx, o), inv);
+        tmin = vmax(vmin(ta, tb), tmin);
+        tmax = vmin(vmax(ta, tb), tmax);
+
+        o = vload(p->oy + k);
+        inv = vload(p->iy + k);
+        ta = vmul(vsub(miny, o), inv);
+        tb = vmul(vsub(maxy, o), inv);
+        tmin = vmax(vmin(ta, tb), tmin);
+        tmax = vmin(vmax(ta, tb), tmax);
+
+        o = vload(p->oz + k);
+        inv = vload(p->iz + k);
+        ta = vmul(vsub(minz, o), inv);
+        tb = vmul(vsub(maxz, o), inv);
+        tmin = vmax(vmin(ta, tb), tmin);
+        tmax = vmin(vmax(ta, tb), tmax);
+
+        vstore(tentry + k, tmin);
+        mask |= vmovemask(vle(tmin, tmax)) << k;
+    }
+    return mask;
+}
+
+static void KERNEL(packet_sphere)(ray_packet *p, const point3 center,
+                                  real radius2, int id)
+{
+    const VEC cx = vset1(center[0]);
+    const VEC cy = vset1(center[1]);
+    const VEC cz = vset1(center[2]);
+    const VEC r2 = vset1(radius2);
+    const VEC zero = vset1(0.0);
+
+    for (int k = 0; k < PACKET_SIZE; k += VWIDTH) {
+        VEC dx = vload(p->dx + k), dy = vload(p->dy + k);
+        VEC dz = vload(p->dz + k);
+        VEC lx = vsub(cx, vload(p->ox + k));
+        VEC ly = vsub(cy, vload(p->oy + k));
+        VEC lz = vsub(cz, vload(p->oz + k));
+
+        VEC s = vadd(vadd(vmul(lx, dx), vmul(ly, dy)), vmul(lz, dz));
+        VEC l2 = vadd(vadd(vmul(lx, lx), vmul(ly, ly)), vmul(lz, lz));
+        VMASK outside = vgt(l2, r2);
+        VMASK miss = vand(vlt(s, zero), outside);
+
+        VEC m2 = vround_float(vsub(l2, vmul(s, s)));
+        miss = vor(miss, vgt(m2, r2));
+        if (vmovemask(miss) == (1 << VWIDTH) - 1)
+            continue;
+
+        VEC q = vround_float(vsqrt(vsub(r2, m2)));
+        VEC t = vblend(outside, vsub(s, q), vadd(s, q));
+        KERNEL(packet_update)(p, k, t, miss, id);
+    }
+}
+
+/* @param v0, v2, r as for rayRectangularIntersection() */
+static void KERNEL(packet_rectangular)(ray_packet *p, const point3 v0,
+                                       const point3 v2,
+                                       const rectangular_record *r, int id)
+{
+    const real *e01 = r->e01, *e03 = r->e03;
+    const real *e23 = r->e23, *e21 = r->e21;
+
+    const VEC zero = vset1(0.0), one = vset1(1.0), eps = vset1(REAL_EPSILON);
+
+    for (int k = 0; k < PACKET_SIZE; k += VWIDTH) {
+        VEC dx = vload(p->dx + k), dy = vload(p->dy + k);
+        VEC dz = vload(p->dz + k);
+        VEC ox = vload(p->ox + k), oy = vload(p->oy + k);
+        VEC oz = vload(p->oz + k);
+
+        /* first triangle: v0, v1, v3 */
+        VEC px = vsub(vmul(dy, vset1(e03[2])), vmul(dz, vset1(e03[1])));
+        VEC py = vsub(vmul(dz, vset1(e03[0])), vmul(dx, vset1(e03[2])));
+        VEC pz = vsub(vmul(dx, vset1(e03[1])), vmul(dy, vset1(e03[0])));
+        VEC det = vadd(vadd(vmul(vset1(e01[0]), px),
+                            vmul(vset1(e01[1]), py)),
+                       vmul(vset1(e01[2]), pz));
+        VMASK miss = vlt(det, eps);
+        if (vmovemask(miss) == (1 << VWIDTH) - 1)
+            continue;
+
+        VEC inv_det = vdiv(one, det);
+        VEC sx = vsub(ox, vset1(v0[0]));
+        VEC sy = vsub(oy, vset1(v0[1]));
+        VEC sz = vsub(oz, vset1(v0[2]));
+        VEC alpha = vmul(inv_det, vadd(vadd(vmul(sx, px), vmul(sy, py)),
+                                       vmul(sz, pz)));
+        miss = vor(miss, vor(vgt(alpha, one), vlt(alpha, zero)));
+
+        VEC qx = vsub(vmul(sy, vset1(e01[2])), vmul(sz, vset1(e01[1])));
+        VEC qy = vsub(vmul(sz, vset1(e01[0])), vmul(sx, vset1(e01[2])));
+        VEC qz = vsub(vmul(sx, vset1(e01[1])), vmul(sy, vset1(e01[0])));
+        VEC beta = vmul(inv_det, vadd(vadd(vmul(dx, qx), vmul(dy, qy)),
+                                      vmul(dz, qz)));
+        miss = vor(miss, vor(vgt(beta, one), vlt(beta, zero)));
+        if (vmovemask(miss) == (1 << VWIDTH) - 1)
+            continue;
+
+        VEC t = vmul(inv_det, vadd(vadd(vmul(vset1(e03[0]), qx),
+                                        vmul(vset1(e03[1]), qy)),
+                                   vmul(vset1(e03[2]), qz)));
+
+        VMASK second = vandnot(miss, vgt(vadd(alpha, beta), one));
+        if (vmovemask(second)) {
+            /* second triangle: v2, v3, v1 */
+            px = vsub(vmul(dy, vset1(e21[2])), vmul(dz, vset1(e21[1])));
+            py = vsub(vmul(dz, vset1(e21[0])), vmul(dx, vset1(e21[2])));
+            pz = vsub(vmul(dx, vset1(e21[1])), vmul(dy, vset1(e21[0])));
+            det = vadd(vadd(vmul(vset1(e23[0]), px),
+                            vmul(vset1(e23[1]), py)),
+                       vmul(vset1(e23[2]), pz));
+            VMASK miss2 = vlt(det, eps);
+
+            inv_det = vdiv(one, det);
+            sx = vsub(ox, vset1(v2[0]));
+            sy = vsub(oy, vset1(v2[1]));
+            sz = vsub(oz, vset1(v2[2]));
+            alpha = vmul(inv_det, vadd(vadd(vmul(sx, px), vmul(sy, py)),
+                                       vmul(sz, pz)));
+            miss2 = vor(miss2, vlt(alpha, zero));
+
+            qx = vsub(vmul(sy, vset1(e23[2])), vmul(sz, vset1(e23[1])));
+            qy = vsub(vmul(sz, vset1(e23[0])), vmul(sx, vset1(e23[2])));
+            qz = vsub(vmul(sx, vset1(e23[1])), vmul(sy, vset1(e23[0])));
+            beta = vmul(inv_det, vadd(vadd(vmul(dx, qx), vmul(dy, qy)),
+                                      vmul(dz, qz)));
+            miss2 = vor(miss2, vor(vlt(beta, zero),
+                                   vgt(vadd(beta, alpha), one)));
+
+            VEC t2 = vmul(inv_det, vadd(vadd(vmul(vset1(e21[0]), qx),
+                                             vmul(vset1(e21[1]), qy)),
+                                        vmul(vset1(e21[2]), qz)));
+            t = vblend(second, t2, t);
+            miss = vor(miss, vand(second, miss2));
+        }
+
+        miss = vor(miss, vlt(t, eps));
+        KERNEL(packet_update)(p, k, t, miss, id);
+    }
+}
+
+static const packet_kernels KERNEL(kernels) = {
+    .node = KERNEL(packet_node),
+    .sphere = KERNEL(packet_sphere),
+    .rectangular = KERNEL(packet_rectangular),
+};
@@ -0,0 +1,387 @@
+#include <string.h>
+#include <tgmath.h>
+
+#include "math-toolkit.h"
+#include "packet.h"
+#include "stats.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PACKET_X86 1
+#include <immintrin.h>
+#endif
+
+typedef struct {
+    int (*node)(const ray_packet *p, const bvh_node *node, real *tentry);
+    void (*sphere)(ray_packet *p, const point3 center, real radius2,
+                   int id);
+    void (*rectangular)(ray_packet *p, const point3 v0, const point3 v2,
+                        const rectangular_record *r, int id);
+} packet_kernels;
+
+/* scalar: one lane per "vector", masks are plain ints */
+#define VEC real
+#define VMASK int
+#define VWIDTH 1
+#define KERNEL(name) name##_scalar
+#define vset1(x) (x)
+#define vload(p) (*(p))
+#define vstore(p, v) (*(p) = (v))
+#define vadd(a, b) ((a) + (b))
+#define vsub(a, b) ((a) - (b))
+#define vmul(a, b) ((a) * (b))
+#define vdiv(a, b) ((a) / (b))
+#define vsqrt(a) sqrt(a)
+#define vmin(a, b) ((a) < (b) ? (a) : (b))
+#define vmax(a, b) ((a) > (b) ? (a) : (b))
+#define vlt(a, b) ((a) < (b))
+#define vgt(a, b) ((a) > (b))
+#define vle(a, b) ((a) <= (b))
+#define vand(a, b) ((a) & (b))
+#define vor(a, b) ((a) | (b))
+#define vandnot(a, b) (!(a) & (b))
+#define vblend(m, a, b) ((m) ? (a) : (b))
+#define vmovemask(m) (m)
+#define vround_float(x) ((real) (float) (x))
+#include "packet-kernel.h"
+#undef VEC
+#undef VMASK
+#undef VWIDTH
+#undef KERNEL
+#undef vset1
+#undef vload
+#undef vstore
+#undef vadd
+#undef vsub
+#undef vmul
+#undef vdiv
+#undef vsqrt
+#undef vmin
+#undef vmax
+#undef vlt
+#undef vgt
+#undef vle
+#undef vand
+#undef vor
+#undef vandnot
+#undef vblend
+#undef vmovemask
+#undef vround_float
+
+#ifdef PACKET_X86
+#ifdef RAY_FLOAT
+/* SSE: four floats per vector, the whole packet in one register */
+#define VEC __m128
+#define VMASK __m128
+#define VWIDTH 4
+#define KERNEL(name) name##_sse2
+#define vset1(x) _mm_set1_ps(x)
+#define vload(p) _mm_load_ps(p)
+#define vstore(p, v) _mm_store_ps(p, v)
+#define vadd(a, b) _mm_add_ps(a, b)
+#define vsub(a, b) _mm_sub_ps(a, b)
+#define vmul(a, b) _mm_mul_ps(a, b)
+#define vdiv(a, b) _mm_div_ps(a, b)
+#define vsqrt(a) _mm_sqrt_ps(a)
+#define vmin(a, b) _mm_min_ps(a, b)
+#define vmax(a, b) _mm_max_ps(a, b)
+#define vlt(a, b) _mm_cmplt_ps(a, b)
+#define vgt(a, b) _mm_cmpgt_ps(a, b)
+#define vle(a, b) _mm_cmple_ps(a, b)
+#define vand(a, b) _mm_and_ps(a, b)
+#define vor(a, b) _mm_or_ps(a, b)
+#define vandnot(a, b) _mm_andnot_ps(a, b)
+#define vblend(m, a, b) _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b))
+#define vmovemask(m) _mm_movemask_ps(m)
+#define vround_float(x) (x)
+#else
+/* SSE2: two doubles per vector */
+#define VEC __m128d
+#define VMASK __m128d
+#define VWIDTH 2
+#define KERNEL(name) name##_sse2
+#define vset1(x) _mm_set1_pd(x)
+#define vload(p) _mm_load_pd(p)
+#define vstore(p, v) _mm_store_pd(p, v)
+#define vadd(a, b) _mm_add_pd(a, b)
+#define vsub(a, b) _mm_sub_pd(a, b)
+#define vmul(a, b) _mm_mul_pd(a, b)
+#define vdiv(a, b) _mm_div_pd(a, b)
+#define vsqrt(a) _mm_sqrt_pd(a)
+#define vmin(a, b) _mm_min_pd(a, b)
+#define vmax(a, b) _mm_max_pd(a, b)
+#define vlt(a, b) _mm_cmplt_pd(a, b)
+#define vgt(a, b) _mm_cmpgt_pd(a, b)
+#define vle(a, b) _mm_cmple_pd(a, b)
+#define vand(a, b) _mm_and_pd(a, b)
+#define vor(a, b) _mm_or_pd(a, b)
+#define vandnot(a, b) _mm_andnot_pd(a, b)
+#define vblend(m, a, b) _mm_or_pd(_mm_and_pd(m, a), _mm_andnot_pd(m, b))
+#define vmovemask(m) _mm_movemask_pd(m)
+#define vround_float(x) _mm_cvtps_pd(_mm_cvtpd_ps(x))
+#endif
+#include "packet-kernel.h"
+#undef VEC
+#undef VMASK
+#undef VWIDTH
+#undef KERNEL
+#undef vset1
+#undef vload
+#undef vstore
+#undef vadd
+#undef vsub
+#undef vmul
+#undef vdiv
+#undef vsqrt
+#undef vmin
+#undef vmax
+#undef vlt
+#undef vgt
+#undef vle
+#undef vand
+#undef vor
+#undef vandnot
+#undef vblend
+#undef vmovemask
+#undef vround_float
+
+/* AVX2: four doubles per vector, compiled for AVX2 only in this block.
+ * In float builds four lanes fill only half a register, so the packet
+ * stays in an xmm register and gains the VEX encoding and blendv.
+ */
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#ifdef RAY_FLOAT
+#define VEC __m128
+#define VMASK __m128
+#define VWIDTH 4
+#define KERNEL(name) name##_avx2
+#define vset1(x) _mm_set1_ps(x)
+#define vload(p) _mm_load_ps(p)
+#define vstore(p, v) _mm_store_ps(p, v)
+#define vadd(a, b) _mm_add_ps(a, b)
+#define vsub(a, b) _mm_sub_ps(a, b)
+#define vmul(a, b) _mm_mul_ps(a, b)
+#define vdiv(a, b) _mm_div_ps(a, b)
+#define vsqrt(a) _mm_sqrt_ps(a)
+#define vmin(a, b) _mm_min_ps(a, b)
+#define vmax(a, b) _mm_max_ps(a, b)
+#define vlt(a, b) _mm_cmp_ps(a, b, _CMP_LT_OQ)
+#define vgt(a, b) _mm_cmp_ps(a, b, _CMP_GT_OQ)
+#define vle(a, b) _mm_cmp_ps(a, b, _CMP_LE_OQ)
+#define vand(a, b) _mm_and_ps(a, b)
+#define vor(a, b) _mm_or_ps(a, b)
+#define vandnot(a, b) _mm_andnot_ps(a, b)
+#define vblend(m, a, b) _mm_blendv_ps(b, a, m)
+#define vmovemask(m) _mm_movemask_ps(m)
+#define vround_float(x) (x)
+#else
+#define VEC __m256d
+#define VMASK __m256d
+#define VWIDTH 4
+#define KERNEL(name) name##_avx2
+#define vset1(x) _mm256_set1_pd(x)
+#define vload(p) _mm256_load_pd(p)
+#define vstore(p, v) _mm256_store_pd(p, v)
+#define vadd(a, b) _mm256_add_pd(a, b)
+#define vsub(a, b) _mm256_sub_pd(a, b)
+#define vmul(a, b) _mm256_mul_pd(a, b)
+#define vdiv(a, b) _mm256_div_pd(a, b)
+#define vsqrt(a) _mm256_sqrt_pd(a)
+#define vmin(a, b) _mm256_min_pd(a, b)
+#define vmax(a, b) _mm256_max_pd(a, b)
+#define vlt(a, b) _mm256_cmp_pd(a, b, _CMP_LT_OQ)
+#define vgt(a, b) _mm256_cmp_pd(a, b, _CMP_GT_OQ)
+#define vle(a, b) _mm256_cmp_pd(a, b, _CMP_LE_OQ)
+#define vand(a, b) _mm256_and_pd(a, b)
+#define vor(a, b) _mm256_or_pd(a, b)
+#define vandnot(a, b) _mm256_andnot_pd(a, b)
+#define vblend(m, a, b) _mm256_blendv_pd(b, a, m)
+#define vmovemask(m) _mm256_movemask_pd(m)
+#define vround_float(x) _mm256_cvtps_pd(_mm256_cvtpd_ps(x))
+#endif
+#include "packet-kernel.h"
+#undef VEC
+#undef VMASK
+#undef VWIDTH
+#undef KERNEL
+#undef vset1
+#undef vload
+#undef vstore
+#undef vadd
+#undef vsub
+#undef vmul
+#undef vdiv
+#undef vsqrt
+#undef vmin
+#undef vmax
+#undef vlt
+#undef vgt
+#undef vle
+#undef vand
+#undef vor
+#undef vandnot
+#undef vblend
+#undef vmovemask
+#undef vround_float
+#pragma GCC pop_options
+#endif
+
+static const char *isa_names[] = {
+    [PACKET_OFF] = "off",
+    [PACKET_SCALAR] = "scalar",
+    [PACKET_SSE2] = "sse2",
+    [PACKET_AVX2] = "avx2",
+    [PACKET_AUTO] = "auto",
+};
+
+const char *packet_isa_name(packet_isa isa)
+{
+    return isa_names[isa];
+}
+
+int packet_isa_parse(const char *name)
+{
+    for (int i = 0; i <= PACKET_AUTO; i++)
+        if (!strcmp(name, isa_names[i]))
+            return i;
+    return -1;
+}
+
+static int isa_supported(packet_isa isa)
+{
+    switch (isa) {
+    case PACKET_OFF:
+    case PACKET_SCALAR:
+        return 1;
+#ifdef PACKET_X86
+    case PACKET_SSE2:
+        return __builtin_cpu_supports("sse2");
+    case PACKET_AVX2:
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return 0;
+    }
+}
+
+packet_isa packet_select(packet_isa isa)
+{
+#ifdef PACKET_X86
+    __builtin_cpu_init();
+#endif
+    if (isa != PACKET_AUTO && isa_supported(isa))
+        return isa;
+    for (int i = PACKET_AVX2; i > PACKET_SCALAR; i--)
+        if (isa_supported(i))
+            return i;
+    return PACKET_SCALAR;
+}
+
+static const packet_kernels *kernels_for(packet_isa isa)
+{
+    switch (isa) {
+#ifdef PACKET_X86
+    case PACKET_SSE2:
+        return &kernels_sse2;
+    case PACKET_AVX2:
+        return &kernels_avx2;
+#endif
+    default:
+        return &kernels_scalar;
+    }
+}
+
+/* meshes have a tree of their own, so their lanes go one at a time */
+static void packet_mesh(ray_packet *p, const triangle_mesh *m, int id)
+{
+    for (int k = 0; k < PACKET_SIZE; k++) {
+        point3 o = { p->ox[k], p->oy[k], p->oz[k] };
+        point3 d = { p->dx[k], p->dy[k], p->dz[k] };
+        intersection ip;
+        real t;
+        if (p->t[k] < 0.0 ||
+                !mesh_intersect(m, o, d, p->t[k], &ip, &t))
+            continue;
+        if (t < p->t[k] || id < p->hit[k]) {
+            p->t[k] = t;
+            p->hit[k] = id;
+        }
+    }
+}
+
+/* intersect every lane with the primitives of one leaf */
+static void packet_leaf(ray_packet *p, const scene *scn,
+                        const packet_kernels *k, const bvh_node *node)
+{
+    const bvh *accel = &scn->accel;
+
+    for (int i = node->start; i < node->start + node->count; i++) {
+        int id = accel->prims[i];
+        STATS_INC(STAT_PACKET_PRIM_TESTS);
+        if (scene_is_mesh(scn, id))
+            packet_mesh(p, scene_mesh(scn, id), id);
+        else if (scene_is_sphere(scn, id)) {
+            int s = id - scn->rectangulars.count;
+            point3 center;
+            point3_array_get(&scn->spheres.center, s, center);
+            k->sphere(p, center, scn->spheres.radius2[s], id);
+        } else {
+            point3 v0, v2;
+            point3_array_get(&scn->rectangulars.vertices[0], id, v0);
+            point3_array_get(&scn->rectangulars.vertices[2], id, v2);
+            k->rectangular(p, v0, v2, &scn->rectangulars.records[id], id);
+        }
+    }
+}
+
+void packet_trace(ray_packet *p, const scene *scn, packet_isa isa)
+{
+    const packet_kernels *k = kernels_for(isa);
+    const bvh *accel = &scn->accel;
+    real tentry[PACKET_SIZE] __attribute__((aligned(32)));
+
+    for (int i = 0; i < PACKET_SIZE; i++) {
+        p->ix[i] = 1.0 / p->dx[i];
+        p->iy[i] = 1.0 / p->dy[i];
+        p->iz[i] = 1.0 / p->dz[i];
+    }
+    if (!accel->stats.primitives)
+        return;
+
+    /* direction of the packet, to visit the nearer child first */
+    point3 dir = { 0.0, 0.0, 0.0 };
+    for (int i = 0; i < PACKET_SIZE; i++) {
+        dir[0] += p->dx[i];
+        dir[1] += p->dy[i];
+        dir[2] += p->dz[i];
+    }
+
+    int stack[BVH_STACK_SIZE], top = 0;
+    stack[top++] = 0;
+    while (top) {
+        const bvh_node *node = &accel->nodes[stack[--top]];
+        /* a node is visited while any lane can still hit inside it */
+        STATS_INC(STAT_PACKET_NODE_TESTS);
+        if (!k->node(p, node, tentry))
+            continue;
+
+        if (node->count) {
+            packet_leaf(p, scn, k, node);
+            continue;
+        }
+
+        int left = node - accel->nodes + 1, right = node->start;
+        const bvh_node *l = &accel->nodes[left], *r = &accel->nodes[right];
+        double ahead = 0.0;
+        for (int i = 0; i < 3; i++)
+            ahead += dir[i] * ((r->min[i] + r->max[i]) -
+                               (l->min[i] + l->max[i]));
+        if (ahead >= 0.0) {
+            stack[top++] = right;
+            stack[top++] = left;
+        } else {
+            stack[top++] = left;
+            stack[top++] = right;
+        }
+    }
+}
@@ -0,0 +1,68 @@
+#ifndef __RAY_PACKET_H
+#define __RAY_PACKET_H
+
+#include "scene.h"
+
+#define PACKET_SIZE 4
+
+/* Rays traced together through the scene. Lanes that carry no ray have
+ * t = -INFINITY: no hit can beat that, so they drop out of every mask.
+ */
+typedef struct {
+    real ox[PACKET_SIZE] __attribute__((aligned(32)));
+    real oy[PACKET_SIZE] __attribute__((aligned(32)));
+    real oz[PACKET_SIZE] __attribute__((aligned(32)));
+    real dx[PACKET_SIZE] __attribute__((aligned(32)));
+    real dy[PACKET_SIZE] __attribute__((aligned(32)));
+    real dz[PACKET_SIZE] __attribute__((aligned(32)));
+    /* reciprocal directions for the box tests, filled by packet_trace() */
+    real ix[PACKET_SIZE] __attribute__((aligned(32)));
+    real iy[PACKET_SIZE] __attribute__((aligned(32)));
+    real iz[PACKET_SIZE] __attribute__((aligned(32)));
+    real t[PACKET_SIZE] __attribute__((aligned(32))); /**< nearest hit */
+    int hit[PACKET_SIZE]; /**< primitive id of that hit, or SCENE_NO_HIT */
+} ray_packet;
+
+typedef enum {
+    PACKET_OFF,    /**< trace one ray at a time */
+    PACKET_SCALAR,
+    PACKET_SSE2,
+    PACKET_AVX2,
+    PACKET_AUTO,   /**< best one the CPU supports */
+} packet_isa;
+
+/* @return isa, or the best supported one if the CPU lacks it */
+packet_isa packet_select(packet_isa isa);
+const char *packet_isa_name(packet_isa isa);
+/* @return the kernels called name, -1 if there are none */
+int packet_isa_parse(const char *name);
+
+/* set lane k to the ray e + t d, searching hits up to distance t1 */
+static inline void packet_set(ray_packet *p, int k, const point3 e,
+                              const point3 d, real t1)
+{
+    p->ox[k] = e[0];
+    p->oy[k] = e[1];
+    p->oz[k] = e[2];
+    p->dx[k] = d[0];
+    p->dy[k] = d[1];
+    p->dz[k] = d[2];
+    p->t[k] = t1;
+    p->hit[k] = SCENE_NO_HIT;
+}
+
+static inline void packet_clear(ray_packet *p, int k)
+{
+    p->ox[k] = p->oy[k] = p->oz[k] = 0.0;
+    p->dx[k] = p->dy[k] = p->dz[k] = 1.0;
+    p->t[k] = -INFINITY;
+    p->hit[k] = SCENE_NO_HIT;
+}
+
+/* Find the nearest primitive of every lane. The result per lane is the
+ * same ray_hit_object() gives for that ray, ties included.
+ * @param isa an isa returned by packet_select()
+ */
+void packet_trace(ray_packet *p, const scene *scn, packet_isa isa);
+
+#endif
@@ -0,0 +1,200 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "ppm_stream.h"
+
+/* Bands go round a ring: the renderer fills the slot after the last
+ * queued one, the writer drains from head. filled counts queued slots.
+ * out, pattern, frame and rows_done belong to the writer thread.
+ */
+struct ppm_stream {
+    FILE *out;
+    char *pattern;       /**< file name per frame, NULL for one FILE */
+    int frame;
+    int rows_done;       /**< rows of the current image written */
+    double write_seconds;
+    int width, height;
+    int band_height;
+    int bands;
+    uint8_t **buf;
+    int *rows;
+    int head, filled;
+    int closing;
+    int error;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t writer;
+};
+
+static double now_seconds(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/* @return nonzero if the write failed */
+static int write_band(ppm_stream *s, const uint8_t *buf, int rows)
+{
+    /* a band never straddles two images */
+    if (s->rows_done == 0) {
+        if (s->pattern) {
+            char path[4096];
+            snprintf(path, sizeof(path), s->pattern, s->frame);
+            if (!(s->out = fopen(path, "wb")))
+                perror(path);
+        }
+        if (s->out)
+            fprintf(s->out, "P6\n%d %d\n%d\n", s->width, s->height, 255);
+    }
+    size_t size = (size_t) rows * s->width * 3;
+    int failed = !s->out || fwrite(buf, 1, size, s->out) != size;
+
+    s->rows_done += rows;
+    if (s->rows_done >= s->height) {
+        s->rows_done = 0;
+        s->frame++;
+        if (s->pattern && s->out) {
+            failed |= fclose(s->out) != 0;
+            s->out = NULL;
+        }
+    }
+    return failed;
+}
+
+static void *writer_main(void *arg)
+{
+    ppm_stream *s = arg;
+
+    pthread_mutex_lock(&s->lock);
+    for (;;) {
+        while (!s->filled && !s->closing)
+            pthread_cond_wait(&s->cond, &s->lock);
+        if (!s->filled)
+            break;
+
+        int slot = s->head;
+        pthread_mutex_unlock(&s->lock);
+        double start = now_seconds();
+        int failed = write_band(s, s->buf[slot], s->rows[slot]);
+        double spent = now_seconds() - start;
+        pthread_mutex_lock(&s->lock);
+
+        s->write_seconds += spent;
+        s->error |= failed;
+        s->head = (s->head + 1) % s->bands;
+        s->filled--;
+        pthread_cond_broadcast(&s->cond);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+static ppm_stream *stream_open(FILE *out, const char *pattern, int width,
+                               int height, int band_height, int bands)
+{
+    ppm_stream *s = calloc(1, sizeof(ppm_stream));
+    if (!s)
+        return NULL;
+    s->out = out;
+    if (pattern && !(s->pattern = strdup(pattern))) {
+        free(s);
+        return NULL;
+    }
+    s->width = width;
+    s->height = height;
+    s->band_height = band_height;
+    s->bands = bands < 2 ? 2 : bands;
+    s->buf = calloc(s->bands, sizeof(uint8_t *));
+    s->rows = calloc(s->bands, sizeof(int));
+    if (!s->buf || !s->rows)
+        goto fail;
+    for (int i = 0; i < s->bands; i++) {
+        s->buf[i] = malloc((size_t) width * band_height * 3);
+        if (!s->buf[i])
+            goto fail;
+    }
+
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+    if (pthread_create(&s->writer, NULL, writer_main, s)) {
+        pthread_cond_destroy(&s->cond);
+        pthread_mutex_destroy(&s->lock);
+        goto fail;
+    }
+    return s;
+
+fail:
+    for (int i = 0; s->buf && i < s->bands; i++)
+        free(s->buf[i]);
+    free(s->buf);
+    free(s->rows);
+    free(s->pattern);
+    free(s);
+    return NULL;
+}
+
+ppm_stream *ppm_stream_open(FILE *out, int width, int height,
+                            int band_height, int bands)
+{
+    return stream_open(out, NULL, width, height, band_height, bands);
+}
+
+ppm_stream *ppm_stream_open_frames(const char *pattern, int width,
+                                   int height, int band_height, int bands)
+{
+    return stream_open(NULL, pattern, width, height, band_height, bands);
+}
+
+uint8_t *ppm_stream_acquire(ppm_stream *s)
+{
+    pthread_mutex_lock(&s->lock);
+    while (s->filled == s->bands)
+        pthread_cond_wait(&s->cond, &s->lock);
+    int slot = (s->head + s->filled) % s->bands;
+    pthread_mutex_unlock(&s->lock);
+    return s->buf[slot];
+}
+
+double ppm_stream_write_seconds(ppm_stream *s)
+{
+    pthread_mutex_lock(&s->lock);
+    while (s->filled)
+        pthread_cond_wait(&s->cond, &s->lock);
+    double seconds = s->write_seconds;
+    pthread_mutex_unlock(&s->lock);
+    return seconds;
+}
+
+void ppm_stream_submit(ppm_stream *s, int rows)
+{
+    pthread_mutex_lock(&s->lock);
+    s->rows[(s->head + s->filled) % s->bands] = rows;
+    s->filled++;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+}
+
+int ppm_stream_close(ppm_stream *s)
+{
+    pthread_mutex_lock(&s->lock);
+    s->closing = 1;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+    pthread_join(s->writer, NULL);
+
+    int ret = (s->error || (s->out && fflush(s->out))) ? -1 : 0;
+    if (s->pattern && s->out)
+        fclose(s->out); /* closed mid-image */
+    pthread_cond_destroy(&s->cond);
+    pthread_mutex_destroy(&s->lock);
+    for (int i = 0; i < s->bands; i++)
+        free(s->buf[i]);
+    free(s->buf);
+    free(s->rows);
+    free(s->pattern);
+    free(s);
+    return ret;
+}
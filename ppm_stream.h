@@ -0,0 +1,46 @@
+#ifndef __RAY_PPM_STREAM_H
+#define __RAY_PPM_STREAM_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* Writes a PPM image band by band from a background thread, so finished
+ * rows reach the file while later rows are still being rendered. Only
+ * a fixed ring of bands is ever allocated, whatever the image height.
+ *
+ * Rows past height start the next image, so a stream can carry the
+ * frames of an animation: back to back in one file, or one file each.
+ */
+typedef struct ppm_stream ppm_stream;
+
+/* @param bands number of band buffers in the ring, at least 2
+ * @return NULL when out of memory or the thread cannot start
+ */
+ppm_stream *ppm_stream_open(FILE *out, int width, int height,
+                            int band_height, int bands);
+
+/* like ppm_stream_open, but frame n goes to the file named by
+ * printf(pattern, n)
+ */
+ppm_stream *ppm_stream_open_frames(const char *pattern, int width,
+                                   int height, int band_height, int bands);
+
+/* @return a buffer for the next band_height rows, waiting for the
+ *         writer to free one if the ring is full
+ */
+uint8_t *ppm_stream_acquire(ppm_stream *s);
+
+/* queue the band returned by the last acquire, holding rows rows */
+void ppm_stream_submit(ppm_stream *s, int rows);
+
+/* wait until the queued bands are written
+ * @return seconds the writer has spent writing
+ */
+double ppm_stream_write_seconds(ppm_stream *s);
+
+/* wait until everything is written and release the stream
+ * @return 0 on success, -1 if a write failed
+ */
+int ppm_stream_close(ppm_stream *s);
+
+#endif
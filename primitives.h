@@ -1,29 +1,43 @@
 #ifndef __RAY_PRIMITIVES_H
 #define __RAY_PRIMITIVES_H
 
-typedef double point3[3];
-typedef double point4[3];
-typedef double color[3];
+/* `make FLOAT=1` defines RAY_FLOAT and builds geometry, intersection and
+ * shading in single precision.
+ */
+#ifdef RAY_FLOAT
+typedef float real;
+/* tolerance of the intersection tests: a float hit point in a scene some
+ * tens of units across is only good to about 1e-5
+ */
+#define REAL_EPSILON 1e-3
+#else
+typedef double real;
+#define REAL_EPSILON 1e-4
+#endif
+
+typedef real point3[3];
+typedef real point4[3];
+typedef real color[3];
 
 typedef struct {
     color light_color; /**< scale (0,1) */
     point3 position;
-    double intensity;
+    real intensity;
 } light;
 
 typedef struct {
     color fill_color; /**< RGB is in terms of 0.0 to 1.0 */
-    double Kd; /**< the diffuse component */
-    double Ks; /**< the specular */
-    double T;  /**< transmittance (fraction of light passed per unit) */
-    double R;  /**< reflectance (effectiveness in reflecting)*/
-    double index_of_refraction;
-    double phong_power; /**< the Phong cosine power for highlights */
+    real Kd; /**< the diffuse component */
+    real Ks; /**< the specular */
+    real T;  /**< transmittance (fraction of light passed per unit) */
+    real R;  /**< reflectance (effectiveness in reflecting)*/
+    real index_of_refraction;
+    real phong_power; /**< the Phong cosine power for highlights */
 } object_fill;
 
 typedef struct {
     point3 center;
-    double radius;
+    real radius;
     object_fill sphere_fill;
 } sphere;
 
@@ -33,6 +47,14 @@ typedef struct {
     object_fill rectangular_fill;
 } rectangular;
 
+struct triangle_mesh;
+
+/* triangles loaded from a file, see mesh.h */
+typedef struct {
+    struct triangle_mesh *geometry; /**< emptied by scene_compile() */
+    object_fill mesh_fill;
+} mesh;
+
 typedef struct {
     point3 vrp;
     point3 vpn;
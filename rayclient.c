@@ -0,0 +1,224 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "server.h"
+#include "net.h"
+
+/* Sends render requests to a server started with raytracing -X, over
+ * one or more connections at once, and reports their latency.
+ */
+
+typedef struct {
+    const char *address;
+    render_request request;
+    point3 step;        /**< the camera moves this much per request */
+    int requests;
+    const char *out_path; /**< the last image of the first connection */
+    double *latencies;  /**< one per request */
+    int failed;
+} connection;
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-r WxH] [-A samples] [-g X,Y,WxH] [-m dx,dy,dz] "
+            "[-n requests] [-c connections] [-o file] address\n"
+            "  -r WxH        resolution (default: the server's)\n"
+            "  -A samples    adaptive anti-aliasing with up to this many "
+            "samples per pixel\n"
+            "                (default: a fixed grid of 4)\n"
+            "  -g X,Y,WxH    render only this region of the image\n"
+            "  -m dx,dy,dz   move the camera this much after each request\n"
+            "  -n requests   requests per connection (default: 1)\n"
+            "  -c number     connections sending requests at once "
+            "(default: 1)\n"
+            "  -o file       write the last image of the first connection "
+            "as PPM\n",
+            prog);
+}
+
+static int write_ppm(const char *path, const uint8_t *pixels,
+                     int width, int height)
+{
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    fprintf(f, "P6\n%d %d\n%d\n", width, height, 255);
+    fwrite(pixels, 1, (size_t) width * height * 3, f);
+    return fclose(f);
+}
+
+static void *run_connection(void *arg)
+{
+    connection *c = arg;
+    server_info info;
+    render_request r = c->request;
+    uint8_t *pixels = NULL;
+
+    int fd = server_connect(c->address, &info);
+    if (fd < 0) {
+        c->failed = 1;
+        return NULL;
+    }
+    r.view = info.view;
+    if (!r.width) {
+        r.width = info.width;
+        r.height = info.height;
+    }
+    int width = r.region.width ? r.region.width : r.width;
+    int height = r.region.height ? r.region.height : r.height;
+    if (!(pixels = malloc((size_t) width * height * 3))) {
+        fprintf(stderr, "out of memory\n");
+        c->failed = 1;
+        close(fd);
+        return NULL;
+    }
+
+    for (int i = 0; i < c->requests; i++) {
+        render_reply reply;
+        double start = monotonic_seconds();
+        if (server_render(fd, &r, pixels, &reply) < 0) {
+            fprintf(stderr, "%s: lost the server\n", c->address);
+            c->failed = 1;
+            break;
+        }
+        if (reply.status < 0) {
+            fprintf(stderr, "%s: request refused\n", c->address);
+            c->failed = 1;
+            break;
+        }
+        c->latencies[i] = monotonic_seconds() - start;
+        for (int k = 0; k < 3; k++)
+            r.view.vrp[k] += c->step[k];
+    }
+    if (!c->failed && c->out_path &&
+            write_ppm(c->out_path, pixels, width, height) < 0)
+        c->failed = 1;
+    free(pixels);
+    close(fd);
+    return NULL;
+}
+
+static int compare_seconds(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/* nearest rank percentile p of n sorted values */
+static double percentile(const double *sorted, int n, double p)
+{
+    int rank = (int) (p / 100.0 * n + 0.999999);
+    return sorted[rank < 1 ? 0 : rank > n ? n - 1 : rank - 1];
+}
+
+int main(int argc, char *argv[])
+{
+    render_request request = { .samples = 0 };
+    point3 step = { 0, 0, 0 };
+    int requests = 1, nconnections = 1, opt, failed = 0;
+    const char *out_path = NULL;
+
+    while ((opt = getopt(argc, argv, "r:A:g:m:n:c:o:h")) != -1) {
+        switch (opt) {
+        case 'r':
+            if (sscanf(optarg, "%dx%d", &request.width,
+                       &request.height) != 2 ||
+                    request.width < 2 || request.height < 2) {
+                fprintf(stderr, "bad resolution %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'A':
+            request.samples = atoi(optarg);
+            break;
+        case 'g':
+            if (sscanf(optarg, "%d,%d,%dx%d", &request.region.x,
+                       &request.region.y, &request.region.width,
+                       &request.region.height) != 4 ||
+                    request.region.width < 1 || request.region.height < 1) {
+                fprintf(stderr, "bad region %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'm': {
+            double d[3];
+            if (sscanf(optarg, "%lf,%lf,%lf", &d[0], &d[1], &d[2]) != 3) {
+                fprintf(stderr, "bad camera step %s\n", optarg);
+                return -1;
+            }
+            for (int k = 0; k < 3; k++)
+                step[k] = d[k];
+            break;
+        }
+        case 'n':
+            requests = atoi(optarg);
+            break;
+        case 'c':
+            nconnections = atoi(optarg);
+            break;
+        case 'o':
+            out_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : -1;
+        }
+    }
+    if (optind != argc - 1 || requests < 1 || nconnections < 1) {
+        usage(argv[0]);
+        return -1;
+    }
+    if (request.region.width && !request.width) {
+        fprintf(stderr, "-g needs -r\n");
+        return -1;
+    }
+
+    connection *c = calloc(nconnections, sizeof(connection));
+    pthread_t *threads = malloc(sizeof(pthread_t) * nconnections);
+    double *latencies = malloc(sizeof(double) * nconnections * requests);
+    if (!c || !threads || !latencies) {
+        fprintf(stderr, "out of memory\n");
+        return -1;
+    }
+
+    double start = monotonic_seconds();
+    for (int i = 0; i < nconnections; i++) {
+        c[i] = (connection) {
+            .address = argv[optind],
+            .request = request,
+            .requests = requests,
+            .out_path = i ? NULL : out_path,
+            .latencies = latencies + i * requests,
+        };
+        COPY_POINT3(c[i].step, step);
+        pthread_create(&threads[i], NULL, run_connection, &c[i]);
+    }
+    for (int i = 0; i < nconnections; i++) {
+        pthread_join(threads[i], NULL);
+        failed |= c[i].failed;
+    }
+    double seconds = monotonic_seconds() - start;
+
+    if (!failed) {
+        int n = nconnections * requests;
+        qsort(latencies, n, sizeof(double), compare_seconds);
+        printf("# %d requests on %d connection(s) in %lf sec, "
+               "%.1f per sec\n", n, nconnections, seconds, n / seconds);
+        printf("# Latency ms: p50 %.3f, p90 %.3f, p99 %.3f, max %.3f\n",
+               1000 * percentile(latencies, n, 50),
+               1000 * percentile(latencies, n, 90),
+               1000 * percentile(latencies, n, 99),
+               1000 * latencies[n - 1]);
+    }
+    free(latencies);
+    free(threads);
+    free(c);
+    return failed ? -1 : 0;
+}
@@ -1,32 +1,43 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "math-toolkit.h"
 #include "primitives.h"
 #include "raytracing.h"
 #include "idx_stack.h"
+#include "scheduler.h"
+#include "scene.h"
+#include "packet.h"
+#include "stats.h"
 
-#define MAX_REFLECTION_BOUNCES	3
 #define MAX_DISTANCE 1000000000000.0
+/* offset of secondary rays from the surface they leave; in float, shadow
+ * rays grazing a sphere find its own surface again below about 1e-3
+ */
+#ifdef RAY_FLOAT
+#define MIN_DISTANCE 0.005
+#else
 #define MIN_DISTANCE 0.00001
+#endif
 #define SAMPLES 4
 
 #define SQUARE(x) (x * x)
 #define MAX(a, b) (a > b ? a : b)
 
-/* @param t t distance
+/* distance only, for shadow rays that never need the hit point
+ * @param t t distance
  * @return 1 means hit, otherwise 0
  */
-static int raySphereIntersection(const point3 ray_e,
-                                 const point3 ray_d,
-                                 const sphere *sph,
-                                 intersection *ip, double *t1)
+static int raySphereDistance(const point3 ray_e, const point3 ray_d,
+                             const point3 center, real r2,
+                             real *t1)
 {
     point3 l;
-    subtract_vector(sph->center, ray_e, l);
-    double s = dot_product(l, ray_d);
-    double l2 = dot_product(l, l);
-    double r2 = sph->radius * sph->radius;
+    subtract_vector(center, ray_e, l);
+    real s = dot_product(l, ray_d);
+    real l2 = dot_product(l, l);
 
     if (s < 0 && l2 > r2)
         return 0;
@@ -35,89 +46,191 @@ static int raySphereIntersection(const point3 ray_e,
         return 0;
     float q = sqrt(r2 - m2);
     *t1 = (l2 > r2) ? (s - q) : (s + q);
+    return 1;
+}
+
+/* @param t t distance
+ * @return 1 means hit, otherwise 0
+ */
+static int raySphereIntersection(const point3 ray_e,
+                                 const point3 ray_d,
+                                 const point3 center, real r2,
+                                 intersection *ip, real *t1)
+{
+    if (!raySphereDistance(ray_e, ray_d, center, r2, t1))
+        return 0;
+
     /* p = e + t1 * d */
     multiply_vector(ray_d, *t1, ip->point);
     add_vector(ray_e, ip->point, ip->point);
 
-    subtract_vector(ip->point, sph->center, ip->normal);
+    subtract_vector(ip->point, center, ip->normal);
     normalize(ip->normal);
     if (dot_product(ip->normal, ray_d) > 0.0)
         multiply_vector(ip->normal, -1, ip->normal);
     return 1;
 }
 
-/* @return 1 means hit, otherwise 0; */
-static int rayRectangularIntersection(const point3 ray_e,
-                                      const point3 ray_d,
-                                      rectangular *rec,
-                                      intersection *ip, double *t1)
+static inline int next_axis(int k)
+{
+    return k == 2 ? 0 : k + 1;
+}
+
+/* Möller-Trumbore for a triangle at o whose edges a and b run along
+ * axes i and j. It is the arithmetic of the general test with the terms
+ * that the zero components of a and b cancel left out, so it gives the
+ * same results to the last bit.
+ * @return 0 if the ray is parallel to or behind the triangle, leaving
+ *         alpha, beta and t unset
+ */
+static int axisTriangle(const point3 ray_e, const point3 ray_d,
+                        const point3 o, real a, int i, real b, int j,
+                        real *alpha, real *beta, real *t)
+{
+    int j1 = next_axis(j), j2 = next_axis(j1);
+    int i1 = next_axis(i), i2 = next_axis(i1);
+    point3 p, q, s;
+
+    /* p = d x b, det = a . p */
+    p[j] = 0.0;
+    p[j1] = ray_d[j2] * b;
+    p[j2] = -(ray_d[j1] * b);
+    real det = a * p[i];
+    if (det < REAL_EPSILON)
+        return 0;
+    real inv_det = 1.0 / det;
+
+    subtract_vector(ray_e, o, s);
+    *alpha = inv_det * (s[j1] * p[j1] + s[j2] * p[j2]);
+
+    /* q = s x a */
+    q[i] = 0.0;
+    q[i1] = s[i2] * a;
+    q[i2] = -(s[i1] * a);
+    *beta = inv_det * (ray_d[i1] * q[i1] + ray_d[i2] * q[i2]);
+    *t = inv_det * (b * q[j]);
+    return 1;
+}
+
+/* rayRectangularDistance() for a rectangular whose edges all run along
+ * axes, as walls and floors do
+ */
+static int rayAlignedRectangularDistance(const point3 ray_e,
+                                         const point3 ray_d,
+                                         const point3 v0, const point3 v2,
+                                         const rectangular_record *r,
+                                         real *t1)
+{
+    int a = r->axis[0], b = r->axis[1];
+    real alpha, beta;
+
+    if (!axisTriangle(ray_e, ray_d, v0, r->e01[a], a, r->e03[b], b,
+                      &alpha, &beta, t1))
+        return 0;
+    if ((alpha > 1.0) || (alpha < 0.0) || (beta > 1.0) || (beta < 0.0))
+        return 0;
+
+    if (alpha + beta > 1.0f) {
+        /* for the second triangle */
+        a = r->axis[2];
+        b = r->axis[3];
+        if (!axisTriangle(ray_e, ray_d, v2, r->e23[a], a, r->e21[b], b,
+                          &alpha, &beta, t1))
+            return 0;
+        if ((alpha < 0.0) || (beta < 0.0) || (beta + alpha > 1.0))
+            return 0;
+    }
+
+    if (*t1 < REAL_EPSILON)
+        return 0;
+    return 1;
+}
+
+/* distance only, for shadow rays that never need the hit point
+ * @param v0, v2 vertices[0] and vertices[2] of the rectangular
+ * @param r its precomputed edges
+ * @return 1 means hit, otherwise 0;
+ */
+static int rayRectangularDistance(const point3 ray_e, const point3 ray_d,
+                                  const point3 v0, const point3 v2,
+                                  const rectangular_record *r, real *t1)
 {
-    point3 e01, e03, p;
-    subtract_vector(rec->vertices[1], rec->vertices[0], e01);
-    subtract_vector(rec->vertices[3], rec->vertices[0], e03);
+    point3 p;
 
-    cross_product(ray_d, e03, p);
+    if (r->aligned)
+        return rayAlignedRectangularDistance(ray_e, ray_d, v0, v2, r, t1);
 
-    double det = dot_product(e01, p);
+    cross_product(ray_d, r->e03, p);
+
+    real det = dot_product(r->e01, p);
 
     /* Reject rays orthagonal to the normal vector.
      * I.e. rays parallell to the plane.
      */
-    if (det < 1e-4)
+    if (det < REAL_EPSILON)
         return 0;
 
-    double inv_det = 1.0 / det;
+    real inv_det = 1.0 / det;
 
     point3 s;
-    subtract_vector(ray_e, rec->vertices[0], s);
+    subtract_vector(ray_e, v0, s);
 
-    double alpha = inv_det * dot_product(s, p);
+    real alpha = inv_det * dot_product(s, p);
 
     if ((alpha > 1.0) || (alpha < 0.0))
         return 0;
 
     point3 q;
-    cross_product(s, e01, q);
+    cross_product(s, r->e01, q);
 
-    double beta = inv_det * dot_product(ray_d, q);
+    real beta = inv_det * dot_product(ray_d, q);
     if ((beta > 1.0) || (beta < 0.0))
         return 0;
 
-    *t1 = inv_det * dot_product(e03, q);
+    *t1 = inv_det * dot_product(r->e03, q);
 
     if (alpha + beta > 1.0f) {
         /* for the second triangle */
-        point3 e23, e21;
-        subtract_vector(rec->vertices[3], rec->vertices[2], e23);
-        subtract_vector(rec->vertices[1], rec->vertices[2], e21);
-
-        cross_product(ray_d, e21, p);
+        cross_product(ray_d, r->e21, p);
 
-        det = dot_product(e23, p);
+        det = dot_product(r->e23, p);
 
-        if (det < 1e-4)
+        if (det < REAL_EPSILON)
             return 0;
 
         inv_det = 1.0 / det;
-        subtract_vector(ray_e, rec->vertices[2], s);
+        subtract_vector(ray_e, v2, s);
 
         alpha = inv_det * dot_product(s, p);
         if (alpha < 0.0)
             return 0;
 
-        cross_product(s, e23, q);
+        cross_product(s, r->e23, q);
         beta = inv_det * dot_product(ray_d, q);
 
         if ((beta < 0.0) || (beta + alpha > 1.0))
             return 0;
 
-        *t1 = inv_det * dot_product(e21, q);
+        *t1 = inv_det * dot_product(r->e21, q);
     }
 
-    if (*t1 < 1e-4)
+    if (*t1 < REAL_EPSILON)
+        return 0;
+    return 1;
+}
+
+/* @return 1 means hit, otherwise 0; */
+static int rayRectangularIntersection(const point3 ray_e,
+                                      const point3 ray_d,
+                                      const point3 v0, const point3 v2,
+                                      const rectangular_record *r,
+                                      const point3 normal,
+                                      intersection *ip, real *t1)
+{
+    if (!rayRectangularDistance(ray_e, ray_d, v0, v2, r, t1))
         return 0;
 
-    COPY_POINT3(ip->normal, rec->normal);
+    COPY_POINT3(ip->normal, normal);
     if (dot_product(ip->normal, ray_d)>0.0)
         multiply_vector(ip->normal, -1, ip->normal);
     multiply_vector(ray_d, *t1, ip->point);
@@ -127,8 +240,8 @@ static int rayRectangularIntersection(const point3 ray_e,
 }
 
 static void localColor(color local_color,
-                       const color light_color, double diffuse,
-                       double specular, const object_fill *fill)
+                       const color light_color, real diffuse,
+                       real specular, const object_fill *fill)
 {
     color ambi = { 0.1, 0.1, 0.1 };
     color diff, spec, lightCo, surface;
@@ -158,10 +271,10 @@ static void localColor(color local_color,
  * @param l direction of intersection to light
  * @param n surface normal
  */
-static void compute_specular_diffuse(double *diffuse,
-                                     double *specular,
+static void compute_specular_diffuse(real *diffuse,
+                                     real *specular,
                                      const point3 d, const point3 l,
-                                     const point3 n, double phong_pow)
+                                     const point3 n, real phong_pow)
 {
     point3 d_copy, l_copy, middle, r;
 
@@ -176,7 +289,7 @@ static void compute_specular_diffuse(double *diffuse,
     normalize(l_copy);
 
     /* Calculate reflection direction R */
-    double tmp = dot_product(n, l_copy);
+    real tmp = dot_product(n, l_copy);
     multiply_vector(n, tmp, middle);
     multiply_vector(middle, 2, middle);
     subtract_vector(middle, l_copy, r);
@@ -200,18 +313,20 @@ static void reflection(point3 r, const point3 d, const point3 n)
     add_vector(r, d, r);
 }
 
-/* reference: https://www.opengl.org/sdk/docs/man/html/refract.xhtml */
-static void refraction(point3 t, const point3 I, const point3 N,
-                       double n1, double n2)
+/* reference: https://www.opengl.org/sdk/docs/man/html/refract.xhtml
+ * (its I is spelled In here, as <tgmath.h> takes I for the imaginary unit)
+ */
+static void refraction(point3 t, const point3 In, const point3 N,
+                       real n1, real n2)
 {
-    double eta = n1 / n2;
-    double dot_NI = dot_product(N,I);
-    double k = 1.0 - eta * eta * (1.0 - dot_NI * dot_NI);
+    real eta = n1 / n2;
+    real dot_NI = dot_product(N,In);
+    real k = 1.0 - eta * eta * (1.0 - dot_NI * dot_NI);
     if (k < 0.0 || n2 <= 0.0)
         t[0] = t[1] = t[2] = 0.0;
     else {
         point3 tmp;
-        multiply_vector(I, eta, t);
+        multiply_vector(In, eta, t);
         multiply_vector(N, eta * dot_NI + sqrt(k), tmp);
         subtract_vector(t, tmp, t);
     }
@@ -225,65 +340,218 @@ static void refraction(point3 t, const point3 I, const point3 N,
  *
  * reference: http://graphics.stanford.edu/courses/cs148-10-summer/docs/2006--degreve--reflection_refraction.pdf
  */
-static double fresnel(const point3 r, const point3 l,
-                      const point3 normal, double n1, double n2)
+static real fresnel(const point3 r, const point3 l,
+                      const point3 normal, real n1, real n2)
 {
     /* TIR */
     if (length(l) < 0.99)
         return 1.0;
-    double cos_theta_i = -dot_product(r, normal);
-    double cos_theta_t = -dot_product(l, normal);
-    double r_vertical_root = (n1 * cos_theta_i - n2 * cos_theta_t) /
+    real cos_theta_i = -dot_product(r, normal);
+    real cos_theta_t = -dot_product(l, normal);
+    real r_vertical_root = (n1 * cos_theta_i - n2 * cos_theta_t) /
                              (n1 * cos_theta_i + n2 * cos_theta_t);
-    double r_parallel_root = (n2 * cos_theta_i - n1 * cos_theta_t) /
+    real r_parallel_root = (n2 * cos_theta_i - n1 * cos_theta_t) /
                              (n2 * cos_theta_i + n1 * cos_theta_t);
     return (r_vertical_root * r_vertical_root +
             r_parallel_root * r_parallel_root) / 2.0;
 }
 
-/* @param t distance */
+/* @param t_max farthest hit of interest; only meshes make use of it
+ * @return 1 means hit, otherwise 0
+ */
+static int ray_hit_primitive(const point3 e, const point3 d,
+                             const scene *scn, int id, real t_max,
+                             intersection *ip, real *t1)
+{
+    if (scene_is_mesh(scn, id)) {
+        STATS_INC(STAT_MESH_TESTS);
+        return mesh_intersect(scene_mesh(scn, id), e, d, t_max, ip, t1);
+    }
+    if (scene_is_sphere(scn, id)) {
+        int i = id - scn->rectangulars.count;
+        point3 center;
+        STATS_INC(STAT_SPHERE_TESTS);
+        point3_array_get(&scn->spheres.center, i, center);
+        return raySphereIntersection(e, d, center, scn->spheres.radius2[i],
+                                     ip, t1);
+    }
+
+    point3 v0, v2, normal;
+    STATS_INC(STAT_RECTANGULAR_TESTS);
+    point3_array_get(&scn->rectangulars.vertices[0], id, v0);
+    point3_array_get(&scn->rectangulars.vertices[2], id, v2);
+    point3_array_get(&scn->rectangulars.normal, id, normal);
+    return rayRectangularIntersection(e, d, v0, v2,
+                                      &scn->rectangulars.records[id],
+                                      normal, ip, t1);
+}
+
+/* @param t distance
+ * @param hit id of the nearest primitive, SCENE_NO_HIT if none
+ */
 static intersection ray_hit_object(const point3 e, const point3 d,
-                                   double t0, double t1,
-                                   const rectangular_node rectangulars,
-                                   rectangular_node *hit_rectangular,
-                                   const sphere_node spheres,
-                                   sphere_node *hit_sphere)
+                                   real t0, real t1,
+                                   const scene *scn, int *hit)
 {
-    /* set these to not hit */
-    *hit_rectangular = NULL;
-    *hit_sphere = NULL;
+    const bvh *accel = &scn->accel;
+
+    /* set this to not hit */
+    *hit = SCENE_NO_HIT;
 
-    point3 biased_e;
+    point3 biased_e, inv_d;
     multiply_vector(d, t0, biased_e);
     add_vector(biased_e, e, biased_e);
+    for (int i = 0; i < 3; i++)
+        inv_d[i] = 1.0 / d[i];
 
-    double nearest = t1;
+    real nearest = t1;
     intersection result, tmpresult;
 
-    for (rectangular_node rec = rectangulars; rec; rec = rec->next) {
-        if (rayRectangularIntersection(biased_e, d, &(rec->element),
-                                       &tmpresult, &t1) && (t1 < nearest)) {
-            /* hit is closest so far */
-            *hit_rectangular = rec;
-            nearest = t1;
-            result = tmpresult;
-        }
+    /* pending nodes with the distance at which the ray enters them */
+    struct {
+        int node;
+        real t;
+    } stack[BVH_STACK_SIZE];
+    int top = 0;
+
+    if (accel->stats.primitives) {
+        STATS_INC(STAT_NODE_TESTS);
+        stack[top].node = 0;
+        stack[top++].t = bvh_node_hit(&accel->nodes[0], biased_e,
+                                      inv_d, nearest);
     }
+    while (top) {
+        top--;
+        if (stack[top].t > nearest)
+            continue;
+        const bvh_node *node = &accel->nodes[stack[top].node];
+
+        if (!node->count) {
+            /* push the farther child first so the nearer one is visited
+             * first and shrinks nearest early
+             */
+            int left = node - accel->nodes + 1, right = node->start;
+            STATS_ADD(STAT_NODE_TESTS, 2);
+            real tl = bvh_node_hit(&accel->nodes[left], biased_e,
+                                     inv_d, nearest);
+            real tr = bvh_node_hit(&accel->nodes[right], biased_e,
+                                     inv_d, nearest);
+            if (tl > tr) {
+                int tmp = left;
+                left = right;
+                right = tmp;
+                real t = tl;
+                tl = tr;
+                tr = t;
+            }
+            if (tr <= nearest) {
+                stack[top].node = right;
+                stack[top++].t = tr;
+            }
+            if (tl <= nearest) {
+                stack[top].node = left;
+                stack[top++].t = tl;
+            }
+            continue;
+        }
 
-    /* check the spheres */
-    for (sphere_node sphere = spheres; sphere; sphere = sphere->next) {
-        if (raySphereIntersection(biased_e, d, &(sphere->element),
-                                  &tmpresult, &t1) && (t1 < nearest)) {
-            *hit_sphere = sphere;
-            *hit_rectangular = NULL;
-            nearest = t1;
-            result = tmpresult;
+        for (int i = node->start; i < node->start + node->count; i++) {
+            int id = accel->prims[i];
+            /* ties go to the lower id, the order of the old lists */
+            if (ray_hit_primitive(biased_e, d, scn, id, nearest,
+                                  &tmpresult, &t1) &&
+                    (t1 < nearest || (t1 == nearest && id < *hit))) {
+                /* hit is closest so far */
+                *hit = id;
+                nearest = t1;
+                result = tmpresult;
+            }
         }
     }
 
     return result;
 }
 
+/* @return 1 if primitive id lies on the ray closer than t1, otherwise 0 */
+static int ray_blocked_by(const point3 e, const point3 d,
+                          const scene *scn, int id, real t1)
+{
+    real t;
+
+    if (scene_is_mesh(scn, id)) {
+        STATS_INC(STAT_MESH_TESTS);
+        return mesh_occluded(scene_mesh(scn, id), e, d, t1);
+    }
+    if (scene_is_sphere(scn, id)) {
+        int i = id - scn->rectangulars.count;
+        point3 center;
+        STATS_INC(STAT_SPHERE_TESTS);
+        point3_array_get(&scn->spheres.center, i, center);
+        return raySphereDistance(e, d, center, scn->spheres.radius2[i],
+                                 &t) && t < t1;
+    }
+
+    point3 v0, v2;
+    STATS_INC(STAT_RECTANGULAR_TESTS);
+    point3_array_get(&scn->rectangulars.vertices[0], id, v0);
+    point3_array_get(&scn->rectangulars.vertices[2], id, v2);
+    return rayRectangularDistance(e, d, v0, v2,
+                                  &scn->rectangulars.records[id], &t) &&
+           t < t1;
+}
+
+/* Any-hit query for shadow rays: is anything in the way before t1?
+ * Stops at the first blocker instead of searching for the nearest one.
+ * @param last primitive that blocked this light last time, tried first
+ *        and updated with the new blocker
+ */
+static int ray_occluded(const point3 e, const point3 d, real t0,
+                        real t1, const scene *scn, int *last)
+{
+    const bvh *accel = &scn->accel;
+    point3 biased_e, inv_d;
+
+    multiply_vector(d, t0, biased_e);
+    add_vector(biased_e, e, biased_e);
+
+    /* neighbouring shading points are usually blocked by the same thing */
+    if (*last != SCENE_NO_HIT &&
+            ray_blocked_by(biased_e, d, scn, *last, t1)) {
+        STATS_INC(STAT_OCCLUDER_HITS);
+        return 1;
+    }
+
+    if (!accel->stats.primitives)
+        return 0;
+
+    for (int i = 0; i < 3; i++)
+        inv_d[i] = 1.0 / d[i];
+
+    int stack[BVH_STACK_SIZE], top = 0;
+    stack[top++] = 0;
+    while (top) {
+        const bvh_node *node = &accel->nodes[stack[--top]];
+        STATS_INC(STAT_NODE_TESTS);
+        if (bvh_node_hit(node, biased_e, inv_d, t1) > t1)
+            continue;
+
+        if (!node->count) {
+            stack[top++] = node->start;
+            stack[top++] = node - accel->nodes + 1;
+            continue;
+        }
+
+        for (int i = node->start; i < node->start + node->count; i++) {
+            int id = accel->prims[i];
+            if (id != *last && ray_blocked_by(biased_e, d, scn, id, t1)) {
+                *last = id;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
 /* @param d direction of ray
  * @param w basic vectors
  */
@@ -292,17 +560,17 @@ static void rayConstruction(point3 d, const point3 u, const point3 v,
                             const viewpoint *view, unsigned int width,
                             unsigned int height)
 {
-    double xmin = -0.0175;
-    double ymin = -0.0175;
-    double xmax =  0.0175;
-    double ymax =  0.0175;
-    double focal = 0.05;
+    real xmin = -0.0175;
+    real ymin = -0.0175;
+    real xmax =  0.0175;
+    real ymax =  0.0175;
+    real focal = 0.05;
 
     point3 u_tmp, v_tmp, w_tmp, s;
 
-    double w_s = focal;
-    double u_s = xmin + ((xmax - xmin) * (float) i / (width - 1));
-    double v_s = ymax + ((ymin - ymax) * (float) j / (height - 1));
+    real w_s = focal;
+    real u_s = xmin + ((xmax - xmin) * (float) i / (width - 1));
+    real v_s = ymax + ((ymin - ymax) * (float) j / (height - 1));
 
     /* s = e + u_s * u + v_s * v + w_s * w */
     multiply_vector(u, u_s, u_tmp);
@@ -334,6 +602,26 @@ static void calculateBasisVectors(point3 u, point3 v, point3 w,
     normalize(v);
 }
 
+static int finite_vector(const real *v)
+{
+    return isfinite(v[0]) && isfinite(v[1]) && isfinite(v[2]);
+}
+
+int view_valid(const viewpoint *view)
+{
+    point3 w, u;
+
+    if (!finite_vector(view->vrp) || !finite_vector(view->vup))
+        return 0;
+    real d = length(view->vpn);
+    if (!(d > 0.0 && isfinite(d)))
+        return 0;
+    multiply_vector(view->vpn, 1.0 / d, w);
+    cross_product(view->vup, w, u);
+    d = length(u);
+    return d > 0.0 && isfinite(d);
+}
+
 /* @brief protect color value overflow */
 static void protect_color_overflow(color c)
 {
@@ -341,158 +629,1544 @@ static void protect_color_overflow(color c)
         if (c[i] > 1.0) c[i] = 1.0;
 }
 
-static unsigned int ray_color(const point3 e, double t,
-                              const point3 d,
-                              idx_stack *stk,
-                              const rectangular_node rectangulars,
-                              const sphere_node spheres,
-                              const light_node lights,
-                              color object_color, int bounces_left)
-{
-    rectangular_node hit_rec = NULL, light_hit_rec = NULL;
-    sphere_node hit_sphere = NULL, light_hit_sphere = NULL;
-    double diffuse, specular;
-    point3 l, _l, r, rr;
-    object_fill fill;
-
-    color reflection_part;
-    color refraction_part;
-    /* might be a reflection ray, so check how many times we've bounced */
-    if (bounces_left == 0) {
-        SET_COLOR(object_color, 0.0, 0.0, 0.0);
-        return 0;
+/* One hit of the ray tree, waiting for its secondary rays. The tree is
+ * walked depth first on a stack of these, one per bounce, and each hit
+ * adds its branches in once they are done.
+ */
+typedef struct {
+    color c;            /**< local color plus the branches done so far */
+    point3 point;
+    point3 dir[2];      /**< reflected and refracted direction */
+    real weight[2];     /**< of the reflection and refraction branch */
+    int live;           /**< bit k: branch k is to be traced */
+    int next;           /**< branch to look at next, 2 when done */
+    real throughput;    /**< weight of this hit in the sample */
+    real pending;       /**< weight of the branch on the frame above */
+    idx_stack_element entered; /**< medium this hit enters */
+    const idx_stack_element *inside; /**< media past this hit */
+} ray_frame;
+
+/* Many-light mode. Lights fall off with the inverse square of the
+ * distance, capped at 1, and a light whose falloff at a hit is below
+ * cutoff is skipped there: it reaches no farther than the radius where
+ * falloff meets cutoff, and a BVH over those spheres finds the lights
+ * that reach a point.
+ */
+typedef struct {
+    real cutoff;     /**< 0 keeps every light */
+    int samples;     /**< lights picked per hit, 0 shades all that reach */
+    bvh tree;        /**< over the spheres of reach, when cutoff > 0 */
+} light_culling;
+
+typedef struct wavefront wavefront;
+
+/* scratch state owned by one worker thread */
+typedef struct {
+    int *last_occluder; /**< per light, primitive that blocked it last */
+    const light_culling *culling; /**< NULL for the classic shading */
+    int *light_ids;     /**< many-light: lights reaching the hit */
+    real *light_weights; /**< their falloff, then selection cdf */
+    ray_frame *frames;  /**< max_bounces of them */
+    int max_bounces;
+    real min_weight;    /**< branches weighing less are cut */
+    int roulette;       /**< cut them only at random, boosting survivors */
+    uint32_t rng;       /**< xorshift state, reseeded per pixel */
+    const tile_deps *deps; /**< grid the rays are tracked in, if any */
+    uint64_t *deps_bits; /**< of the tile being rendered */
+    wavefront *wave;    /**< batches of ray trees, made on first use */
+    ray_stats rays;
+    render_counters counters; /**< only counted with RAY_STATS */
+} worker_state;
+
+/* track the ray from e that ends at p, or passes it when hit is
+ * SCENE_NO_HIT, toward direction d
+ */
+static void track_ray(worker_state *ws, const point3 e, const point3 d,
+                      int hit, const point3 p)
+{
+    point3 end;
+
+    if (!ws->deps_bits)
+        return;
+    if (hit == SCENE_NO_HIT) {
+        multiply_vector(d, MAX_DISTANCE, end);
+        add_vector(e, end, end);
+        p = end;
     }
+    deps_mark(ws->deps, ws->deps_bits, e, p);
+}
 
-    /* check for intersection with a sphere or a rectangular */
-    intersection ip= ray_hit_object(e, d, t, MAX_DISTANCE, rectangulars,
-                                    &hit_rec, spheres, &hit_sphere);
-    if (!hit_rec && !hit_sphere)
-        return 0;
+/* @return uniform in [0, 1) */
+static real next_random(uint32_t *state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return (x >> 8) / 16777216.0;
+}
 
-    /* pick the fill of the object that was hit */
-    fill = hit_rec ?
-           hit_rec->element.rectangular_fill :
-           hit_sphere->element.sphere_fill;
+/* trace the shadow ray from the hit at ip to light i
+ * @param l set to the vector from the light to the hit
+ * @return 1 if nothing is in the way
+ */
+static int light_visible(const intersection *ip, int i, point3 l,
+                         const scene *scn, worker_state *ws)
+{
+    point3 position, _l;
+
+    point3_array_get(&scn->lights.position, i, position);
+    /* calculate the intersection vector pointing at the light */
+    subtract_vector(ip->point, position, l);
+    multiply_vector(l, -1, _l);
+    normalize(_l);
+    /* check for any object between the hit and the light */
+    ws->rays.shadow++;
+    track_ray(ws, ip->point, _l, 0, position);
+    STATS_TIMER_START(shadow_start);
+    int occluded = ray_occluded(ip->point, _l, MIN_DISTANCE, length(l),
+                                scn, &ws->last_occluder[i]);
+    STATS_TIMER_STOP(STAGE_SHADOW, shadow_start);
+    return !occluded;
+}
 
-    void *hit_obj = hit_rec ? (void *) hit_rec : (void *) hit_sphere;
+/* add light i, seen from the hit at ip along l, to c scaled by scale */
+static void add_light(color c, int i, real scale, const point3 l,
+                      const intersection *ip, const point3 d,
+                      const object_fill *fill, const scene *scn)
+{
+    real diffuse, specular;
+    color local = { 0.0, 0.0, 0.0 };
+
+    compute_specular_diffuse(&diffuse, &specular, d, l, ip->normal,
+                             fill->phong_power);
+    localColor(local, scn->lights.light_color[i], diffuse, specular, fill);
+    multiply_vector(local, scale, local);
+    add_vector(c, local, c);
+}
 
-    /* assume it is a shadow */
-    SET_COLOR(object_color, 0.0, 0.0, 0.0);
-
-    for (light_node light = lights; light; light = light->next) {
-        /* calculate the intersection vector pointing at the light */
-        subtract_vector(ip.point, light->element.position, l);
-        multiply_vector(l, -1, _l);
-        normalize(_l);
-        /* check for intersection with an object. use ignore_me
-         * because we don't care about this normal
-        */
-        ray_hit_object(ip.point, _l, MIN_DISTANCE, length(l),
-                       rectangulars, &light_hit_rec,
-                       spheres, &light_hit_sphere);
-        /* the light was not block by itself(lit object) */
-        if (light_hit_rec || light_hit_sphere)
+/* add light i to c, scaled by scale, if it sees the hit */
+static void shade_light(color c, int i, real scale, const intersection *ip,
+                        const point3 d, const object_fill *fill,
+                        const scene *scn, worker_state *ws)
+{
+    point3 l;
+
+    if (light_visible(ip, i, l, scn, ws))
+        add_light(c, i, scale, l, ip, d, fill, scn);
+}
+
+/* falloff of light i at p, 0 below the cutoff */
+static real light_falloff(const scene *scn, const light_culling *lc,
+                          int i, const point3 p)
+{
+    point3 position, l;
+
+    point3_array_get(&scn->lights.position, i, position);
+    subtract_vector(p, position, l);
+    real d2 = dot_product(l, l);
+    real intensity = scn->lights.intensity[i];
+    real falloff = intensity >= d2 ? 1.0 : intensity / d2;
+    return falloff >= lc->cutoff && falloff > 0 ? falloff : 0.0;
+}
+
+/* the lights reaching p, into ws->light_ids and ws->light_weights
+ * @return how many
+ */
+static int lights_reaching(const point3 p, const scene *scn,
+                           worker_state *ws)
+{
+    const light_culling *lc = ws->culling;
+    int n = 0;
+
+    if (!lc->tree.nodes) {
+        for (int i = 0; i < scn->lights.count; i++) {
+            real falloff = light_falloff(scn, lc, i, p);
+            if (falloff > 0) {
+                ws->light_ids[n] = i;
+                ws->light_weights[n++] = falloff;
+            }
+        }
+        return n;
+    }
+
+    int stack[BVH_STACK_SIZE], top = 0;
+    stack[top++] = 0;
+    while (top) {
+        const bvh_node *node = &lc->tree.nodes[stack[--top]];
+        if (!bvh_node_contains(node, p))
+            continue;
+        if (!node->count) {
+            stack[top++] = node->start;
+            stack[top++] = node - lc->tree.nodes + 1;
             continue;
+        }
+        for (int k = node->start; k < node->start + node->count; k++) {
+            int i = lc->tree.prims[k];
+            real falloff = light_falloff(scn, lc, i, p);
+            if (falloff > 0) {
+                ws->light_ids[n] = i;
+                ws->light_weights[n++] = falloff;
+            }
+        }
+    }
+    return n;
+}
 
-        compute_specular_diffuse(&diffuse, &specular, d, l,
-                                 ip.normal, fill.phong_power);
+static real luminance(const color c)
+{
+    return 0.2126 * c[0] + 0.7152 * c[1] + 0.0722 * c[2];
+}
+
+/* Many-light shading of the hit at ip: every light that reaches it, or
+ * when there are more than culling->samples, that many drawn in
+ * proportion to falloff times brightness and weighted by the inverse of
+ * their odds, which keeps the expected color that of shading them all.
+ */
+static void shade_many_lights(color c, const intersection *ip,
+                              const point3 d, const object_fill *fill,
+                              const scene *scn, worker_state *ws)
+{
+    const light_culling *lc = ws->culling;
+    int n = lights_reaching(ip->point, scn, ws);
+
+    STATS_ADD(STAT_LIGHTS_CULLED, scn->lights.count - n);
+    if (!lc->samples || n <= lc->samples) {
+        for (int k = 0; k < n; k++)
+            shade_light(c, ws->light_ids[k], ws->light_weights[k], ip, d,
+                        fill, scn, ws);
+        return;
+    }
 
-        localColor(object_color, light->element.light_color,
-                   diffuse, specular, &fill);
+    /* turn the falloffs into a cdf of falloff times brightness */
+    real total = 0.0;
+    for (int k = 0; k < n; k++) {
+        total += ws->light_weights[k] *
+                 luminance(scn->lights.light_color[ws->light_ids[k]]);
+        ws->light_weights[k] = total;
     }
+    if (total <= 0.0)
+        return;
+    for (int s = 0; s < lc->samples; s++) {
+        real u = next_random(&ws->rng) * total;
+        int lo = 0, hi = n - 1;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (ws->light_weights[mid] <= u)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        int i = ws->light_ids[lo];
+        /* falloff / (samples * p) where p is falloff * brightness / total */
+        real scale = total /
+                     (lc->samples * luminance(scn->lights.light_color[i]));
+        shade_light(c, i, scale, ip, d, fill, scn, ws);
+    }
+}
 
-    reflection(r, d, ip.normal);
-    double idx = idx_stack_top(stk).idx, idx_pass = fill.index_of_refraction;
-    if (idx_stack_top(stk).obj == hit_obj) {
-        idx_stack_pop(stk);
-        idx_pass = idx_stack_top(stk).idx;
+/* set up f for the reflection and refraction branches of the hit at ip
+ * of a ray with direction d, its local color already in f->c
+ */
+static void ray_branches(ray_frame *f, const intersection *ip, int hit,
+                         const point3 d, const idx_stack_element *inside,
+                         real throughput, const object_fill *fill)
+{
+    reflection(f->dir[0], d, ip->normal);
+    real idx = inside->idx, idx_pass = fill->index_of_refraction;
+    if (inside->obj == hit) {
+        f->inside = idx_stack_pop(inside);
+        idx_pass = f->inside->idx;
     } else {
-        idx_stack_element e = { .obj = hit_obj,
-                                .idx = fill.index_of_refraction
-                              };
-        idx_stack_push(stk, e);
+        f->entered.obj = hit;
+        f->entered.idx = fill->index_of_refraction;
+        f->inside = idx_stack_push(inside, &f->entered);
     }
 
-    refraction(rr, d, ip.normal, idx, idx_pass);
-    double R = (fill.T > 0.1) ?
-               fresnel(d, rr, ip.normal, idx, idx_pass) :
+    refraction(f->dir[1], d, ip->normal, idx, idx_pass);
+    real R = (fill->T > 0.1) ?
+               fresnel(d, f->dir[1], ip->normal, idx, idx_pass) :
                1.0;
 
     /* totalColor = localColor +
                     mix((1-fill.Kd) * fill.R * reflection, T * refraction, R)
      */
-    if (fill.R > 0) {
-        /* if we hit something, add the color */
-        int old_top = stk->top;
-        if (ray_color(ip.point, MIN_DISTANCE, r, stk, rectangulars, spheres,
-                      lights, reflection_part,
-                      bounces_left - 1)) {
-            multiply_vector(reflection_part, R * (1.0 - fill.Kd) * fill.R,
-                            reflection_part);
-            add_vector(object_color, reflection_part,
-                       object_color);
-        }
-        stk->top = old_top;
-    }
-    /* calculate refraction ray */
-    if ((length(rr) > 0.0) && (fill.T > 0.0) &&
-            (fill.index_of_refraction > 0.0)) {
-        normalize(rr);
-        if (ray_color(ip.point, MIN_DISTANCE, rr, stk,rectangulars, spheres,
-                      lights, refraction_part,
-                      bounces_left - 1)) {
-            multiply_vector(refraction_part, (1 - R) * fill.T,
-                            refraction_part);
-            add_vector(object_color, refraction_part,
-                       object_color);
+    f->live = 0;
+    if (fill->R > 0) {
+        f->weight[0] = R * (1.0 - fill->Kd) * fill->R;
+        f->live |= 1;
+    }
+    if ((length(f->dir[1]) > 0.0) && (fill->T > 0.0) &&
+            (fill->index_of_refraction > 0.0)) {
+        normalize(f->dir[1]);
+        f->weight[1] = (1 - R) * fill->T;
+        f->live |= 2;
+    }
+    COPY_POINT3(f->point, ip->point);
+    f->throughput = throughput;
+    f->next = 0;
+}
+
+/* shade the hit of a ray with direction d, tracing shadow rays, and set
+ * up f for the reflection and refraction branches
+ */
+static void ray_shade(ray_frame *f, intersection ip, int hit,
+                      const point3 d, const idx_stack_element *inside,
+                      real throughput, const scene *scn, worker_state *ws)
+{
+    /* pick the fill of the object that was hit */
+    const object_fill *fill = &scn->fills[hit];
+
+    /* assume it is a shadow */
+    SET_COLOR(f->c, 0.0, 0.0, 0.0);
+
+    if (ws->culling)
+        shade_many_lights(f->c, &ip, d, fill, scn, ws);
+    else
+        for (int i = 0; i < scn->lights.count; i++)
+            shade_light(f->c, i, 1.0, &ip, d, fill, scn, ws);
+    ray_branches(f, &ip, hit, d, inside, throughput, fill);
+}
+
+/* Color of a ray with direction d that hit primitive hit at ip, with
+ * the whole tree of reflections and refractions below it. Every hit is
+ * clamped once its branches are in, as the recursive form did.
+ */
+static void ray_tree(intersection ip, int hit, const point3 d,
+                     const scene *scn, worker_state *ws,
+                     color object_color)
+{
+    ray_frame *frames = ws->frames;
+    int n = 0;
+
+    ray_shade(&frames[0], ip, hit, d, &idx_stack_air, 1.0, scn, ws);
+    for (;;) {
+        ray_frame *f = &frames[n];
+        if (f->next < 2) {
+            int k = f->next++;
+            if (!(f->live & (1 << k)))
+                continue;
+
+            real weight = f->weight[k];
+            real throughput = f->throughput * weight;
+            if (throughput < ws->min_weight) {
+                if (!ws->roulette)
+                    continue;
+                real survive = throughput / ws->min_weight;
+                if (next_random(&ws->rng) >= survive)
+                    continue;
+                weight /= survive;
+                throughput = ws->min_weight;
+            }
+            /* the branch would be one bounce too many */
+            if (n + 1 >= ws->max_bounces) {
+                STATS_INC(STAT_BOUNCE_LIMIT);
+                continue;
+            }
+            if (k)
+                ws->rays.refraction++;
+            else
+                ws->rays.reflection++;
+
+            int next_hit;
+            STATS_TIMER_START(intersect_start);
+            intersection next_ip = ray_hit_object(f->point, f->dir[k],
+                                                  MIN_DISTANCE, MAX_DISTANCE,
+                                                  scn, &next_hit);
+            STATS_TIMER_STOP(STAGE_INTERSECT, intersect_start);
+            track_ray(ws, f->point, f->dir[k], next_hit, next_ip.point);
+            if (next_hit == SCENE_NO_HIT)
+                continue;
+
+            f->pending = weight;
+            ray_shade(&frames[n + 1], next_ip, next_hit, f->dir[k],
+                      f->inside, throughput, scn, ws);
+            n++;
+            continue;
         }
+
+        /* both branches are in: hand the color to the hit above */
+        protect_color_overflow(f->c);
+        if (n == 0)
+            break;
+        ray_frame *parent = &frames[--n];
+        multiply_vector(f->c, parent->pending, f->c);
+        add_vector(parent->c, f->c, parent->c);
     }
+    COPY_COLOR(object_color, frames[0].c);
+}
+
+typedef struct {
+    uint8_t *pixels;
+    const real *background_color;
+    const scene *scn;
+    const viewpoint *view;
+    point3 u, v, w;
+    int width, height;
+    tile region; /**< the part of the image pixels holds, row by row */
+    packet_isa packets;
+    int max_factor; /**< adaptive: finest grid is max_factor squared */
+    real contrast; /**< adaptive: channel difference that asks for more */
+    int block; /**< progressive: one sample per block x block pixels */
+    traversal_order order; /**< of tiles and of the pixels in a tile */
+    int wavefront; /**< fixed grid: trace a generation of rays at a time */
+    gbuffer *gbuf; /**< primary hits to record, or to relight from */
+    pixel_cost *costs; /**< per pixel of region, if they are measured */
+    tile_deps *deps; /**< where the rays of each tile go, if tracked */
+    double deadline; /**< CLOCK_MONOTONIC seconds to stop at, 0 for none */
+    int expired; /**< set once the deadline has passed */
+    int failed; /**< set when a tile ran out of memory */
+    worker_state *workers; /**< one per thread */
+} render_job;
+
+static double monotonic_seconds(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1000000000.0;
+}
 
-    protect_color_overflow(object_color);
+/* checked once per row, so a pass overruns its budget by a row at most */
+static int job_expired(render_job *job)
+{
+    if (!job->deadline)
+        return 0;
+    if (__atomic_load_n(&job->expired, __ATOMIC_RELAXED))
+        return 1;
+    if (monotonic_seconds() < job->deadline)
+        return 0;
+    __atomic_store_n(&job->expired, 1, __ATOMIC_RELAXED);
     return 1;
 }
 
-/* @param background_color this is not ambient light */
-void raytracing(uint8_t *pixels, color background_color,
-                rectangular_node rectangulars, sphere_node spheres,
-                light_node lights, const viewpoint *view,
-                int width, int height)
+/* sub-sample s of pixel (i, j) on a factor x factor grid */
+static void sample_ray(point3 d, const render_job *job, int i, int j, int s,
+                       int factor)
+{
+    rayConstruction(d, job->u, job->v, job->w,
+                    i * factor + s / factor,
+                    j * factor + s % factor,
+                    job->view,
+                    job->width * factor, job->height * factor);
+}
+
+/* add the color of one sample to sum and widen the range [lo, hi] */
+static void add_sample(color sum, color lo, color hi, const color c)
+{
+    add_vector(sum, c, sum);
+    for (int k = 0; k < 3; k++) {
+        lo[k] = fmin(lo[k], c[k]);
+        hi[k] = fmax(hi[k], c[k]);
+    }
+}
+
+/* keep the primary hit of sub-sample s of pixel (i, j), if recording */
+static void record_hit(const render_job *job, int i, int j, int s,
+                       int hit, const intersection *ip)
+{
+    gbuffer *gb = job->gbuf;
+
+    if (!gb)
+        return;
+    size_t k = ((size_t) j * gb->width + i) * gb->samples + s;
+    gb->hits[k] = hit;
+    if (hit != SCENE_NO_HIT)
+        gb->points[k] = *ip;
+}
+
+/* add the color of a sample whose primary ray d hit primitive hit at ip,
+ * or the background for SCENE_NO_HIT
+ */
+static void shade_sample(const render_job *job, worker_state *ws,
+                         int hit, const intersection *ip, const point3 d,
+                         color sum, color lo, color hi)
 {
-    point3 u, v, w, d;
     color object_color = { 0.0, 0.0, 0.0 };
 
-    /* calculate u, v, w */
-    calculateBasisVectors(u, v, w, view);
+    if (hit == SCENE_NO_HIT) {
+        add_sample(sum, lo, hi, job->background_color);
+        return;
+    }
+    ray_tree(*ip, hit, d, job->scn, ws, object_color);
+    add_sample(sum, lo, hi, object_color);
+}
 
-    idx_stack stk;
+/* start the sums of pixel (i, j) */
+static void pixel_begin(const render_job *job, worker_state *ws,
+                        int i, int j, color sum, color lo, color hi)
+{
+    /* roulette decisions depend on the pixel only, not on the thread */
+    ws->rng = (uint32_t) (j * job->width + i) * 2654435761u | 1;
+    SET_COLOR(sum, 0.0, 0.0, 0.0);
+    SET_COLOR(lo, INFINITY, INFINITY, INFINITY);
+    SET_COLOR(hi, -INFINITY, -INFINITY, -INFINITY);
+}
 
-    int factor = sqrt(SAMPLES);
-    for (int j = 0; j < height; j++) {
-        for (int i = 0; i < width; i++) {
-            double r = 0, g = 0, b = 0;
-            /* MSAA */
-            for (int s = 0; s < SAMPLES; s++) {
-                idx_stack_init(&stk);
-                rayConstruction(d, u, v, w,
-                                i * factor + s / factor,
-                                j * factor + s % factor,
-                                view,
-                                width * factor, height * factor);
-                if (ray_color(view->vrp, 0.0, d, &stk, rectangulars, spheres,
-                              lights, object_color,
-                              MAX_REFLECTION_BOUNCES)) {
-                    r += object_color[0];
-                    g += object_color[1];
-                    b += object_color[2];
-                } else {
-                    r += background_color[0];
-                    g += background_color[1];
-                    b += background_color[2];
+/* Trace the primary rays of sub-samples s0 to s0 + n - 1 of pixel
+ * (i, j) on a factor x factor grid, n at most PACKET_SIZE, as one packet
+ * unless packets are off.
+ * @param d, hit, ip receive the direction, primitive hit and hit of each
+ */
+static void trace_primary(const render_job *job, worker_state *ws,
+                          int i, int j, int factor, int s0, int n,
+                          point3 *d, int *hit, intersection *ip)
+{
+    ray_packet p;
+
+    ws->rays.primary += n;
+    if (job->packets == PACKET_OFF) {
+        for (int k = 0; k < n; k++) {
+            sample_ray(d[k], job, i, j, s0 + k, factor);
+            STATS_TIMER_START(intersect_start);
+            ip[k] = ray_hit_object(job->view->vrp, d[k], 0.0,
+                                   MAX_DISTANCE, job->scn, &hit[k]);
+            STATS_TIMER_STOP(STAGE_INTERSECT, intersect_start);
+            track_ray(ws, job->view->vrp, d[k], hit[k], ip[k].point);
+        }
+        return;
+    }
+
+    for (int k = 0; k < PACKET_SIZE; k++) {
+        if (k < n) {
+            sample_ray(d[k], job, i, j, s0 + k, factor);
+            packet_set(&p, k, job->view->vrp, d[k], MAX_DISTANCE);
+        } else
+            packet_clear(&p, k);
+    }
+    STATS_TIMER_START(primary_start);
+    packet_trace(&p, job->scn, job->packets);
+    STATS_TIMER_STOP(STAGE_PRIMARY, primary_start);
+    for (int k = 0; k < n; k++) {
+        real t;
+        hit[k] = p.hit[k];
+        if (hit[k] != SCENE_NO_HIT)
+            ray_hit_primitive(job->view->vrp, d[k], job->scn, hit[k],
+                              MAX_DISTANCE, &ip[k], &t);
+        track_ray(ws, job->view->vrp, d[k], hit[k], ip[k].point);
+    }
+}
+
+/* trace the factor x factor grid of sub-samples of pixel (i, j), a
+ * packet at a time, shading each hit on its own
+ * @param sum receives the sum of their colors
+ * @param lo, hi receive the range of each channel
+ */
+static void render_pixel_grid(const render_job *job, worker_state *ws,
+                              int i, int j, int factor,
+                              color sum, color lo, color hi)
+{
+    int samples = factor * factor;
+
+    pixel_begin(job, ws, i, j, sum, lo, hi);
+    for (int s0 = 0; s0 < samples; s0 += PACKET_SIZE) {
+        int n = samples - s0 < PACKET_SIZE ? samples - s0 : PACKET_SIZE;
+        point3 d[PACKET_SIZE];
+        int hit[PACKET_SIZE];
+        intersection ip[PACKET_SIZE];
+        trace_primary(job, ws, i, j, factor, s0, n, d, hit, ip);
+        for (int k = 0; k < n; k++) {
+            record_hit(job, i, j, s0 + k, hit[k], &ip[k]);
+            shade_sample(job, ws, hit[k], &ip[k], d[k], sum, lo, hi);
+        }
+    }
+}
+
+/* start tracking the rays of tile t, if the job tracks them */
+static void track_tile(const render_job *job, worker_state *ws,
+                       const tile *t)
+{
+    if (job->deps)
+        ws->deps_bits = deps_tile_begin(job->deps, t->x, t->y);
+}
+
+/* what a worker had spent when a pixel began */
+typedef struct {
+    uint64_t rays, tests, clock;
+} cost_mark;
+
+static uint64_t rays_traced(const worker_state *ws)
+{
+    return ws->rays.primary + ws->rays.reflection + ws->rays.refraction +
+           ws->rays.shadow;
+}
+
+/* zero unless counted, with RAY_STATS */
+static uint64_t tests_done(const worker_state *ws)
+{
+    const uint64_t *count = ws->counters.count;
+
+    return count[STAT_NODE_TESTS] + count[STAT_SPHERE_TESTS] +
+           count[STAT_RECTANGULAR_TESTS] + count[STAT_MESH_TESTS] +
+           count[STAT_PACKET_NODE_TESTS] + count[STAT_PACKET_PRIM_TESTS];
+}
+
+static void cost_begin(const render_job *job, const worker_state *ws,
+                       cost_mark *m)
+{
+    if (!job->costs)
+        return;
+    m->rays = rays_traced(ws);
+    m->tests = tests_done(ws);
+    m->clock = stats_clock();
+}
+
+/* add what was spent since m to the cost of pixel (i, j) */
+static void cost_end(const render_job *job, const worker_state *ws,
+                     int i, int j, const cost_mark *m)
+{
+    if (!job->costs)
+        return;
+    pixel_cost *c = &job->costs[(size_t) (j - job->region.y) *
+                                job->region.width + i - job->region.x];
+    c->cycles += stats_clock() - m->clock;
+    c->rays += rays_traced(ws) - m->rays;
+    c->tests += tests_done(ws) - m->tests;
+}
+
+static void store_pixel(const render_job *job, int i, int j,
+                        const color sum, int samples)
+{
+    uint8_t *pixel = job->pixels +
+                     ((size_t) (j - job->region.y) * job->region.width +
+                      i - job->region.x) * 3;
+    pixel[0] = sum[0] * 255 / samples;
+    pixel[1] = sum[1] * 255 / samples;
+    pixel[2] = sum[2] * 255 / samples;
+}
+
+/* the pixels of a rectangle, in a traversal order */
+typedef struct {
+    tile r;
+    traversal_order order;
+    int side;  /**< of the grid the order runs through */
+    int step, steps;
+} pixel_walk;
+
+static void pixel_walk_init(pixel_walk *w, const tile *r,
+                            traversal_order order)
+{
+    w->r = *r;
+    w->order = order;
+    w->step = 0;
+    if (order <= ORDER_TILES) {
+        w->side = r->width;
+        w->steps = r->width * r->height;
+        return;
+    }
+    /* curves cover a power of two square; skip the cells outside */
+    for (w->side = 1; w->side < r->width || w->side < r->height; )
+        w->side *= 2;
+    w->steps = w->side * w->side;
+}
+
+/* @return 1 and the next pixel in (i, j), or 0 after the last one */
+static int pixel_walk_next(pixel_walk *w, int *i, int *j)
+{
+    while (w->step < w->steps) {
+        int x, y;
+        traversal_point(w->order, w->side, w->step++, &x, &y);
+        if (x < w->r.width && y < w->r.height) {
+            *i = w->r.x + x;
+            *j = w->r.y + y;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Wavefront rendering. Rather than following each sample down its own
+ * ray tree, a batch of pixels goes down the trees a generation at a
+ * time: all rays of a generation are intersected, their hits sorted by
+ * the primitive hit so that each material is shaded in one run, the
+ * shadow rays of a slice of hits are traced together, and the
+ * reflection and refraction rays they spawn make the next generation.
+ * Colors are summed up the trees at the end in the order ray_tree()
+ * adds them, so the image is the same bit for bit. Random numbers are
+ * drawn per pixel in tree order, so Russian roulette and sampled lights
+ * stay with ray_tree().
+ */
+
+/* pixels per batch, which bounds the memory its trees take */
+#define WAVE_PIXELS 256
+
+/* hits whose shadow rays are traced in one go */
+#define WAVE_SLICE 64
+
+/* nodes per block of the pool; blocks never move, as media point in */
+#define WAVE_BLOCK 1024
+
+/* a hit in a ray tree */
+typedef struct {
+    ray_frame f;       /**< its shading, branches and media */
+    intersection ip;
+    point3 d;          /**< direction of the ray that hit */
+    const idx_stack_element *inside; /**< media that ray went through */
+    int hit;           /**< primitive id */
+    int depth;         /**< bounces above it, 0 for a primary hit */
+    int child[2];      /**< node of each branch, -1 for none */
+} wave_node;
+
+/* a hit waiting to be shaded, by the primitive it is on */
+typedef struct {
+    int hit, node;
+} wave_item;
+
+/* branch k of a node, to be traced with the next generation */
+typedef struct {
+    int node, k;
+} wave_ray;
+
+/* a shadow ray from a hit to a light */
+typedef struct {
+    int light;
+    int visible;
+    real scale;        /**< of the light's contribution */
+    point3 l;          /**< from the light to the hit */
+} wave_shadow;
+
+struct wavefront {
+    wave_node **blocks;
+    int nblocks, nnodes;
+    int roots[WAVE_PIXELS * SAMPLES]; /**< node per sample, -1: missed */
+    wave_item *queue;  /**< hits of the generation being shaded */
+    int queue_size;
+    wave_ray *rays;    /**< spawned for the next generation */
+    int rays_size;
+    wave_shadow *shadows; /**< of a slice */
+    int shadows_size;
+    int first_shadow[WAVE_SLICE + 1]; /**< per hit of the slice */
+};
+
+static wave_node *wave_node_at(const wavefront *w, int n)
+{
+    return &w->blocks[n / WAVE_BLOCK][n % WAVE_BLOCK];
+}
+
+/* @return a new node, -1 when out of memory */
+static int wave_node_new(wavefront *w)
+{
+    if (w->nnodes == w->nblocks * WAVE_BLOCK) {
+        wave_node **b = realloc(w->blocks, sizeof(*b) * (w->nblocks + 1));
+        if (!b)
+            return -1;
+        w->blocks = b;
+        if (!(b[w->nblocks] = malloc(sizeof(wave_node) * WAVE_BLOCK)))
+            return -1;
+        w->nblocks++;
+    }
+    return w->nnodes++;
+}
+
+/* make *p hold at least n elements of elem bytes
+ * @return 0 on success, -1 when out of memory
+ */
+static int wave_reserve(void **p, int *size, int n, size_t elem)
+{
+    if (n <= *size)
+        return 0;
+    int grown = *size ? *size : 256;
+    while (grown < n)
+        grown *= 2;
+    void *q = realloc(*p, elem * grown);
+    if (!q)
+        return -1;
+    *p = q;
+    *size = grown;
+    return 0;
+}
+
+static void wave_free(wavefront *w)
+{
+    if (!w)
+        return;
+    for (int b = 0; b < w->nblocks; b++)
+        free(w->blocks[b]);
+    free(w->blocks);
+    free(w->queue);
+    free(w->rays);
+    free(w->shadows);
+    free(w);
+}
+
+/* @return a hit of the queue for primitive hit at ip, -1 when out of
+ *         memory
+ */
+static int wave_hit(wavefront *w, int nq, const intersection *ip, int hit,
+                    const point3 d, const idx_stack_element *inside,
+                    real throughput, int depth)
+{
+    int n = wave_node_new(w);
+    if (n < 0)
+        return -1;
+    wave_node *node = wave_node_at(w, n);
+    node->ip = *ip;
+    node->hit = hit;
+    COPY_POINT3(node->d, d);
+    node->inside = inside;
+    node->f.throughput = throughput;
+    node->depth = depth;
+    node->child[0] = node->child[1] = -1;
+    w->queue[nq] = (wave_item) { .hit = hit, .node = n };
+    return n;
+}
+
+static int compare_items(const void *a, const void *b)
+{
+    const wave_item *x = a, *y = b;
+    if (x->hit != y->hit)
+        return x->hit < y->hit ? -1 : 1;
+    return (x->node > y->node) - (x->node < y->node);
+}
+
+/* trace the shadow rays of hits a to b - 1 of the queue, then shade
+ * them the way ray_shade() does
+ * @return 0 on success, -1 when out of memory
+ */
+static int wave_shade(const render_job *job, worker_state *ws,
+                      wavefront *w, int a, int b)
+{
+    const scene *scn = job->scn;
+    int nlights = scn->lights.count, ns = 0;
+
+    for (int h = a; h < b; h++) {
+        const wave_node *node = wave_node_at(w, w->queue[h].node);
+        int n = nlights;
+        if (ws->culling) {
+            n = lights_reaching(node->ip.point, scn, ws);
+            STATS_ADD(STAT_LIGHTS_CULLED, nlights - n);
+        }
+        if (wave_reserve((void **) &w->shadows, &w->shadows_size, ns + n,
+                         sizeof(wave_shadow)) < 0)
+            return -1;
+        w->first_shadow[h - a] = ns;
+        for (int k = 0; k < n; k++, ns++) {
+            w->shadows[ns].light = ws->culling ? ws->light_ids[k] : k;
+            w->shadows[ns].scale = ws->culling ? ws->light_weights[k] : 1.0;
+        }
+    }
+    w->first_shadow[b - a] = ns;
+
+    for (int h = a; h < b; h++) {
+        const wave_node *node = wave_node_at(w, w->queue[h].node);
+        for (int e = w->first_shadow[h - a]; e < w->first_shadow[h - a + 1];
+                e++) {
+            wave_shadow *sh = &w->shadows[e];
+            sh->visible = light_visible(&node->ip, sh->light, sh->l, scn,
+                                        ws);
+        }
+    }
+
+    for (int h = a; h < b; h++) {
+        wave_node *node = wave_node_at(w, w->queue[h].node);
+        const object_fill *fill = &scn->fills[node->hit];
+        SET_COLOR(node->f.c, 0.0, 0.0, 0.0);
+        for (int e = w->first_shadow[h - a]; e < w->first_shadow[h - a + 1];
+                e++) {
+            const wave_shadow *sh = &w->shadows[e];
+            if (sh->visible)
+                add_light(node->f.c, sh->light, sh->scale, sh->l,
+                          &node->ip, node->d, fill, scn);
+        }
+        ray_branches(&node->f, &node->ip, node->hit, node->d, node->inside,
+                     node->f.throughput, fill);
+    }
+    return 0;
+}
+
+/* Render the npix pixels (pi[p], pj[p]) as one wavefront.
+ * @return 0 on success, -1 when out of memory, leaving them unstored
+ */
+static int wave_batch(const render_job *job, worker_state *ws,
+                      wavefront *w, const int *pi, const int *pj, int npix)
+{
+    const scene *scn = job->scn;
+    int factor = sqrt(SAMPLES), nq = 0;
+
+    w->nnodes = 0;
+    if (wave_reserve((void **) &w->queue, &w->queue_size, npix * SAMPLES,
+                     sizeof(wave_item)) < 0)
+        return -1;
+    for (int p = 0; p < npix; p++)
+        for (int s0 = 0; s0 < SAMPLES; s0 += PACKET_SIZE) {
+            int n = SAMPLES - s0 < PACKET_SIZE ? SAMPLES - s0 : PACKET_SIZE;
+            point3 d[PACKET_SIZE];
+            int hit[PACKET_SIZE];
+            intersection ip[PACKET_SIZE];
+            trace_primary(job, ws, pi[p], pj[p], factor, s0, n, d, hit, ip);
+            for (int k = 0; k < n; k++) {
+                int *root = &w->roots[p * SAMPLES + s0 + k];
+                record_hit(job, pi[p], pj[p], s0 + k, hit[k], &ip[k]);
+                *root = -1;
+                if (hit[k] == SCENE_NO_HIT)
+                    continue;
+                if ((*root = wave_hit(w, nq++, &ip[k], hit[k], d[k],
+                                      &idx_stack_air, 1.0, 0)) < 0)
+                    return -1;
+            }
+        }
+
+    while (nq) {
+        /* shade the generation material by material */
+        qsort(w->queue, nq, sizeof(wave_item), compare_items);
+        for (int a = 0; a < nq; a += WAVE_SLICE)
+            if (wave_shade(job, ws, w, a, a + WAVE_SLICE < nq ?
+                           a + WAVE_SLICE : nq) < 0)
+                return -1;
+
+        /* the branches that ray_tree() would follow */
+        int nr = 0;
+        if (wave_reserve((void **) &w->rays, &w->rays_size, 2 * nq,
+                         sizeof(wave_ray)) < 0)
+            return -1;
+        for (int h = 0; h < nq; h++) {
+            const wave_node *node = wave_node_at(w, w->queue[h].node);
+            for (int k = 0; k < 2; k++) {
+                if (!(node->f.live & (1 << k)) ||
+                        node->f.throughput * node->f.weight[k] <
+                        ws->min_weight)
+                    continue;
+                if (node->depth + 1 >= ws->max_bounces) {
+                    STATS_INC(STAT_BOUNCE_LIMIT);
+                    continue;
                 }
+                w->rays[nr++] = (wave_ray) { w->queue[h].node, k };
             }
-            pixels[((i + (j * width)) * 3) + 0] = r * 255 / SAMPLES;
-            pixels[((i + (j * width)) * 3) + 1] = g * 255 / SAMPLES;
-            pixels[((i + (j * width)) * 3) + 2] = b * 255 / SAMPLES;
         }
+
+        /* and their hits, the next generation */
+        nq = 0;
+        if (wave_reserve((void **) &w->queue, &w->queue_size, nr,
+                         sizeof(wave_item)) < 0)
+            return -1;
+        for (int r = 0; r < nr; r++) {
+            wave_node *node = wave_node_at(w, w->rays[r].node);
+            const ray_frame *f = &node->f;
+            int k = w->rays[r].k, hit;
+            if (k)
+                ws->rays.refraction++;
+            else
+                ws->rays.reflection++;
+            STATS_TIMER_START(intersect_start);
+            intersection ip = ray_hit_object(f->point, f->dir[k],
+                                             MIN_DISTANCE, MAX_DISTANCE,
+                                             scn, &hit);
+            STATS_TIMER_STOP(STAGE_INTERSECT, intersect_start);
+            track_ray(ws, f->point, f->dir[k], hit, ip.point);
+            if (hit == SCENE_NO_HIT)
+                continue;
+            if ((node->child[k] = wave_hit(w, nq++, &ip, hit, f->dir[k],
+                                           f->inside,
+                                           f->throughput * f->weight[k],
+                                           node->depth + 1)) < 0)
+                return -1;
+        }
+    }
+
+    /* children come after their parents: add them up bottom up */
+    for (int n = w->nnodes - 1; n >= 0; n--) {
+        wave_node *node = wave_node_at(w, n);
+        for (int k = 0; k < 2; k++) {
+            if (node->child[k] < 0)
+                continue;
+            color c;
+            COPY_COLOR(c, wave_node_at(w, node->child[k])->f.c);
+            multiply_vector(c, node->f.weight[k], c);
+            add_vector(node->f.c, c, node->f.c);
+        }
+        protect_color_overflow(node->f.c);
+    }
+
+    for (int p = 0; p < npix; p++) {
+        color sum, lo, hi;
+        pixel_begin(job, ws, pi[p], pj[p], sum, lo, hi);
+        for (int s = 0; s < SAMPLES; s++) {
+            int root = w->roots[p * SAMPLES + s];
+            add_sample(sum, lo, hi, root < 0 ? job->background_color :
+                       wave_node_at(w, root)->f.c);
+        }
+        store_pixel(job, pi[p], pj[p], sum, SAMPLES);
+    }
+    return 0;
+}
+
+/* render the pixels of t WAVE_PIXELS at a time, going back to one ray
+ * tree at a time for a batch that runs out of memory
+ */
+static void wave_tile(render_job *job, worker_state *ws,
+                      const tile *t)
+{
+    int pi[WAVE_PIXELS], pj[WAVE_PIXELS], n;
+    pixel_walk walk;
+
+    if (!ws->wave)
+        ws->wave = calloc(1, sizeof(wavefront));
+    pixel_walk_init(&walk, t, job->order);
+    do {
+        for (n = 0; n < WAVE_PIXELS &&
+                    pixel_walk_next(&walk, &pi[n], &pj[n]); n++)
+            ;
+        ray_stats before = ws->rays;
+        if (ws->wave && wave_batch(job, ws, ws->wave, pi, pj, n) == 0)
+            continue;
+        ws->rays = before;
+        for (int p = 0; p < n; p++) {
+            color sum, lo, hi;
+            render_pixel_grid(job, ws, pi[p], pj[p], sqrt(SAMPLES),
+                              sum, lo, hi);
+            store_pixel(job, pi[p], pj[p], sum, SAMPLES);
+        }
+    } while (n == WAVE_PIXELS && !job_expired(job));
+}
+
+static void render_tile(const tile *t, int worker, void *arg)
+{
+    render_job *job = arg;
+    worker_state *ws = &job->workers[worker];
+    int factor = sqrt(SAMPLES);
+    pixel_walk walk;
+    int i, j;
+
+    STATS_BIND(&ws->counters);
+    STATS_TIMER_START(render_start);
+    track_tile(job, ws, t);
+    if (job->wavefront) {
+        wave_tile(job, ws, t);
+        STATS_TIMER_STOP(STAGE_RENDER, render_start);
+        return;
     }
+    pixel_walk_init(&walk, t, job->order);
+    while (pixel_walk_next(&walk, &i, &j) && !job_expired(job)) {
+        color sum, lo, hi;
+        cost_mark mark;
+        cost_begin(job, ws, &mark);
+        render_pixel_grid(job, ws, i, j, factor, sum, lo, hi);
+        store_pixel(job, i, j, sum, SAMPLES);
+        cost_end(job, ws, i, j, &mark);
+    }
+    STATS_TIMER_STOP(STAGE_RENDER, render_start);
+}
+
+/* shade the recorded hits of the pixels of t, tracing no primary ray */
+static void render_tile_relight(const tile *t, int worker, void *arg)
+{
+    render_job *job = arg;
+    worker_state *ws = &job->workers[worker];
+    const gbuffer *gb = job->gbuf;
+    int factor = sqrt(gb->samples);
+    pixel_walk walk;
+    int i, j;
+
+    STATS_BIND(&ws->counters);
+    STATS_TIMER_START(render_start);
+    pixel_walk_init(&walk, t, job->order);
+    while (pixel_walk_next(&walk, &i, &j) && !job_expired(job)) {
+        size_t k = ((size_t) j * gb->width + i) * gb->samples;
+        color sum, lo, hi;
+        point3 d;
+        pixel_begin(job, ws, i, j, sum, lo, hi);
+        for (int s = 0; s < gb->samples; s++) {
+            sample_ray(d, job, i, j, s, factor);
+            shade_sample(job, ws, gb->hits[k + s], &gb->points[k + s], d,
+                         sum, lo, hi);
+        }
+        store_pixel(job, i, j, sum, gb->samples);
+    }
+    STATS_TIMER_STOP(STAGE_RENDER, render_start);
+}
+
+static int exceeds_contrast(const render_job *job, const color a,
+                            const color b)
+{
+    for (int k = 0; k < 3; k++)
+        if (fabs(a[k] - b[k]) > job->contrast)
+            return 1;
+    return 0;
+}
+
+/* Adaptive sampling: one sample per pixel first, for the tile and the
+ * ring of pixels around it so that the outcome does not depend on how
+ * the image is tiled. Pixels that differ from a neighbour are traced
+ * again on a 2x2 grid, and the grid doubles while its own samples still
+ * disagree, up to max_factor.
+ */
+static void render_tile_adaptive(const tile *t, int worker, void *arg)
+{
+    render_job *job = arg;
+    worker_state *ws = &job->workers[worker];
+    int x0 = t->x > 0 ? t->x - 1 : 0;
+    int y0 = t->y > 0 ? t->y - 1 : 0;
+    int x1 = t->x + t->width < job->width ? t->x + t->width + 1 : job->width;
+    int y1 = t->y + t->height < job->height ?
+             t->y + t->height + 1 : job->height;
+    int stride = x1 - x0;
+    tile ring = { .x = x0, .y = y0, .width = stride, .height = y1 - y0 };
+    pixel_walk walk;
+    int i, j;
+
+    STATS_BIND(&ws->counters);
+    STATS_TIMER_START(render_start);
+    color *base = malloc(sizeof(color) * stride * (y1 - y0));
+    if (!base) {
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    track_tile(job, ws, t);
+    pixel_walk_init(&walk, &ring, job->order);
+    while (pixel_walk_next(&walk, &i, &j) && !job_expired(job)) {
+        color lo, hi;
+        cost_mark mark;
+        cost_begin(job, ws, &mark);
+        render_pixel_grid(job, ws, i, j, 1,
+                          base[(j - y0) * stride + i - x0], lo, hi);
+        /* the ring belongs to the neighbours, which trace it again */
+        if (i >= t->x && i < t->x + t->width &&
+                j >= t->y && j < t->y + t->height)
+            cost_end(job, ws, i, j, &mark);
+    }
+
+    pixel_walk_init(&walk, t, job->order);
+    while (pixel_walk_next(&walk, &i, &j) && !job_expired(job)) {
+        const real *c = base[(j - y0) * stride + i - x0];
+        int refine = 0;
+        for (int dj = -1; dj <= 1 && !refine; dj++)
+            for (int di = -1; di <= 1 && !refine; di++) {
+                int ni = i + di, nj = j + dj;
+                if (ni >= x0 && ni < x1 && nj >= y0 && nj < y1)
+                    refine = exceeds_contrast(job, c,
+                             base[(nj - y0) * stride + ni - x0]);
+            }
+
+        color sum, lo, hi;
+        int factor = 1;
+        cost_mark mark;
+        cost_begin(job, ws, &mark);
+        COPY_COLOR(sum, c);
+        while (refine && factor < job->max_factor) {
+            factor = factor * 2 < job->max_factor ?
+                     factor * 2 : job->max_factor;
+            render_pixel_grid(job, ws, i, j, factor, sum, lo, hi);
+            refine = exceeds_contrast(job, lo, hi);
+        }
+        store_pixel(job, i, j, sum, factor * factor);
+        cost_end(job, ws, i, j, &mark);
+    }
+    free(base);
+    STATS_TIMER_STOP(STAGE_RENDER, render_start);
+}
+
+/* Progressive preview: one sample from the middle of every block of
+ * block x block pixels, copied over the block. Blocks are anchored at
+ * multiples of block, so each pixel has one writer however the image
+ * is tiled.
+ */
+static void render_tile_blocks(const tile *t, int worker, void *arg)
+{
+    render_job *job = arg;
+    worker_state *ws = &job->workers[worker];
+    int b = job->block;
+    int x1 = job->region.x + job->region.width;
+    int y1 = job->region.y + job->region.height;
+
+    STATS_BIND(&ws->counters);
+    STATS_TIMER_START(render_start);
+    for (int j = (t->y + b - 1) / b * b; j < t->y + t->height; j += b) {
+        if (job_expired(job))
+            break;
+        for (int i = (t->x + b - 1) / b * b; i < t->x + t->width; i += b) {
+            int ci = i + b / 2 < x1 ? i + b / 2 : x1 - 1;
+            int cj = j + b / 2 < y1 ? j + b / 2 : y1 - 1;
+            color sum, lo, hi;
+            render_pixel_grid(job, ws, ci, cj, 1, sum, lo, hi);
+            for (int y = j; y < j + b && y < y1; y++)
+                for (int x = i; x < i + b && x < x1; x++)
+                    store_pixel(job, x, y, sum, 1);
+        }
+    }
+    STATS_TIMER_STOP(STAGE_RENDER, render_start);
+}
+
+/* @param background_color this is not ambient light */
+int raytracing(uint8_t *pixels, color background_color,
+               const scene *scn, const viewpoint *view,
+               int width, int height, const render_options *options)
+{
+    return raytracing_rows(pixels, background_color, scn, view, width,
+                           height, 0, height, options);
+}
+
+/* fill in the render settings of options that every pass shares */
+static void job_init(render_job *job, uint8_t *pixels,
+                     color background_color, const scene *scn,
+                     const viewpoint *view, int width, int height,
+                     const render_options *options)
+{
+    memset(job, 0, sizeof(*job));
+    job->pixels = pixels;
+    job->background_color = background_color;
+    job->scn = scn;
+    job->view = view;
+    job->width = width;
+    job->height = height;
+    job->order = options->order;
+    job->costs = options->costs;
+    /* wavefronts shade out of tree order and cannot charge pixels */
+    job->wavefront = options->wavefront && !options->roulette &&
+                     options->light_samples <= 0 && !options->costs;
+    job->packets = packet_select(options->packets);
+    if (options->packets == PACKET_OFF)
+        job->packets = PACKET_OFF;
+    if (options->max_samples > 0) {
+        job->max_factor = sqrt(options->max_samples);
+        job->contrast = options->contrast > 0 ?
+                        options->contrast : DEFAULT_CONTRAST;
+    }
+
+    /* calculate u, v, w */
+    calculateBasisVectors(job->u, job->v, job->w, view);
+}
+
+/* set up many-light mode as options ask, tree included
+ * @return 0 on success, -1 when out of memory
+ */
+static int light_culling_init(light_culling *lc, const scene *scn,
+                              const render_options *options)
+{
+    int n = scn->lights.count;
+
+    memset(lc, 0, sizeof(*lc));
+    lc->cutoff = options->light_cutoff;
+    lc->samples = options->light_samples;
+    if (lc->cutoff <= 0 || !n)
+        return 0;
+
+    aabb *boxes = malloc(sizeof(aabb) * n);
+    if (!boxes)
+        return -1;
+    for (int i = 0; i < n; i++) {
+        point3 position;
+        real intensity = scn->lights.intensity[i];
+        /* falloff reaches the cutoff where intensity / d^2 == cutoff */
+        real reach = intensity > 0 ? sqrt(intensity / lc->cutoff) : 0.0;
+        point3_array_get(&scn->lights.position, i, position);
+        for (int k = 0; k < 3; k++) {
+            boxes[i].min[k] = position[k] - reach;
+            boxes[i].max[k] = position[k] + reach;
+        }
+    }
+    int ret = bvh_build(&lc->tree, boxes, n);
+    free(boxes);
+    return ret;
+}
+
+/* render the region of the job with render, or only the tiles of only
+ * in it when there are some
+ * @return 0 on success, -1 when out of memory
+ */
+static int job_run_tiles(render_job *job, const tile *region,
+                          const tile *only, int nonly, tile_func render,
+                          const render_options *options)
+{
+    int nthreads = options->nthreads > 1 ? options->nthreads : 1;
+    const scene *scn = job->scn;
+
+    job->region = *region;
+
+    /* one block for every worker's occluder cache, one for the ray
+     * trees
+     */
+    int nlights = scn->lights.count;
+    int bounces = options->max_bounces > 0 ?
+                  options->max_bounces : MAX_REFLECTION_BOUNCES;
+    int many_lights = options->light_cutoff > 0 ||
+                      options->light_samples > 0;
+    light_culling culling = { .cutoff = 0 };
+    int *light_ids = NULL;
+    real *light_weights = NULL;
+    job->workers = malloc(sizeof(worker_state) * nthreads);
+    int *occluders = malloc(sizeof(int) * (nlights * nthreads + 1));
+    ray_frame *frames = malloc(sizeof(ray_frame) * bounces * nthreads);
+    if (many_lights) {
+        light_ids = malloc(sizeof(int) * (nlights * nthreads + 1));
+        light_weights = malloc(sizeof(real) * (nlights * nthreads + 1));
+    }
+    if (!job->workers || !occluders || !frames ||
+            (many_lights && (!light_ids || !light_weights ||
+                             light_culling_init(&culling, scn,
+                                                options) < 0))) {
+        free(job->workers);
+        free(occluders);
+        free(frames);
+        free(light_ids);
+        free(light_weights);
+        bvh_free(&culling.tree);
+        job->workers = NULL;
+        return -1;
+    }
+    for (int i = 0; i < nlights * nthreads; i++)
+        occluders[i] = SCENE_NO_HIT;
+    memset(job->workers, 0, sizeof(worker_state) * nthreads);
+    for (int i = 0; i < nthreads; i++) {
+        worker_state *ws = &job->workers[i];
+        ws->last_occluder = occluders + i * nlights;
+        ws->frames = frames + i * bounces;
+        ws->max_bounces = bounces;
+        ws->min_weight = options->min_weight;
+        ws->roulette = options->roulette;
+        ws->deps = job->deps;
+        if (many_lights) {
+            ws->culling = &culling;
+            ws->light_ids = light_ids + i * nlights;
+            ws->light_weights = light_weights + i * nlights;
+        }
+    }
+
+    /* in scanline order a serial render goes down the whole region,
+     * unless the rays of each tile are tracked
+     */
+    tile *tiles = NULL;
+    int ntiles = 0;
+    if (only) {
+        if (scheduler_run(only, nonly, nthreads, render, job) < 0)
+            for (int i = 0; i < nonly; i++)
+                render(&only[i], 0, job);
+    } else if (nthreads > 1 || job->order != ORDER_SCANLINE ||
+               job->deps) {
+        ntiles = tile_split(&tiles, region->width, region->height,
+                            options->tile_size);
+        if (tile_order(tiles, ntiles, options->tile_size, job->order) < 0)
+            ntiles = 0;
+        for (int i = 0; i < ntiles; i++) {
+            tiles[i].x += region->x;
+            tiles[i].y += region->y;
+        }
+    }
+    if (!only && (!ntiles || scheduler_run(tiles, ntiles, nthreads,
+                                           render, job) < 0)) {
+        /* serial path: the region as one tile, in scanline order */
+        render(region, 0, job);
+    }
+    free(tiles);
+
+    for (int i = 0; options->stats && i < nthreads; i++) {
+        const ray_stats *rays = &job->workers[i].rays;
+        options->stats->primary += rays->primary;
+        options->stats->reflection += rays->reflection;
+        options->stats->refraction += rays->refraction;
+        options->stats->shadow += rays->shadow;
+    }
+    for (int i = 0; options->counters && i < nthreads; i++)
+        stats_merge(options->counters, &job->workers[i].counters);
+    for (int i = 0; i < nthreads; i++)
+        wave_free(job->workers[i].wave);
+    free(occluders);
+    free(frames);
+    free(light_ids);
+    free(light_weights);
+    bvh_free(&culling.tree);
+    free(job->workers);
+    job->workers = NULL;
+    return job->failed ? -1 : 0;
+}
+
+static int job_run(render_job *job, const tile *region, tile_func render,
+                   const render_options *options)
+{
+    return job_run_tiles(job, region, NULL, 0, render, options);
+}
+
+int raytracing_rows(uint8_t *pixels, color background_color,
+                    const scene *scn, const viewpoint *view,
+                    int width, int height, int y0, int y1,
+                    const render_options *options)
+{
+    tile rows = { .x = 0, .y = y0, .width = width, .height = y1 - y0 };
+
+    return raytracing_tile(pixels, background_color, scn, view, width,
+                           height, &rows, options);
+}
+
+int raytracing_tile(uint8_t *pixels, color background_color,
+                    const scene *scn, const viewpoint *view,
+                    int width, int height, const tile *region,
+                    const render_options *options)
+{
+    render_job job;
+
+    job_init(&job, pixels, background_color, scn, view, width, height,
+             options);
+    return job_run(&job, region, job.max_factor ? render_tile_adaptive :
+                   render_tile, options);
+}
+
+/* block sizes of the preview passes, coarse to fine */
+static const int preview_blocks[] = { 8, 4, 2 };
+
+int raytracing_progressive(uint8_t *pixels, color background_color,
+                           const scene *scn, const viewpoint *view,
+                           int width, int height,
+                           const render_options *options,
+                           const progressive_options *progressive)
+{
+    int npasses = sizeof(preview_blocks) / sizeof(preview_blocks[0]) + 1;
+    render_job job;
+
+    job_init(&job, pixels, background_color, scn, view, width, height,
+             options);
+    if (progressive->budget > 0)
+        job.deadline = monotonic_seconds() + progressive->budget;
+
+    tile whole = { .x = 0, .y = 0, .width = width, .height = height };
+    for (int pass = 0; pass < npasses; pass++) {
+        int final = pass == npasses - 1;
+        job.block = final ? 1 : preview_blocks[pass];
+        if (job_run(&job, &whole, final ? (job.max_factor ?
+                    render_tile_adaptive : render_tile) : render_tile_blocks,
+                    options) < 0)
+            return -1;
+        if (job.expired)
+            return 0;
+        if (progressive->pass_done)
+            progressive->pass_done(pixels, pass, job.block, final,
+                                   progressive->arg);
+    }
+    return 1;
+}
+
+int raytracing_record(uint8_t *pixels, gbuffer *gb,
+                      color background_color, const scene *scn,
+                      const viewpoint *view, int width, int height,
+                      const render_options *options)
+{
+    size_t n = (size_t) width * height * SAMPLES;
+    tile whole = { .x = 0, .y = 0, .width = width, .height = height };
+    render_job job;
+
+    memset(gb, 0, sizeof(*gb));
+    if (options->max_samples > 0)
+        return -1;
+    gb->hits = malloc(sizeof(int) * n);
+    gb->points = malloc(sizeof(intersection) * n);
+    if (!gb->hits || !gb->points) {
+        gbuffer_free(gb);
+        return -1;
+    }
+    gb->view = *view;
+    gb->width = width;
+    gb->height = height;
+    gb->samples = SAMPLES;
+
+    job_init(&job, pixels, background_color, scn, view, width, height,
+             options);
+    job.gbuf = gb;
+    if (job_run(&job, &whole, render_tile, options) < 0) {
+        gbuffer_free(gb);
+        return -1;
+    }
+    return 0;
+}
+
+int raytracing_relight(uint8_t *pixels, color background_color,
+                       const scene *scn, const gbuffer *gb,
+                       const render_options *options)
+{
+    tile whole = { .x = 0, .y = 0, .width = gb->width,
+                   .height = gb->height };
+    render_job job;
+
+    job_init(&job, pixels, background_color, scn, &gb->view, gb->width,
+             gb->height, options);
+    job.gbuf = (gbuffer *) gb;
+    return job_run(&job, &whole, render_tile_relight, options);
+}
+
+size_t gbuffer_size(const gbuffer *gb)
+{
+    return ((size_t) gb->width * gb->height * gb->samples) *
+           (sizeof(int) + sizeof(intersection));
+}
+
+void gbuffer_free(gbuffer *gb)
+{
+    free(gb->hits);
+    free(gb->points);
+    gb->hits = NULL;
+    gb->points = NULL;
+}
+
+int raytracing_track(uint8_t *pixels, tile_deps *deps,
+                     color background_color, const scene *scn,
+                     const viewpoint *view, int width, int height,
+                     const aabb *region, const render_options *options)
+{
+    tile whole = { .x = 0, .y = 0, .width = width, .height = height };
+    int tile_size = options->tile_size > 0 ?
+                    options->tile_size : DEFAULT_TILE_SIZE;
+    aabb bounds = { { 0, 0, 0 }, { 0, 0, 0 } };
+    render_job job;
+
+    if (region)
+        bounds = *region;
+    else if (scn->accel.nodes) {
+        COPY_POINT3(bounds.min, scn->accel.nodes[0].min);
+        COPY_POINT3(bounds.max, scn->accel.nodes[0].max);
+    }
+    if (deps_init(deps, &bounds, width, height, tile_size) < 0)
+        return -1;
+
+    render_options tiled = *options;
+    tiled.tile_size = tile_size;
+    job_init(&job, pixels, background_color, scn, view, width, height,
+             options);
+    job.deps = deps;
+    if (job_run(&job, &whole, job.max_factor ? render_tile_adaptive :
+                render_tile, &tiled) < 0) {
+        deps_free(deps);
+        return -1;
+    }
+    return 0;
+}
+
+int raytracing_update(uint8_t *pixels, tile_deps *deps,
+                      const aabb *changed, int nchanged,
+                      color background_color, const scene *scn,
+                      const viewpoint *view, const render_options *options)
+{
+    int ntiles = deps->cols * deps->rows, n;
+    char *dirty = malloc(ntiles);
+    tile *tiles = malloc(sizeof(tile) * ntiles);
+
+    if (!dirty || !tiles ||
+            (n = deps_dirty(deps, changed, nchanged, dirty)) < 0) {
+        free(dirty);
+        free(tiles);
+        return -1;
+    }
+    n = 0;
+    for (int t = 0; t < ntiles; t++) {
+        if (!dirty[t])
+            continue;
+        int x = t % deps->cols * deps->tile_size;
+        int y = t / deps->cols * deps->tile_size;
+        tiles[n++] = (tile) {
+            .x = x, .y = y,
+            .width = x + deps->tile_size > deps->width ?
+                     deps->width - x : deps->tile_size,
+            .height = y + deps->tile_size > deps->height ?
+                      deps->height - y : deps->tile_size,
+        };
+    }
+
+    tile whole = { .x = 0, .y = 0, .width = deps->width,
+                   .height = deps->height };
+    render_job job;
+    job_init(&job, pixels, background_color, scn, view, deps->width,
+             deps->height, options);
+    job.deps = deps;
+    if (n && job_run_tiles(&job, &whole, tiles, n, job.max_factor ?
+                           render_tile_adaptive : render_tile, options) < 0)
+        n = -1;
+    free(dirty);
+    free(tiles);
+    return n;
 }
@@ -1,11 +1,178 @@
 #ifndef __RAYTRACING_H
 #define __RAYTRACING_H
 
-#include "objects.h"
+#include "scene.h"
+#include "packet.h"
+#include "stats.h"
+#include "scheduler.h"
+#include "deps.h"
 #include <stdint.h>
 
-void raytracing(uint8_t *pixels, color background_color,
-                rectangular_node rectangulars, sphere_node spheres,
-                light_node lights, const viewpoint *view,
-                int width, int height);
+/* number of rays traced, by kind */
+typedef struct {
+    uint64_t primary;
+    uint64_t reflection;
+    uint64_t refraction;
+    uint64_t shadow;
+} ray_stats;
+
+/* what rendering one pixel took */
+typedef struct {
+    uint32_t rays;   /**< traced, of every kind */
+    uint32_t tests;  /**< BVH boxes and primitives tested, in builds with
+                          RAY_STATS; 0 otherwise */
+    uint64_t cycles; /**< stats_clock() ticks */
+} pixel_cost;
+
+typedef struct {
+    int nthreads;  /**< worker threads, 1 renders serially */
+    int tile_size; /**< edge of a square tile in pixels */
+    packet_isa packets; /**< kernels for primary ray packets */
+    traversal_order order; /**< of tiles and of the pixels in a tile */
+    int wavefront; /**< fixed grid: trace, shade and spawn the rays of
+                        a batch of pixels a generation at a time; the
+                        image is the same. Ignored with adaptive
+                        sampling, roulette, sampled lights or costs */
+    int max_samples; /**< adaptive sampling up to this many samples per
+                          pixel; 0 keeps the fixed grid of 4 */
+    real contrast; /**< channel difference that makes adaptive sampling
+                        refine, 0 for DEFAULT_CONTRAST */
+    int max_bounces; /**< depth of the ray tree, 0 for
+                          MAX_REFLECTION_BOUNCES */
+    real min_weight; /**< reflection and refraction rays contributing
+                          less than this to their sample are dropped */
+    int roulette; /**< drop them by Russian roulette instead, keeping the
+                       image unbiased */
+    /* Many-light mode, on when either is set, shades with inverse-square
+     * falloff (intensity / d^2, capped at 1), where the classic shading
+     * ignores distance and intensity.
+     */
+    real light_cutoff; /**< skip lights whose falloff at a hit is below
+                            this */
+    int light_samples; /**< shade this many lights per hit, picked at
+                            random by contribution; 0 for all */
+    ray_stats *stats; /**< if set, the rays traced are added to it */
+    render_counters *counters; /**< likewise, for builds with RAY_STATS */
+    pixel_cost *costs; /**< if set, what each pixel rendered with the fixed
+                            grid or adaptively cost is added to it, row by
+                            row over the rows or tile rendered */
+} render_options;
+
+#define DEFAULT_TILE_SIZE 32
+#define DEFAULT_CONTRAST 0.05
+#define MAX_REFLECTION_BOUNCES 3
+
+/* @return 1 if a camera can be built from view: a finite vrp and vup,
+ *         and vpn and vup x vpn of finite, non-zero length
+ */
+int view_valid(const viewpoint *view);
+
+/* @return 0 on success, -1 when out of memory, leaving pixels partly
+ *         or not at all rendered
+ */
+int raytracing(uint8_t *pixels, color background_color,
+               const scene *scn, const viewpoint *view,
+               int width, int height, const render_options *options);
+
+/* render only rows [y0, y1) of the image; pixels holds just those rows
+ * @return as raytracing()
+ */
+int raytracing_rows(uint8_t *pixels, color background_color,
+                    const scene *scn, const viewpoint *view,
+                    int width, int height, int y0, int y1,
+                    const render_options *options);
+
+/* render only the region of the image; pixels holds just the region,
+ * row by row, and gets what raytracing() would put there
+ * @return as raytracing()
+ */
+int raytracing_tile(uint8_t *pixels, color background_color,
+                    const scene *scn, const viewpoint *view,
+                    int width, int height, const tile *region,
+                    const render_options *options);
+
+/* Primary hits of every sample of a render with the fixed grid: what is
+ * needed to shade the image again without tracing primary rays, after
+ * lights or fills changed but the geometry and camera did not.
+ */
+typedef struct {
+    viewpoint view;
+    int width, height;
+    int samples;          /**< per pixel */
+    int *hits;            /**< primitive per sample, or SCENE_NO_HIT */
+    intersection *points; /**< per sample that hit */
+} gbuffer;
+
+/* render as raytracing() does and record the primary hits into gb
+ * @return 0 on success, -1 when out of memory or with adaptive sampling,
+ *         whose samples depend on the shading
+ */
+int raytracing_record(uint8_t *pixels, gbuffer *gb,
+                      color background_color, const scene *scn,
+                      const viewpoint *view, int width, int height,
+                      const render_options *options);
+
+/* shade the hits of gb again with the lights and fills scn has now:
+ * the image raytracing() would give, shadow and secondary rays traced
+ * anew, primary rays not at all
+ * @return as raytracing()
+ */
+int raytracing_relight(uint8_t *pixels, color background_color,
+                       const scene *scn, const gbuffer *gb,
+                       const render_options *options);
+
+/* @return bytes held by gb */
+size_t gbuffer_size(const gbuffer *gb);
+void gbuffer_free(gbuffer *gb);
+
+/* render as raytracing() does and track into deps where the rays of
+ * each tile of options->tile_size went
+ * @param region where changes will be: the boxes later given to
+ *        raytracing_update() must lie inside it. Rays are only followed
+ *        through it, so a small one is cheap and precise; NULL for the
+ *        whole scene
+ * @return 0 on success, -1 when out of memory
+ */
+int raytracing_track(uint8_t *pixels, tile_deps *deps,
+                     color background_color, const scene *scn,
+                     const viewpoint *view, int width, int height,
+                     const aabb *region, const render_options *options);
+
+/* After the objects within the boxes changed, e.g. their bounds before
+ * and after a move, render again just the tiles of pixels whose rays
+ * crossed a box, tracking them anew, so that pixels holds what
+ * raytracing() would give. The view, resolution and lights must be
+ * those deps was tracked with.
+ * @return number of tiles rendered, -1 when out of memory
+ */
+int raytracing_update(uint8_t *pixels, tile_deps *deps,
+                      const aabb *changed, int nchanged,
+                      color background_color, const scene *scn,
+                      const viewpoint *view, const render_options *options);
+
+/* called after each pass of a progressive render with the whole image
+ * @param block edge of the blocks sharing one sample, 1 in the last pass
+ * @param final nonzero for the last pass, whose image raytracing() gives
+ */
+typedef void (*pass_func)(const uint8_t *pixels, int pass, int block,
+                          int final, void *arg);
+
+typedef struct {
+    double budget; /**< wall-clock seconds, 0 for no limit */
+    pass_func pass_done; /**< may be NULL */
+    void *arg;
+} progressive_options;
+
+/* Render coarse to fine: one sample per 8x8, 4x4 and 2x2 block of
+ * pixels, then the image raytracing() renders. Each pass overwrites the
+ * one before, so when the budget runs out pixels holds the finest image
+ * reached, partly refined.
+ * @return 1 if every pass finished, 0 if the budget ran out, -1 when
+ *         out of memory
+ */
+int raytracing_progressive(uint8_t *pixels, color background_color,
+                           const scene *scn, const viewpoint *view,
+                           int width, int height,
+                           const render_options *options,
+                           const progressive_options *progressive);
 #endif
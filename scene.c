@@ -0,0 +1,265 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "math-toolkit.h"
+#include "scene.h"
+
+/* Hand out aligned arrays from one block. With base == NULL it only
+ * accumulates the size, so the same code computes and applies the layout.
+ */
+typedef struct {
+    char *base;
+    size_t used;
+} carver;
+
+static void *carve(carver *c, size_t bytes)
+{
+    void *p = c->base ? c->base + c->used : NULL;
+    c->used += SCENE_ALIGN_UP(bytes);
+    return p;
+}
+
+static void carve_point3(carver *c, point3_array *a, int n)
+{
+    a->x = carve(c, sizeof(real) * n);
+    a->y = carve(c, sizeof(real) * n);
+    a->z = carve(c, sizeof(real) * n);
+}
+
+size_t scene_layout(scene *scn, void *base)
+{
+    carver block = { .base = base, .used = 0 }, *c = &block;
+    int nr = scn->rectangulars.count;
+    int ns = scn->spheres.count;
+    int nl = scn->lights.count;
+    int nm = scn->meshes.count;
+
+    /* hot geometry first, cold material data last */
+    carve_point3(c, &scn->spheres.center, ns);
+    scn->spheres.radius = carve(c, sizeof(real) * ns);
+    scn->spheres.radius2 = carve(c, sizeof(real) * ns);
+    for (int v = 0; v < 4; v++)
+        carve_point3(c, &scn->rectangulars.vertices[v], nr);
+    scn->rectangulars.records = carve(c, sizeof(rectangular_record) * nr);
+    carve_point3(c, &scn->rectangulars.normal, nr);
+    carve_point3(c, &scn->lights.position, nl);
+    scn->lights.light_color = carve(c, sizeof(color) * nl);
+    scn->lights.intensity = carve(c, sizeof(real) * nl);
+    scn->fills = carve(c, sizeof(object_fill) * (nr + ns + nm));
+    return c->used;
+}
+
+void scene_primitive_bounds(const scene *scn, int id, aabb *box)
+{
+    point3 p;
+    if (scene_is_mesh(scn, id)) {
+        mesh_bounds(scene_mesh(scn, id), box);
+        return;
+    }
+    if (scene_is_sphere(scn, id)) {
+        int i = id - scn->rectangulars.count;
+        real r = scn->spheres.radius[i];
+        point3_array_get(&scn->spheres.center, i, p);
+        for (int k = 0; k < 3; k++) {
+            box->min[k] = p[k] - r;
+            box->max[k] = p[k] + r;
+        }
+        return;
+    }
+
+    point3_array_get(&scn->rectangulars.vertices[0], id, p);
+    COPY_POINT3(box->min, p);
+    COPY_POINT3(box->max, p);
+    for (int v = 1; v < 4; v++) {
+        point3_array_get(&scn->rectangulars.vertices[v], id, p);
+        aabb_grow_point(box, p);
+    }
+}
+
+/* @return the axis v runs along, RECT_SKEW if not exactly one */
+static int edge_axis(const point3 v)
+{
+    int axis = RECT_SKEW;
+    for (int k = 0; k < 3; k++) {
+        if (v[k] == 0.0)
+            continue;
+        if (axis != RECT_SKEW)
+            return RECT_SKEW;
+        axis = k;
+    }
+    return axis;
+}
+
+void scene_prepare_rectangular(scene *scn, int id)
+{
+    rectangular_record *r = &scn->rectangulars.records[id];
+    point3 v[4];
+
+    for (int i = 0; i < 4; i++)
+        point3_array_get(&scn->rectangulars.vertices[i], id, v[i]);
+    subtract_vector(v[1], v[0], r->e01);
+    subtract_vector(v[3], v[0], r->e03);
+    subtract_vector(v[3], v[2], r->e23);
+    subtract_vector(v[1], v[2], r->e21);
+    r->axis[0] = edge_axis(r->e01);
+    r->axis[1] = edge_axis(r->e03);
+    r->axis[2] = edge_axis(r->e23);
+    r->axis[3] = edge_axis(r->e21);
+
+    /* both triangles need two edges along different axes */
+    r->aligned = 1;
+    for (int i = 0; i < 4; i++)
+        if (r->axis[i] == RECT_SKEW)
+            r->aligned = 0;
+    if (r->axis[0] == r->axis[1] || r->axis[2] == r->axis[3])
+        r->aligned = 0;
+}
+
+int scene_set_lights(scene *scn, light_node lights)
+{
+    int i = 0;
+
+    for (light_node l = lights; l; l = l->next)
+        i++;
+    if (i != scn->lights.count)
+        return -1;
+    i = 0;
+    for (light_node l = lights; l; l = l->next, i++) {
+        point3_array_set(&scn->lights.position, i, l->element.position);
+        COPY_COLOR(scn->lights.light_color[i], l->element.light_color);
+        scn->lights.intensity[i] = l->element.intensity;
+    }
+    return 0;
+}
+
+int scene_compile(scene *scn, light_node lights,
+                  rectangular_node rectangulars, sphere_node spheres,
+                  mesh_node meshes)
+{
+    memset(scn, 0, sizeof(*scn));
+    for (light_node l = lights; l; l = l->next)
+        scn->lights.count++;
+    for (rectangular_node r = rectangulars; r; r = r->next)
+        scn->rectangulars.count++;
+    for (sphere_node s = spheres; s; s = s->next)
+        scn->spheres.count++;
+    for (mesh_node m = meshes; m; m = m->next)
+        scn->meshes.count++;
+
+    scn->memory_size = scene_layout(scn, NULL);
+    if (posix_memalign(&scn->memory, SCENE_ALIGN,
+                       scn->memory_size ? scn->memory_size : 1))
+        return -1;
+    scene_layout(scn, scn->memory);
+
+    scene_set_lights(scn, lights);
+
+    int i = 0;
+    for (rectangular_node r = rectangulars; r; r = r->next, i++) {
+        for (int v = 0; v < 4; v++)
+            point3_array_set(&scn->rectangulars.vertices[v], i,
+                             r->element.vertices[v]);
+        point3_array_set(&scn->rectangulars.normal, i, r->element.normal);
+        scene_prepare_rectangular(scn, i);
+        COPY_OBJECT_FILL(scn->fills[i], r->element.rectangular_fill);
+    }
+
+    i = 0;
+    for (sphere_node s = spheres; s; s = s->next, i++) {
+        point3_array_set(&scn->spheres.center, i, s->element.center);
+        scn->spheres.radius[i] = s->element.radius;
+        scn->spheres.radius2[i] = s->element.radius * s->element.radius;
+        COPY_OBJECT_FILL(scn->fills[scn->rectangulars.count + i],
+                         s->element.sphere_fill);
+    }
+
+    int first_mesh = scn->rectangulars.count + scn->spheres.count;
+    scn->meshes.items = calloc(scn->meshes.count ? scn->meshes.count : 1,
+                               sizeof(triangle_mesh));
+    if (!scn->meshes.items) {
+        scn->meshes.count = 0;
+        scene_free(scn);
+        return -1;
+    }
+    i = 0;
+    for (mesh_node m = meshes; m; m = m->next, i++) {
+        triangle_mesh *geometry = m->element.geometry;
+        scn->meshes.items[i] = *geometry;
+        memset(geometry, 0, sizeof(*geometry));
+        COPY_OBJECT_FILL(scn->fills[first_mesh + i], m->element.mesh_fill);
+        if (!scn->meshes.items[i].accel.nodes &&
+                mesh_build(&scn->meshes.items[i]) < 0) {
+            scene_free(scn);
+            return -1;
+        }
+    }
+
+    int n = scene_primitive_count(scn);
+    aabb *boxes = malloc(sizeof(aabb) * (n ? n : 1));
+    if (!boxes) {
+        scene_free(scn);
+        return -1;
+    }
+    for (int id = 0; id < n; id++)
+        scene_primitive_bounds(scn, id, &boxes[id]);
+    int ret = bvh_build(&scn->accel, boxes, n);
+    free(boxes);
+    if (ret < 0) {
+        scene_free(scn);
+        return -1;
+    }
+    return 0;
+}
+
+void scene_translate(scene *scn, int id, const point3 offset)
+{
+    point3 p;
+    if (scene_is_mesh(scn, id)) {
+        mesh_translate(&scn->meshes.items[id - scn->rectangulars.count -
+                                          scn->spheres.count], offset);
+        return;
+    }
+    if (scene_is_sphere(scn, id)) {
+        int i = id - scn->rectangulars.count;
+        point3_array_get(&scn->spheres.center, i, p);
+        add_vector(p, offset, p);
+        point3_array_set(&scn->spheres.center, i, p);
+        return;
+    }
+    for (int v = 0; v < 4; v++) {
+        point3_array_get(&scn->rectangulars.vertices[v], id, p);
+        add_vector(p, offset, p);
+        point3_array_set(&scn->rectangulars.vertices[v], id, p);
+    }
+    scene_prepare_rectangular(scn, id);
+}
+
+int scene_refit(scene *scn)
+{
+    int n = scene_primitive_count(scn);
+    aabb *boxes = malloc(sizeof(aabb) * (n ? n : 1));
+    if (!boxes)
+        return -1;
+    for (int id = 0; id < n; id++)
+        scene_primitive_bounds(scn, id, &boxes[id]);
+    bvh_refit(&scn->accel, boxes);
+    free(boxes);
+    return 0;
+}
+
+void scene_free(scene *scn)
+{
+    if (scn->mapped_size) {
+        /* arrays and tree all point into the mapping */
+        munmap(scn->mapping, scn->mapped_size);
+    } else {
+        bvh_free(&scn->accel);
+        free(scn->memory);
+    }
+    for (int i = 0; i < scn->meshes.count; i++)
+        mesh_free(&scn->meshes.items[i]);
+    free(scn->meshes.items);
+    memset(scn, 0, sizeof(*scn));
+}
@@ -0,0 +1,159 @@
+#ifndef __RAY_SCENE_H
+#define __RAY_SCENE_H
+
+#include <stdint.h>
+
+#include "primitives.h"
+#include "objects.h"
+#include "bvh.h"
+#include "mesh.h"
+
+/* arrays are aligned for vector loads of this many bytes */
+#define SCENE_ALIGN 32
+#define SCENE_ALIGN_UP(n) \
+    (((n) + SCENE_ALIGN - 1) & ~(size_t) (SCENE_ALIGN - 1))
+
+/* one array per component, so consecutive objects are adjacent */
+typedef struct {
+    real *x, *y, *z;
+} point3_array;
+
+typedef struct {
+    int count;
+    point3_array center;
+    real *radius;
+    real *radius2;  /**< radius squared, for the intersection tests */
+} sphere_array;
+
+/* not an axis, for rectangular_record.axis */
+#define RECT_SKEW (-1)
+
+/* What the intersection test of a rectangular needs besides vertices[0]
+ * and vertices[2]: the edges of its two triangles, v0 v1 v3 and
+ * v2 v3 v1, and for each edge the one axis it runs along, if any.
+ * There is no plane equation or inverse basis: a plane test rounds
+ * differently from the two triangle tests at the shared diagonal and
+ * the edges, which would change rendered images, so aligned ones run
+ * the same triangle tests with the zero terms left out instead.
+ */
+typedef struct {
+    point3 e01, e03;
+    point3 e23, e21;
+    int8_t axis[4];  /**< of e01, e03, e23 and e21, or RECT_SKEW */
+    int8_t aligned;  /**< every edge runs along an axis */
+} rectangular_record;
+
+typedef struct {
+    int count;
+    point3_array vertices[4];
+    point3_array normal;
+    rectangular_record *records;
+} rectangular_array;
+
+/* meshes keep their own buffers, outside the scene's block */
+typedef struct {
+    int count;
+    triangle_mesh *items;
+} mesh_array;
+
+typedef struct {
+    int count;
+    point3_array position;
+    /* cold: only read once a light is known to be visible */
+    color *light_color;
+    real *intensity;
+} light_array;
+
+/* Compiled form of the scene used by the renderer, read-only while a
+ * frame renders.
+ * Primitives are identified by one id: rectangulars take [0, n), then
+ * come spheres and meshes, in the order of the lists they were compiled
+ * from.
+ */
+typedef struct {
+    rectangular_array rectangulars;
+    sphere_array spheres;
+    mesh_array meshes;
+    light_array lights;
+    object_fill *fills; /**< cold material data, indexed by primitive id */
+    bvh accel;
+    void *memory;       /**< single block backing every array above */
+    size_t memory_size;
+    /* set when loaded from a binary scene file, see scene_io.h */
+    void *mapping;
+    size_t mapped_size;
+} scene;
+
+#define SCENE_NO_HIT (-1)
+
+/* builds the BVH of every mesh and takes over its buffers
+ * @return 0 on success, -1 when out of memory
+ */
+int scene_compile(scene *scn, light_node lights,
+                  rectangular_node rectangulars, sphere_node spheres,
+                  mesh_node meshes);
+void scene_free(scene *scn);
+
+/* replace the lights, one for one, keeping the geometry
+ * @return 0 on success, -1 when lights are not as many as the scene's
+ */
+int scene_set_lights(scene *scn, light_node lights);
+
+/* recompute the precomputed data of rectangular id from its vertices */
+void scene_prepare_rectangular(scene *scn, int id);
+
+/* box around primitive id */
+void scene_primitive_bounds(const scene *scn, int id, aabb *box);
+
+/* move primitive id by offset; call scene_refit() once all are moved */
+void scene_translate(scene *scn, int id, const point3 offset);
+
+/* bring the BVH up to date with moved primitives
+ * @return 0 on success, -1 when out of memory
+ */
+int scene_refit(scene *scn);
+
+/* Point the arrays of scn into base according to the counts already
+ * set; base == NULL only computes the size.
+ * @return number of bytes the arrays take
+ */
+size_t scene_layout(scene *scn, void *base);
+
+static inline int scene_primitive_count(const scene *scn)
+{
+    return scn->rectangulars.count + scn->spheres.count +
+           scn->meshes.count;
+}
+
+static inline int scene_is_sphere(const scene *scn, int id)
+{
+    return id >= scn->rectangulars.count &&
+           id < scn->rectangulars.count + scn->spheres.count;
+}
+
+static inline int scene_is_mesh(const scene *scn, int id)
+{
+    return id >= scn->rectangulars.count + scn->spheres.count;
+}
+
+static inline const triangle_mesh *scene_mesh(const scene *scn, int id)
+{
+    return &scn->meshes.items[id - scn->rectangulars.count -
+                              scn->spheres.count];
+}
+
+static inline void point3_array_get(const point3_array *a, int i, point3 p)
+{
+    p[0] = a->x[i];
+    p[1] = a->y[i];
+    p[2] = a->z[i];
+}
+
+static inline void point3_array_set(point3_array *a, int i, const point3 p)
+{
+    a->x[i] = p[0];
+    a->y[i] = p[1];
+    a->z[i] = p[2];
+}
+
+#endif
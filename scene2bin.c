@@ -0,0 +1,30 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "scene_io.h"
+
+/* compile a text scene, BVH included, into the mmap()able binary form */
+int main(int argc, char *argv[])
+{
+    scene scn;
+    viewpoint view;
+
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s scene.txt scene.bin\n", argv[0]);
+        return -1;
+    }
+
+    memset(&view, 0, sizeof(view));
+    if (scene_load_text(&scn, &view, argv[1]) < 0)
+        return -1;
+
+    const bvh_stats *stats = &scn.accel.stats;
+    printf("%s: %d lights, %d rectangulars, %d spheres, "
+           "BVH of %d nodes built in %.3f ms\n", argv[1],
+           scn.lights.count, scn.rectangulars.count, scn.spheres.count,
+           stats->nodes, stats->build_ms);
+
+    int ret = scene_save_binary(&scn, &view, argv[2]);
+    scene_free(&scn);
+    return ret;
+}
@@ -0,0 +1,194 @@
+#include <math.h>
+
+#include "math-toolkit.h"
+#include "primitives.h"
+#include "scene_gen.h"
+
+/* objects are scattered over the stock 20x20x20 corner */
+#define SCENE_EXTENT 20.0
+
+static const viewpoint default_view = {
+    .vrp = { 40.0, 40.0, 40.0 },
+    .vpn = { -1.0, -1.0, -1.0 },
+    .vup = {  0.0,  0.0,  1.0 }
+};
+
+/* xorshift32, so scenes do not depend on the libc rand() */
+static double next_random(unsigned int *state)
+{
+    unsigned int x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return (x >> 8) / (double) (1 << 24);
+}
+
+static double uniform(unsigned int *state, double lo, double hi)
+{
+    return lo + (hi - lo) * next_random(state);
+}
+
+static void random_fill(object_fill *fill, const scene_params *p,
+                        unsigned int *state)
+{
+    double kind = next_random(state);
+    SET_COLOR(fill->fill_color, uniform(state, 0.2, 1.0),
+              uniform(state, 0.2, 1.0), uniform(state, 0.2, 1.0));
+    fill->index_of_refraction = 0.0;
+    fill->T = 0.0;
+    if (kind < p->refractive) {
+        /* glass, like sphere2 of models.inc */
+        fill->Kd = 0.0;
+        fill->Ks = 1.0;
+        fill->T = 1.0;
+        fill->R = 1.0;
+        fill->index_of_refraction = 1.5;
+        fill->phong_power = 30.0;
+    } else if (kind < p->refractive + p->reflective) {
+        fill->Kd = 0.8;
+        fill->Ks = 0.8;
+        fill->R = 0.6;
+        fill->phong_power = 30.0;
+    } else {
+        fill->Kd = 0.8;
+        fill->Ks = 0.1;
+        fill->R = 0.0;
+        fill->phong_power = 5.0;
+    }
+}
+
+static void write_point3(FILE *out, const char *name, const point3 p)
+{
+    fprintf(out, "    .%s = { %.6f, %.6f, %.6f },\n", name, p[0], p[1], p[2]);
+}
+
+static void write_fill(FILE *out, const char *name, const object_fill *f)
+{
+    fprintf(out, "    .%s = {\n"
+            "        .fill_color = { %.6f, %.6f, %.6f },\n"
+            "        .Kd = %.6f, .Ks = %.6f, .T = %.6f, .R = %.6f,\n"
+            "        .index_of_refraction = %.6f, .phong_power = %.6f\n"
+            "    }\n", name,
+            f->fill_color[0], f->fill_color[1], f->fill_color[2],
+            f->Kd, f->Ks, f->T, f->R, f->index_of_refraction,
+            f->phong_power);
+}
+
+/* the floor and two walls of models.inc */
+static void stock_rectangular(int i, rectangular *r)
+{
+    static const double corner[3][4][3] = {
+        { { 0, 0, 0 }, { 0, 0, 20 }, { 20, 0, 20 }, { 20, 0, 0 } },
+        { { 0, 0, 0 }, { 20, 0, 0 }, { 20, 20, 0 }, { 0, 20, 0 } },
+        { { 0, 0, 0 }, { 0, 20, 0 }, { 0, 20, 20 }, { 0, 0, 20 } },
+    };
+    for (int v = 0; v < 4; v++)
+        COPY_POINT3(r->vertices[v], corner[i][v]);
+    SET_COLOR(r->normal, i == 2, i == 0, i == 1);
+}
+
+void scene_generate(FILE *out, const scene_params *p)
+{
+    unsigned int state = p->seed ? p->seed : 1;
+
+    fprintf(out, "/* generated: %d spheres, %d rectangulars, %d lights, "
+            "%.2f reflective, %.2f refractive, seed %u */\n\n",
+            p->spheres, p->rectangulars, p->lights,
+            p->reflective, p->refractive, p->seed);
+
+    fprintf(out, "viewpoint view = {\n");
+    write_point3(out, "vrp", default_view.vrp);
+    write_point3(out, "vpn", default_view.vpn);
+    write_point3(out, "vup", default_view.vup);
+    fprintf(out, "};\n\n");
+
+    for (int i = 0; i < p->lights; i++) {
+        point3 position = {
+            uniform(&state, 0.0, 30.0), uniform(&state, 0.0, 30.0),
+            uniform(&state, 20.0, 30.0)
+        };
+        color c = {
+            uniform(&state, 0.3, 0.8), uniform(&state, 0.3, 0.8),
+            uniform(&state, 0.3, 0.8)
+        };
+        fprintf(out, "light light%d = {\n", i + 1);
+        write_point3(out, "light_color", c);
+        write_point3(out, "position", position);
+        fprintf(out, "    .intensity = 200.0,\n};\n\n");
+    }
+
+    /* keep the total volume of spheres about constant with their count */
+    double scale = cbrt(1000.0 / (p->spheres > 0 ? p->spheres : 1));
+    for (int i = 0; i < p->spheres; i++) {
+        double radius = uniform(&state, 0.2, 0.6) * scale;
+        point3 center = {
+            uniform(&state, 1.0, SCENE_EXTENT - 1.0),
+            uniform(&state, 1.0, SCENE_EXTENT - 1.0),
+            uniform(&state, 1.0, SCENE_EXTENT - 1.0)
+        };
+        object_fill fill;
+        random_fill(&fill, p, &state);
+        fprintf(out, "sphere sphere%d = {\n", i + 1);
+        write_point3(out, "center", center);
+        fprintf(out, "    .radius = %.6f,\n", radius);
+        write_fill(out, "sphere_fill", &fill);
+        fprintf(out, "};\n\n");
+    }
+
+    for (int i = 0; i < p->rectangulars; i++) {
+        rectangular r;
+        if (i < 3)
+            stock_rectangular(i, &r);
+        else {
+            /* a random quad turned towards the camera */
+            point3 c = {
+                uniform(&state, 1.0, SCENE_EXTENT - 1.0),
+                uniform(&state, 1.0, SCENE_EXTENT - 1.0),
+                uniform(&state, 1.0, SCENE_EXTENT - 1.0)
+            };
+            point3 a = {
+                uniform(&state, -1, 1), uniform(&state, -1, 1),
+                uniform(&state, -1, 1)
+            };
+            point3 up = { 0.0, 0.0, 1.0 }, b, to_eye;
+            normalize(a);
+            cross_product(a, up, b);
+            if (length(b) < 1e-3)
+                SET_COLOR(b, 1.0, 0.0, 0.0);
+            normalize(b);
+            multiply_vector(a, uniform(&state, 0.5, 2.0) * scale, a);
+            multiply_vector(b, uniform(&state, 0.5, 2.0) * scale, b);
+
+            cross_product(a, b, r.normal);
+            subtract_vector(default_view.vrp, c, to_eye);
+            if (dot_product(r.normal, to_eye) < 0) {
+                point3 tmp;
+                COPY_POINT3(tmp, a);
+                COPY_POINT3(a, b);
+                COPY_POINT3(b, tmp);
+                cross_product(a, b, r.normal);
+            }
+            normalize(r.normal);
+
+            /* v0, v1 = v0 + a, v2 = v0 + a + b, v3 = v0 + b */
+            for (int k = 0; k < 3; k++) {
+                r.vertices[0][k] = c[k] - a[k] / 2 - b[k] / 2;
+                r.vertices[1][k] = r.vertices[0][k] + a[k];
+                r.vertices[2][k] = r.vertices[1][k] + b[k];
+                r.vertices[3][k] = r.vertices[0][k] + b[k];
+            }
+        }
+        random_fill(&r.rectangular_fill, p, &state);
+
+        fprintf(out, "rectangular rectangular%d = {\n    .vertices = {\n",
+                i + 1);
+        for (int v = 0; v < 4; v++)
+            fprintf(out, "        { %.6f, %.6f, %.6f },\n",
+                    r.vertices[v][0], r.vertices[v][1], r.vertices[v][2]);
+        fprintf(out, "    },\n");
+        write_point3(out, "normal", r.normal);
+        write_fill(out, "rectangular_fill", &r.rectangular_fill);
+        fprintf(out, "};\n\n");
+    }
+}
@@ -0,0 +1,21 @@
+#ifndef __RAY_SCENE_GEN_H
+#define __RAY_SCENE_GEN_H
+
+#include <stdio.h>
+
+/* what a procedurally generated scene is made of */
+typedef struct {
+    int spheres;
+    int rectangulars; /**< the first three form the stock floor and walls */
+    int lights;
+    double reflective; /**< fraction of objects with a mirror finish */
+    double refractive; /**< fraction of objects made of glass */
+    unsigned int seed;
+} scene_params;
+
+/* Write a text scene (models.inc syntax) for p to out. The same
+ * parameters always produce the same scene, on any platform.
+ */
+void scene_generate(FILE *out, const scene_params *p);
+
+#endif
@@ -0,0 +1,793 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "scene_io.h"
+#include "raytracing.h"
+#include "math-toolkit.h"
+
+/* parsed initializer: a number, a string, or a braced list of items */
+typedef struct value {
+    char name[32]; /**< designator (.name = ...), empty if positional */
+    int line;
+    int is_list;
+    double number;
+    char *string;  /**< set for "..." */
+    struct value *items;
+    int count;
+} value;
+
+typedef struct {
+    const char *path;
+    const char *p;
+    int line;
+} parser;
+
+static void value_free(value *v)
+{
+    for (int i = 0; i < v->count; i++)
+        value_free(&v->items[i]);
+    free(v->items);
+    free(v->string);
+}
+
+static int parse_error(const parser *ps, int line, const char *msg,
+                       const char *arg)
+{
+    fprintf(stderr, "%s:%d: %s%s%s\n", ps->path, line, msg,
+            arg ? " " : "", arg ? arg : "");
+    return -1;
+}
+
+/* skip blanks, comments and preprocessor lines */
+static void skip_space(parser *ps)
+{
+    for (;;) {
+        const char *p = ps->p;
+        if (*p == '\n') {
+            ps->line++;
+            ps->p++;
+        } else if (isspace((unsigned char) *p))
+            ps->p++;
+        else if (p[0] == '/' && p[1] == '/')
+            while (*ps->p && *ps->p != '\n') ps->p++;
+        else if (p[0] == '/' && p[1] == '*') {
+            ps->p += 2;
+            while (*ps->p && !(ps->p[0] == '*' && ps->p[1] == '/')) {
+                if (*ps->p == '\n') ps->line++;
+                ps->p++;
+            }
+            if (*ps->p) ps->p += 2;
+        } else if (*p == '#')
+            while (*ps->p && *ps->p != '\n') ps->p++;
+        else
+            return;
+    }
+}
+
+static int expect(parser *ps, char c)
+{
+    skip_space(ps);
+    if (*ps->p != c) {
+        char what[2] = { c, 0 };
+        return parse_error(ps, ps->line, "expected", what);
+    }
+    ps->p++;
+    return 0;
+}
+
+/* @return length of the identifier read into buf, 0 if there is none */
+static int parse_ident(parser *ps, char *buf, size_t size)
+{
+    size_t n = 0;
+    skip_space(ps);
+    while (isalnum((unsigned char) *ps->p) || *ps->p == '_') {
+        if (n + 1 < size)
+            buf[n++] = *ps->p;
+        ps->p++;
+    }
+    buf[n] = '\0';
+    return n;
+}
+
+static int parse_value(parser *ps, value *v)
+{
+    skip_space(ps);
+    v->line = ps->line;
+    if (*ps->p == '"') {
+        /* no escapes: strings are only file names */
+        const char *end = strchr(ps->p + 1, '"');
+        if (!end || memchr(ps->p + 1, '\n', end - ps->p - 1))
+            return parse_error(ps, ps->line, "unterminated string", NULL);
+        v->string = strndup(ps->p + 1, end - ps->p - 1);
+        if (!v->string)
+            return parse_error(ps, ps->line, "out of memory", NULL);
+        ps->p = end + 1;
+        return 0;
+    }
+    if (*ps->p != '{') {
+        char *end;
+        v->number = strtod(ps->p, &end);
+        if (end == ps->p)
+            return parse_error(ps, ps->line, "expected a number", NULL);
+        ps->p = end;
+        /* allow C float suffixes such as 1.0f */
+        if (*ps->p == 'f' || *ps->p == 'F')
+            ps->p++;
+        return 0;
+    }
+
+    ps->p++;
+    v->is_list = 1;
+    int cap = 0;
+    for (;;) {
+        skip_space(ps);
+        if (*ps->p == '}') {
+            ps->p++;
+            return 0;
+        }
+        if (v->count == cap) {
+            cap = cap ? cap * 2 : 4;
+            value *items = realloc(v->items, sizeof(value) * cap);
+            if (!items)
+                return parse_error(ps, ps->line, "out of memory", NULL);
+            v->items = items;
+        }
+        value *item = &v->items[v->count];
+        memset(item, 0, sizeof(*item));
+        if (*ps->p == '.') {
+            ps->p++;
+            if (!parse_ident(ps, item->name, sizeof(item->name)) ||
+                    expect(ps, '='))
+                return parse_error(ps, ps->line, "bad designator", NULL);
+        }
+        v->count++;
+        if (parse_value(ps, item) < 0)
+            return -1;
+        skip_space(ps);
+        if (*ps->p == ',')
+            ps->p++;
+        else if (*ps->p != '}')
+            return parse_error(ps, ps->line, "expected , or }", NULL);
+    }
+}
+
+/* how the fields of one object map onto its C struct */
+typedef enum {
+    FIELD_NUMBER,
+    FIELD_INT,
+    FIELD_POINT3,
+    FIELD_VERTICES,
+    FIELD_FILL,
+    FIELD_PATH,     /**< into a char[SCENE_PATH_SIZE] */
+} field_kind;
+
+#define SCENE_PATH_SIZE 4096
+
+typedef struct {
+    const char *name;
+    field_kind kind;
+    size_t offset;
+} field;
+
+static const field fill_fields[] = {
+    { "fill_color", FIELD_POINT3, offsetof(object_fill, fill_color) },
+    { "Kd", FIELD_NUMBER, offsetof(object_fill, Kd) },
+    { "Ks", FIELD_NUMBER, offsetof(object_fill, Ks) },
+    { "T", FIELD_NUMBER, offsetof(object_fill, T) },
+    { "R", FIELD_NUMBER, offsetof(object_fill, R) },
+    { "index_of_refraction", FIELD_NUMBER,
+      offsetof(object_fill, index_of_refraction) },
+    { "phong_power", FIELD_NUMBER, offsetof(object_fill, phong_power) },
+    { NULL }
+};
+
+static const field light_fields[] = {
+    { "light_color", FIELD_POINT3, offsetof(light, light_color) },
+    { "position", FIELD_POINT3, offsetof(light, position) },
+    { "intensity", FIELD_NUMBER, offsetof(light, intensity) },
+    { NULL }
+};
+
+static const field sphere_fields[] = {
+    { "center", FIELD_POINT3, offsetof(sphere, center) },
+    { "radius", FIELD_NUMBER, offsetof(sphere, radius) },
+    { "sphere_fill", FIELD_FILL, offsetof(sphere, sphere_fill) },
+    { NULL }
+};
+
+static const field rectangular_fields[] = {
+    { "vertices", FIELD_VERTICES, offsetof(rectangular, vertices) },
+    { "normal", FIELD_POINT3, offsetof(rectangular, normal) },
+    { "rectangular_fill", FIELD_FILL,
+      offsetof(rectangular, rectangular_fill) },
+    { NULL }
+};
+
+/* a mesh as declared: the OBJ file and where it goes */
+typedef struct {
+    char file[SCENE_PATH_SIZE]; /**< relative to the scene file */
+    real scale;
+    point3 position;
+    object_fill mesh_fill;
+} mesh_declaration;
+
+static const field mesh_fields[] = {
+    { "file", FIELD_PATH, offsetof(mesh_declaration, file) },
+    { "scale", FIELD_NUMBER, offsetof(mesh_declaration, scale) },
+    { "position", FIELD_POINT3, offsetof(mesh_declaration, position) },
+    { "mesh_fill", FIELD_FILL, offsetof(mesh_declaration, mesh_fill) },
+    { NULL }
+};
+
+static const field viewpoint_fields[] = {
+    { "vrp", FIELD_POINT3, offsetof(viewpoint, vrp) },
+    { "vpn", FIELD_POINT3, offsetof(viewpoint, vpn) },
+    { "vup", FIELD_POINT3, offsetof(viewpoint, vup) },
+    { NULL }
+};
+
+static const field keyframe_fields[] = {
+    { "frame", FIELD_INT, offsetof(keyframe, frame) },
+    { "vrp", FIELD_POINT3, offsetof(keyframe, view.vrp) },
+    { "vpn", FIELD_POINT3, offsetof(keyframe, view.vpn) },
+    { "vup", FIELD_POINT3, offsetof(keyframe, view.vup) },
+    { NULL }
+};
+
+static const field motion_fields[] = {
+    { "object", FIELD_INT, offsetof(motion, object) },
+    { "velocity", FIELD_POINT3, offsetof(motion, velocity) },
+    { NULL }
+};
+
+static int get_point3(const parser *ps, const value *v, real *out)
+{
+    if (!v->is_list || v->count != 3)
+        return parse_error(ps, v->line, "expected { x, y, z }", NULL);
+    for (int i = 0; i < 3; i++) {
+        if (v->items[i].is_list || v->items[i].string)
+            return parse_error(ps, v->line, "expected a number", NULL);
+        out[i] = v->items[i].number;
+    }
+    return 0;
+}
+
+static int get_fields(const parser *ps, const value *init,
+                      const field *fields, void *obj)
+{
+    if (!init->is_list)
+        return parse_error(ps, init->line, "expected { ... }", NULL);
+
+    for (int i = 0; i < init->count; i++) {
+        const value *v = &init->items[i];
+        const field *f = fields;
+        while (f->name && strcmp(f->name, v->name))
+            f++;
+        if (!f->name)
+            return parse_error(ps, v->line, "unknown field",
+                               v->name[0] ? v->name : "(positional)");
+
+        char *dst = (char *) obj + f->offset;
+        switch (f->kind) {
+        case FIELD_NUMBER:
+            if (v->is_list || v->string)
+                return parse_error(ps, v->line, "expected a number", NULL);
+            *(real *) dst = v->number;
+            break;
+        case FIELD_INT:
+            if (v->is_list || v->string || v->number != (int) v->number)
+                return parse_error(ps, v->line, "expected an integer",
+                                   NULL);
+            *(int *) dst = v->number;
+            break;
+        case FIELD_POINT3:
+            if (get_point3(ps, v, (real *) dst) < 0)
+                return -1;
+            break;
+        case FIELD_VERTICES:
+            if (!v->is_list || v->count != 4)
+                return parse_error(ps, v->line, "expected 4 vertices", NULL);
+            for (int k = 0; k < 4; k++)
+                if (get_point3(ps, &v->items[k], (real *) dst + 3 * k) < 0)
+                    return -1;
+            break;
+        case FIELD_FILL:
+            if (get_fields(ps, v, fill_fields, dst) < 0)
+                return -1;
+            break;
+        case FIELD_PATH:
+            if (!v->string || strlen(v->string) >= SCENE_PATH_SIZE)
+                return parse_error(ps, v->line, "expected a file name",
+                                   NULL);
+            strcpy(dst, v->string);
+            break;
+        }
+    }
+    return 0;
+}
+
+static char *read_file(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return NULL;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *buf = malloc(size + 1);
+    if (buf && fread(buf, 1, size, f) != (size_t) size) {
+        free(buf);
+        buf = NULL;
+    }
+    if (buf)
+        buf[size] = '\0';
+    fclose(f);
+    return buf;
+}
+
+/* called with each `type name = init;` of a text file
+ * @return 0 to go on, -1 on error (already reported)
+ */
+typedef int (*declaration_func)(const parser *ps, int line,
+                                const char *type, const value *init,
+                                void *ctx);
+
+/* @return 0 on success, -1 on error (reported on stderr) */
+static int parse_declarations(const char *path, declaration_func handle,
+                              void *ctx)
+{
+    char *src = read_file(path);
+    if (!src) {
+        perror(path);
+        return -1;
+    }
+
+    parser ps = { .path = path, .p = src, .line = 1 };
+    int ret = 0;
+
+    for (;;) {
+        char word[64], type[64] = "", name[64] = "";
+        skip_space(&ps);
+        if (!*ps.p)
+            break;
+
+        /* [static] [const] type name = { ... }; */
+        int line = ps.line;
+        while (parse_ident(&ps, word, sizeof(word))) {
+            strcpy(type, name);
+            strcpy(name, word);
+        }
+        if (!type[0] || expect(&ps, '=') < 0) {
+            ret = parse_error(&ps, line, "expected a declaration", NULL);
+            break;
+        }
+
+        value init;
+        memset(&init, 0, sizeof(init));
+        if (parse_value(&ps, &init) < 0 || expect(&ps, ';') < 0) {
+            value_free(&init);
+            ret = -1;
+            break;
+        }
+        ret = handle(&ps, line, type, &init, ctx);
+        value_free(&init);
+        if (ret < 0)
+            break;
+    }
+    free(src);
+    return ret;
+}
+
+/* animation declarations may share a file with the scene */
+static int is_animation_type(const char *type)
+{
+    return !strcmp(type, "keyframe") || !strcmp(type, "motion");
+}
+
+static const char bad_view[] =
+    "viewpoint needs vpn and vup x vpn finite and non-zero";
+
+typedef struct {
+    viewpoint *view;
+    int has_view;
+    light_node lights;
+    rectangular_node rectangulars;
+    sphere_node spheres;
+    mesh_node meshes;
+} scene_text;
+
+/* load the OBJ file of a mesh declaration and place it
+ * @return the geometry, NULL on error (reported on stderr)
+ */
+static triangle_mesh *load_mesh(const parser *ps,
+                                const mesh_declaration *decl)
+{
+    char path[2 * SCENE_PATH_SIZE];
+    const char *slash = strrchr(ps->path, '/');
+
+    if (decl->file[0] != '/' && slash)
+        snprintf(path, sizeof(path), "%.*s/%s", (int) (slash - ps->path),
+                 ps->path, decl->file);
+    else
+        snprintf(path, sizeof(path), "%s", decl->file);
+
+    triangle_mesh *geometry = malloc(sizeof(triangle_mesh));
+    if (!geometry) {
+        fprintf(stderr, "%s: out of memory\n", path);
+        return NULL;
+    }
+    if (mesh_load_obj(geometry, path) < 0) {
+        free(geometry);
+        return NULL;
+    }
+    mesh_transform(geometry, decl->scale, decl->position);
+    return geometry;
+}
+
+static void free_meshes(mesh_node meshes)
+{
+    for (mesh_node m = meshes; m; m = m->next) {
+        mesh_free(m->element.geometry);
+        free(m->element.geometry);
+    }
+}
+
+static int scene_declaration(const parser *ps, int line, const char *type,
+                             const value *init, void *ctx)
+{
+    scene_text *st = ctx;
+    int ret = 0;
+
+    if (!strcmp(type, "light")) {
+        light l;
+        memset(&l, 0, sizeof(l));
+        if ((ret = get_fields(ps, init, light_fields, &l)) == 0 &&
+                append_light(&l, &st->lights) < 0)
+            ret = parse_error(ps, line, "out of memory", NULL);
+    } else if (!strcmp(type, "sphere")) {
+        sphere s;
+        memset(&s, 0, sizeof(s));
+        if ((ret = get_fields(ps, init, sphere_fields, &s)) == 0 &&
+                append_sphere(&s, &st->spheres) < 0)
+            ret = parse_error(ps, line, "out of memory", NULL);
+    } else if (!strcmp(type, "rectangular")) {
+        rectangular r;
+        memset(&r, 0, sizeof(r));
+        if ((ret = get_fields(ps, init, rectangular_fields, &r)) == 0 &&
+                append_rectangular(&r, &st->rectangulars) < 0)
+            ret = parse_error(ps, line, "out of memory", NULL);
+    } else if (!strcmp(type, "mesh")) {
+        mesh_declaration decl;
+        memset(&decl, 0, sizeof(decl));
+        decl.scale = 1.0;
+        if ((ret = get_fields(ps, init, mesh_fields, &decl)) < 0)
+            return ret;
+        if (!decl.file[0])
+            return parse_error(ps, line, "mesh without a file", NULL);
+        mesh m = { .geometry = load_mesh(ps, &decl),
+                   .mesh_fill = decl.mesh_fill };
+        if (!m.geometry)
+            return -1;
+        if (append_mesh(&m, &st->meshes) < 0) {
+            mesh_free(m.geometry);
+            free(m.geometry);
+            ret = parse_error(ps, line, "out of memory", NULL);
+        }
+    } else if (!strcmp(type, "viewpoint")) {
+        ret = get_fields(ps, init, viewpoint_fields, st->view);
+        st->has_view = 1;
+    } else if (!is_animation_type(type))
+        ret = parse_error(ps, line, "unknown type", type);
+    return ret;
+}
+
+int scene_load_text(scene *scn, viewpoint *view, const char *path)
+{
+    scene_text st = { .view = view };
+    int ret = parse_declarations(path, scene_declaration, &st);
+
+    if (ret == 0 && !st.has_view) {
+        fprintf(stderr, "%s: no viewpoint\n", path);
+        ret = -1;
+    } else if (ret == 0 && !view_valid(view)) {
+        fprintf(stderr, "%s: %s\n", path, bad_view);
+        ret = -1;
+    }
+    if (ret == 0 && scene_compile(scn, st.lights, st.rectangulars,
+                                  st.spheres, st.meshes) < 0) {
+        fprintf(stderr, "%s: out of memory\n", path);
+        ret = -1;
+    }
+    /* the scene took over the buffers of the meshes it compiled */
+    free_meshes(st.meshes);
+    delete_mesh_list(&st.meshes);
+    delete_rectangular_list(&st.rectangulars);
+    delete_sphere_list(&st.spheres);
+    delete_light_list(&st.lights);
+    return ret;
+}
+
+static int light_declaration(const parser *ps, int line, const char *type,
+                             const value *init, void *ctx)
+{
+    light_node *lights = ctx;
+    light l;
+
+    if (strcmp(type, "light"))
+        return 0;
+    memset(&l, 0, sizeof(l));
+    if (get_fields(ps, init, light_fields, &l) < 0)
+        return -1;
+    if (append_light(&l, lights) < 0)
+        return parse_error(ps, line, "out of memory", NULL);
+    return 0;
+}
+
+int lights_load(light_node *lights, const char *path)
+{
+    *lights = NULL;
+    if (parse_declarations(path, light_declaration, lights) < 0) {
+        delete_light_list(lights);
+        return -1;
+    }
+    return 0;
+}
+
+static int animation_declaration(const parser *ps, int line,
+                                 const char *type, const value *init,
+                                 void *ctx)
+{
+    animation *anim = ctx;
+
+    if (!strcmp(type, "keyframe")) {
+        keyframe k;
+        memset(&k, 0, sizeof(k));
+        if (get_fields(ps, init, keyframe_fields, &k) < 0)
+            return -1;
+        if (!view_valid(&k.view))
+            return parse_error(ps, line, bad_view, NULL);
+        /* animation_view() interpolates unit vectors */
+        normalize(k.view.vpn);
+        normalize(k.view.vup);
+        keyframe *keys = realloc(anim->keys,
+                                 sizeof(keyframe) * (anim->nkeys + 1));
+        if (!keys)
+            return parse_error(ps, line, "out of memory", NULL);
+        /* keep them sorted by frame */
+        int i = anim->nkeys++;
+        for (; i > 0 && keys[i - 1].frame > k.frame; i--)
+            keys[i] = keys[i - 1];
+        keys[i] = k;
+        anim->keys = keys;
+    } else if (!strcmp(type, "motion")) {
+        motion m;
+        memset(&m, 0, sizeof(m));
+        if (get_fields(ps, init, motion_fields, &m) < 0)
+            return -1;
+        motion *motions = realloc(anim->motions,
+                                  sizeof(motion) * (anim->nmotions + 1));
+        if (!motions)
+            return parse_error(ps, line, "out of memory", NULL);
+        motions[anim->nmotions++] = m;
+        anim->motions = motions;
+    }
+    /* the scene declarations are scene_load_text()'s */
+    return 0;
+}
+
+int animation_load(animation *anim, const char *path)
+{
+    memset(anim, 0, sizeof(*anim));
+    if (parse_declarations(path, animation_declaration, anim) < 0) {
+        animation_free(anim);
+        return -1;
+    }
+    if (!anim->nkeys) {
+        fprintf(stderr, "%s: no keyframe\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+/* The file is the header, then scene_layout()'s block, then the BVH
+ * nodes and primitive ids, each starting at a SCENE_ALIGN boundary.
+ */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;  /**< SCENE_BYTE_ORDER as written */
+    uint32_t real_size;   /**< sizeof(real) */
+    uint32_t fill_size;   /**< sizeof(object_fill) */
+    uint32_t node_size;   /**< sizeof(bvh_node) */
+    int32_t lights, rectangulars, spheres;
+    viewpoint view;
+    bvh_stats stats;
+    uint64_t data_offset, data_size;
+    uint64_t nodes_offset, prims_offset;
+    uint64_t file_size;
+} scene_file_header;
+
+#define SCENE_BYTE_ORDER 0x01020304
+
+static void header_init(scene_file_header *h, const scene *scn,
+                        const viewpoint *view)
+{
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, SCENE_FILE_MAGIC, sizeof(SCENE_FILE_MAGIC));
+    h->version = SCENE_FILE_VERSION;
+    h->byte_order = SCENE_BYTE_ORDER;
+    h->real_size = sizeof(real);
+    h->fill_size = sizeof(object_fill);
+    h->node_size = sizeof(bvh_node);
+    h->lights = scn->lights.count;
+    h->rectangulars = scn->rectangulars.count;
+    h->spheres = scn->spheres.count;
+    if (view)
+        h->view = *view;
+    h->stats = scn->accel.stats;
+
+    size_t nodes = scn->accel.stats.nodes;
+    size_t prims = scn->accel.stats.primitives;
+    h->data_offset = SCENE_ALIGN_UP(sizeof(*h));
+    h->data_size = scn->memory_size;
+    h->nodes_offset = SCENE_ALIGN_UP(h->data_offset + h->data_size);
+    h->prims_offset = SCENE_ALIGN_UP(h->nodes_offset +
+                                     nodes * sizeof(bvh_node));
+    h->file_size = h->prims_offset + prims * sizeof(int);
+}
+
+static int write_at(FILE *f, uint64_t offset, const void *data, size_t size)
+{
+    /* pad up to offset so every section keeps its alignment */
+    static const char zeros[SCENE_ALIGN];
+    long pos = ftell(f);
+    if (pos < 0 || (uint64_t) pos > offset)
+        return -1;
+    if (fwrite(zeros, 1, offset - pos, f) != offset - pos)
+        return -1;
+    return (fwrite(data, 1, size, f) == size) ? 0 : -1;
+}
+
+int scene_save_binary(const scene *scn, const viewpoint *view,
+                      const char *path)
+{
+    scene_file_header h;
+    header_init(&h, scn, view);
+
+    /* meshes live outside the block the file is an image of */
+    if (scn->meshes.count) {
+        fprintf(stderr, "%s: binary scenes cannot hold meshes\n", path);
+        return -1;
+    }
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    int ret = 0;
+    if (fwrite(&h, sizeof(h), 1, f) != 1 ||
+            write_at(f, h.data_offset, scn->memory, h.data_size) ||
+            write_at(f, h.nodes_offset, scn->accel.nodes,
+                     h.stats.nodes * sizeof(bvh_node)) ||
+            write_at(f, h.prims_offset, scn->accel.prims,
+                     h.stats.primitives * sizeof(int))) {
+        perror(path);
+        ret = -1;
+    }
+    if (fclose(f) && !ret) {
+        perror(path);
+        ret = -1;
+    }
+    return ret;
+}
+
+/* @return 1 if count elements of size bytes at offset lie within a file
+ *         of file_size bytes, aligned as header_init() puts them
+ */
+static int section_fits(uint64_t offset, uint64_t count, uint64_t size,
+                        uint64_t file_size)
+{
+    return offset % SCENE_ALIGN == 0 && offset <= file_size &&
+           count <= (file_size - offset) / size;
+}
+
+int scene_load_binary(scene *scn, viewpoint *view, const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 ||
+            st.st_size < (off_t) sizeof(scene_file_header)) {
+        fprintf(stderr, "%s: not a binary scene\n", path);
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror(path);
+        return -1;
+    }
+
+    const scene_file_header *h = map;
+    if (memcmp(h->magic, SCENE_FILE_MAGIC, sizeof(SCENE_FILE_MAGIC)) ||
+            h->version != SCENE_FILE_VERSION ||
+            h->byte_order != SCENE_BYTE_ORDER ||
+            h->real_size != sizeof(real) ||
+            h->fill_size != sizeof(object_fill) ||
+            h->node_size != sizeof(bvh_node) ||
+            h->file_size > (uint64_t) st.st_size) {
+        fprintf(stderr, "%s: incompatible binary scene\n", path);
+        munmap(map, st.st_size);
+        return -1;
+    }
+    if (!view_valid(&h->view)) {
+        fprintf(stderr, "%s: %s\n", path, bad_view);
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    /* every section within the file, then the tree within its sections */
+    uint64_t size = st.st_size;
+    memset(scn, 0, sizeof(*scn));
+    scn->lights.count = h->lights;
+    scn->rectangulars.count = h->rectangulars;
+    scn->spheres.count = h->spheres;
+    scn->memory = (char *) map + h->data_offset;
+    if (h->lights < 0 || h->rectangulars < 0 || h->spheres < 0 ||
+            h->stats.nodes < 0 || h->stats.primitives < 0 ||
+            !section_fits(h->data_offset, h->data_size, 1, size) ||
+            !section_fits(h->nodes_offset, h->stats.nodes,
+                          sizeof(bvh_node), size) ||
+            !section_fits(h->prims_offset, h->stats.primitives,
+                          sizeof(int), size) ||
+            scene_layout(scn, scn->memory) != h->data_size) {
+        fprintf(stderr, "%s: corrupted binary scene\n", path);
+        munmap(map, st.st_size);
+        memset(scn, 0, sizeof(*scn));
+        return -1;
+    }
+    scn->memory_size = h->data_size;
+    scn->accel.nodes = (bvh_node *) ((char *) map + h->nodes_offset);
+    scn->accel.prims = (int *) ((char *) map + h->prims_offset);
+    scn->accel.stats = h->stats;
+    if (bvh_check(&scn->accel, h->rectangulars + h->spheres) < 0) {
+        fprintf(stderr, "%s: corrupted binary scene\n", path);
+        munmap(map, st.st_size);
+        memset(scn, 0, sizeof(*scn));
+        return -1;
+    }
+    scn->mapping = map;
+    scn->mapped_size = st.st_size;
+    if (view)
+        *view = h->view;
+    return 0;
+}
+
+int scene_load(scene *scn, viewpoint *view, const char *path)
+{
+    char magic[sizeof(SCENE_FILE_MAGIC)] = "";
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    size_t n = fread(magic, 1, sizeof(magic), f);
+    fclose(f);
+
+    if (n == sizeof(magic) && !memcmp(magic, SCENE_FILE_MAGIC, n))
+        return scene_load_binary(scn, view, path);
+    return scene_load_text(scn, view, path);
+}
@@ -0,0 +1,58 @@
+#ifndef __RAY_SCENE_IO_H
+#define __RAY_SCENE_IO_H
+
+#include "scene.h"
+#include "animation.h"
+
+/* Text scenes use the syntax of models.inc: C initializers such as
+ *
+ *     static const sphere sphere1 = { .center = { 5, 0, 5 }, ... };
+ *
+ * for the types light, sphere, rectangular and viewpoint. Objects are
+ * added in the order they appear. A mesh names a Wavefront OBJ file,
+ * relative to the scene file:
+ *
+ *     mesh bunny = { .file = "bunny.obj", .scale = 10,
+ *                    .position = { 0, 0, 5 }, .mesh_fill = { ... } };
+ *
+ * Meshes are not carried by binary scenes.
+ *
+ * Binary scenes are the compiled arrays and BVH of a scene written out
+ * as they sit in memory. They are mmap()ed privately and used in place,
+ * so they must be produced on a machine with the same byte order and
+ * layout; scene2bin converts text scenes.
+ *
+ * Animations are text files of the same syntax declaring
+ *
+ *     keyframe k1 = { .frame = 0, .vrp = { ... }, .vpn = ..., .vup = ... };
+ *     motion m1 = { .object = 4, .velocity = { 0, 0, 0.1 } };
+ *
+ * and may be the scene file itself: each loader skips the other's types.
+ */
+
+#define SCENE_FILE_MAGIC "RTSCENE"
+#define SCENE_FILE_VERSION 2
+
+/* load either kind of scene, telling them apart by the magic
+ * @param view receives the viewpoint of the file, which must have a
+ *        valid one, see view_valid()
+ * @return 0 on success, -1 on error (reported on stderr)
+ */
+int scene_load(scene *scn, viewpoint *view, const char *path);
+int scene_load_text(scene *scn, viewpoint *view, const char *path);
+int scene_load_binary(scene *scn, viewpoint *view, const char *path);
+
+/* @return 0 on success, -1 on error (reported on stderr) */
+int animation_load(animation *anim, const char *path);
+
+/* the lights of a text file, in order, skipping every other declaration,
+ * so that a scene file itself can serve
+ * @return 0 on success, -1 on error (reported on stderr)
+ */
+int lights_load(light_node *lights, const char *path);
+
+/* @return 0 on success, -1 on error (reported on stderr) */
+int scene_save_binary(const scene *scn, const viewpoint *view,
+                      const char *path);
+
+#endif
@@ -0,0 +1,58 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "scene_gen.h"
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-n spheres] [-m rectangulars] [-k lights] "
+            "[-f reflective] [-g refractive] [-x seed] [-o file]\n"
+            "  writes a text scene, to stdout unless -o is given\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+    scene_params p = {
+        .spheres = 100, .rectangulars = 3, .lights = 2,
+        .reflective = 0.2, .refractive = 0.05, .seed = 1
+    };
+    FILE *out = stdout;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:m:k:f:g:x:o:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            p.spheres = atoi(optarg);
+            break;
+        case 'm':
+            p.rectangulars = atoi(optarg);
+            break;
+        case 'k':
+            p.lights = atoi(optarg);
+            break;
+        case 'f':
+            p.reflective = atof(optarg);
+            break;
+        case 'g':
+            p.refractive = atof(optarg);
+            break;
+        case 'x':
+            p.seed = strtoul(optarg, NULL, 0);
+            break;
+        case 'o':
+            if (!(out = fopen(optarg, "w"))) {
+                perror(optarg);
+                return -1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : -1;
+        }
+    }
+
+    scene_generate(out, &p);
+    return fclose(out) ? -1 : 0;
+}
@@ -0,0 +1,282 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "scheduler.h"
+
+/* Each worker owns the tile range [head, tail). The owner consumes from
+ * the head so tiles are rendered in order, thieves cut from the tail.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    int head, tail;
+} work_queue;
+
+typedef struct {
+    const tile *tiles;
+    work_queue *queues;
+    int nthreads;
+    tile_func func;
+    void *arg;
+} scheduler;
+
+typedef struct {
+    scheduler *sched;
+    int id;
+} worker;
+
+int tile_split(tile **tiles, int width, int height, int tile_size)
+{
+    int cols = (width + tile_size - 1) / tile_size;
+    int rows = (height + tile_size - 1) / tile_size;
+    int n = 0;
+
+    *tiles = malloc(sizeof(tile) * cols * rows);
+    if (!*tiles)
+        return 0;
+
+    for (int y = 0; y < height; y += tile_size) {
+        for (int x = 0; x < width; x += tile_size) {
+            tile *t = &(*tiles)[n++];
+            t->x = x;
+            t->y = y;
+            t->width = (x + tile_size > width) ? width - x : tile_size;
+            t->height = (y + tile_size > height) ? height - y : tile_size;
+        }
+    }
+    return n;
+}
+
+static const char *order_names[] = {
+    [ORDER_SCANLINE] = "scanline",
+    [ORDER_TILES] = "tiles",
+    [ORDER_MORTON] = "morton",
+    [ORDER_HILBERT] = "hilbert",
+};
+
+const char *traversal_order_name(traversal_order order)
+{
+    return order_names[order];
+}
+
+int traversal_order_parse(const char *name)
+{
+    for (int i = 0; i <= ORDER_HILBERT; i++)
+        if (!strcmp(name, order_names[i]))
+            return i;
+    return -1;
+}
+
+/* rotate and flip a quadrant of the Hilbert curve into place */
+static void hilbert_rotate(int n, int *x, int *y, int rx, int ry)
+{
+    if (ry)
+        return;
+    if (rx) {
+        *x = n - 1 - *x;
+        *y = n - 1 - *y;
+    }
+    int t = *x;
+    *x = *y;
+    *y = t;
+}
+
+void traversal_point(traversal_order order, int side, int d,
+                     int *x, int *y)
+{
+    *x = *y = 0;
+    switch (order) {
+    case ORDER_MORTON:
+        /* x takes the even bits of d, y the odd ones */
+        for (int b = 0; (1 << b) < side; b++) {
+            *x |= ((d >> (2 * b)) & 1) << b;
+            *y |= ((d >> (2 * b + 1)) & 1) << b;
+        }
+        break;
+    case ORDER_HILBERT:
+        for (int s = 1; s < side; s *= 2) {
+            int rx = 1 & (d / 2);
+            int ry = 1 & (d ^ rx);
+            hilbert_rotate(s, x, y, rx, ry);
+            *x += s * rx;
+            *y += s * ry;
+            d /= 4;
+        }
+        break;
+    default:
+        *x = d % side;
+        *y = d / side;
+    }
+}
+
+int traversal_index(traversal_order order, int side, int x, int y)
+{
+    int d = 0;
+
+    switch (order) {
+    case ORDER_MORTON:
+        for (int b = 0; (1 << b) < side; b++)
+            d |= (((x >> b) & 1) << (2 * b)) |
+                 (((y >> b) & 1) << (2 * b + 1));
+        return d;
+    case ORDER_HILBERT:
+        for (int s = side / 2; s > 0; s /= 2) {
+            int rx = (x & s) > 0;
+            int ry = (y & s) > 0;
+            d += s * s * ((3 * rx) ^ ry);
+            hilbert_rotate(side, &x, &y, rx, ry);
+        }
+        return d;
+    default:
+        return y * side + x;
+    }
+}
+
+typedef struct {
+    int key;
+    tile t;
+} keyed_tile;
+
+static int compare_keys(const void *a, const void *b)
+{
+    const keyed_tile *ka = a, *kb = b;
+    return (ka->key > kb->key) - (ka->key < kb->key);
+}
+
+int tile_order(tile *tiles, int ntiles, int tile_size,
+               traversal_order order)
+{
+    if (order <= ORDER_TILES || ntiles < 2)
+        return 0;
+
+    keyed_tile *keyed = malloc(sizeof(keyed_tile) * ntiles);
+    if (!keyed)
+        return -1;
+    int side = 1;
+    for (int i = 0; i < ntiles; i++) {
+        while (side * tile_size <= tiles[i].x ||
+               side * tile_size <= tiles[i].y)
+            side *= 2;
+    }
+    for (int i = 0; i < ntiles; i++) {
+        keyed[i].key = traversal_index(order, side, tiles[i].x / tile_size,
+                                       tiles[i].y / tile_size);
+        keyed[i].t = tiles[i];
+    }
+    qsort(keyed, ntiles, sizeof(keyed_tile), compare_keys);
+    for (int i = 0; i < ntiles; i++)
+        tiles[i] = keyed[i].t;
+    free(keyed);
+    return 0;
+}
+
+/* @return index of the next tile of our own queue, -1 when empty */
+static int queue_pop(work_queue *q)
+{
+    int idx = -1;
+    pthread_mutex_lock(&q->lock);
+    if (q->head < q->tail)
+        idx = q->head++;
+    pthread_mutex_unlock(&q->lock);
+    return idx;
+}
+
+/* move the back half of a victim's range into our own (empty) queue */
+static int queue_steal(scheduler *s, int thief)
+{
+    for (int i = 1; i < s->nthreads; i++) {
+        work_queue *victim = &s->queues[(thief + i) % s->nthreads];
+        int head, tail;
+
+        pthread_mutex_lock(&victim->lock);
+        head = victim->head;
+        tail = victim->tail;
+        if (tail - head > 0) {
+            /* leave the victim the front half, rounded up */
+            victim->tail = head + (tail - head + 1) / 2;
+            head = victim->tail;
+        }
+        pthread_mutex_unlock(&victim->lock);
+
+        if (tail - head > 0) {
+            work_queue *own = &s->queues[thief];
+            pthread_mutex_lock(&own->lock);
+            own->head = head;
+            own->tail = tail;
+            pthread_mutex_unlock(&own->lock);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void *worker_main(void *arg)
+{
+    worker *w = arg;
+    scheduler *s = w->sched;
+
+    for (;;) {
+        int idx = queue_pop(&s->queues[w->id]);
+        if (idx < 0) {
+            if (!queue_steal(s, w->id))
+                break;
+            continue;
+        }
+        s->func(&s->tiles[idx], w->id, s->arg);
+    }
+    return NULL;
+}
+
+int scheduler_run(const tile *tiles, int ntiles, int nthreads,
+                  tile_func func, void *arg)
+{
+    if (nthreads > ntiles)
+        nthreads = ntiles;
+    if (nthreads <= 1) {
+        for (int i = 0; i < ntiles; i++)
+            func(&tiles[i], 0, arg);
+        return 0;
+    }
+
+    scheduler s = {
+        .tiles = tiles, .nthreads = nthreads,
+        .func = func, .arg = arg
+    };
+    pthread_t *threads = malloc(sizeof(pthread_t) * nthreads);
+    worker *workers = malloc(sizeof(worker) * nthreads);
+    s.queues = malloc(sizeof(work_queue) * nthreads);
+    if (!threads || !workers || !s.queues) {
+        free(threads);
+        free(workers);
+        free(s.queues);
+        return -1;
+    }
+
+    for (int i = 0; i < nthreads; i++) {
+        pthread_mutex_init(&s.queues[i].lock, NULL);
+        s.queues[i].head = (long) ntiles * i / nthreads;
+        s.queues[i].tail = (long) ntiles * (i + 1) / nthreads;
+        workers[i].sched = &s;
+        workers[i].id = i;
+    }
+
+    /* worker 0 runs on the calling thread. If a thread fails to start,
+     * its range is simply stolen by the workers that did.
+     */
+    int started = 1;
+    for (; started < nthreads; started++) {
+        if (pthread_create(&threads[started], NULL,
+                           worker_main, &workers[started]))
+            break;
+    }
+    worker_main(&workers[0]);
+    for (int i = 1; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    for (int i = 0; i < nthreads; i++)
+        pthread_mutex_destroy(&s.queues[i].lock);
+    free(s.queues);
+    free(workers);
+    free(threads);
+    return 0;
+}
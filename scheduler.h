@@ -0,0 +1,57 @@
+#ifndef __RAY_SCHEDULER_H
+#define __RAY_SCHEDULER_H
+
+/* a rectangular block of the image, in pixels */
+typedef struct {
+    int x, y;
+    int width, height;
+} tile;
+
+/* order in which tiles, and the pixels inside a tile, are visited; the
+ * image is laid out in rows whatever the order
+ */
+typedef enum {
+    ORDER_SCANLINE, /**< rows: serial renders go down the whole image */
+    ORDER_TILES,    /**< square tiles row by row, rows inside each */
+    ORDER_MORTON,   /**< tiles and their pixels along the Z-order curve */
+    ORDER_HILBERT,  /**< tiles and their pixels along the Hilbert curve */
+} traversal_order;
+
+const char *traversal_order_name(traversal_order order);
+
+/* @return the order called name, -1 if there is none */
+int traversal_order_parse(const char *name);
+
+/* cell (x, y) of the d-th step along the curve of order through a
+ * side x side grid, side a power of two; row by row for the orders
+ * without a curve
+ */
+void traversal_point(traversal_order order, int side, int d,
+                     int *x, int *y);
+
+/* @return the step of cell (x, y) along that curve */
+int traversal_index(traversal_order order, int side, int x, int y);
+
+/* @param worker index of the calling worker, in [0, nthreads) */
+typedef void (*tile_func)(const tile *t, int worker, void *arg);
+
+/* split the width x height image into square tiles of tile_size pixels.
+ * @return number of tiles written to *tiles, which the caller frees
+ */
+int tile_split(tile **tiles, int width, int height, int tile_size);
+
+/* sort tiles that tile_split() made with tile_size into order
+ * @return 0 on success, -1 when out of memory
+ */
+int tile_order(tile *tiles, int ntiles, int tile_size,
+               traversal_order order);
+
+/* Run func over every tile on nthreads workers. Each worker starts with
+ * a contiguous share of the tiles and, once that runs dry, steals half
+ * of the remaining work from another worker.
+ * @return 0 on success, -1 if the workers could not be started
+ */
+int scheduler_run(const tile *tiles, int ntiles, int nthreads,
+                  tile_func func, void *arg);
+
+#endif
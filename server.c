@@ -0,0 +1,340 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+
+#include "server.h"
+#include "net.h"
+
+#define SERVER_MAGIC 0x52415953 /* "RAYS" */
+#define SERVER_VERSION 1
+
+/* milliseconds between looks at the stop flag */
+#define SERVER_POLL_MS 200
+
+enum {
+    MSG_HELLO,  /**< server: server_hello */
+    MSG_RENDER, /**< client: render_request */
+    MSG_IMAGE,  /**< server: render_reply, then the pixels */
+};
+
+typedef struct {
+    uint32_t magic, version, real_size;
+    server_info info;
+} server_hello;
+
+typedef struct server server;
+
+typedef struct {
+    server *srv;
+    int fd;
+    int used;     /**< the slot holds a connection */
+    int finished; /**< its thread has returned and can be joined */
+    pthread_t thread;
+} client;
+
+struct server {
+    const scene *scn;
+    color background;
+    render_options options;
+
+    /* requests take tickets and render when theirs comes up */
+    pthread_mutex_t lock;
+    pthread_cond_t turn;
+    unsigned next_ticket, serving;
+
+    /* answered requests; seconds from arrival to the reply */
+    double *latencies;
+    int answered, latencies_size, refused;
+    double queued, render;
+
+    client clients[SERVER_MAX_CLIENTS];
+};
+
+static volatile sig_atomic_t stop_requested;
+
+static void request_stop(int sig)
+{
+    (void) sig;
+    stop_requested = 1;
+}
+
+static int check_request(const render_request *r)
+{
+    const tile *t = &r->region;
+
+    return r->width >= 2 && r->width <= SERVER_MAX_SIZE &&
+           r->height >= 2 && r->height <= SERVER_MAX_SIZE &&
+           r->samples >= 0 && r->samples <= 1024 &&
+           t->x >= 0 && t->y >= 0 && t->width >= 0 && t->height >= 0 &&
+           t->width <= r->width - t->x && t->height <= r->height - t->y &&
+           view_valid(&r->view);
+}
+
+static void record(server *s, double latency, const render_reply *reply)
+{
+    if (reply->status < 0) {
+        s->refused++;
+        return;
+    }
+    if (s->answered == s->latencies_size) {
+        int size = s->latencies_size ? s->latencies_size * 2 : 1024;
+        double *l = realloc(s->latencies, sizeof(double) * size);
+        if (!l)
+            return;
+        s->latencies = l;
+        s->latencies_size = size;
+    }
+    s->latencies[s->answered++] = latency;
+    s->queued += reply->queued;
+    s->render += reply->render;
+}
+
+/* Wait for the turn of the request that arrived at received, render it
+ * into a buffer of its own and pass the turn on before answering, so a
+ * client slow to read holds up nobody else.
+ * @return 0 on success, -1 when the client is gone or stopped reading
+ */
+static int answer(server *s, int fd, render_request *r, double received)
+{
+    render_reply reply = { .status = -1 };
+    uint8_t *pixels = NULL;
+    size_t size = 0;
+
+    pthread_mutex_lock(&s->lock);
+    unsigned ticket = s->next_ticket++;
+    while (s->serving != ticket)
+        pthread_cond_wait(&s->turn, &s->lock);
+    pthread_mutex_unlock(&s->lock);
+
+    double start = monotonic_seconds();
+    reply.queued = start - received;
+    if (check_request(r)) {
+        if (!r->region.width || !r->region.height)
+            r->region = (tile) { 0, 0, r->width, r->height };
+        size = (size_t) r->region.width * r->region.height * 3;
+        pixels = malloc(size);
+    }
+    if (pixels) {
+        render_options options = s->options;
+        options.max_samples = r->samples;
+        if (raytracing_tile(pixels, s->background, s->scn, &r->view,
+                            r->width, r->height, &r->region,
+                            &options) == 0)
+            reply.status = 0;
+    }
+    if (reply.status < 0)
+        size = 0;
+    reply.render = monotonic_seconds() - start;
+
+    pthread_mutex_lock(&s->lock);
+    s->serving++;
+    pthread_cond_broadcast(&s->turn);
+    pthread_mutex_unlock(&s->lock);
+
+    int ret = send_message(fd, MSG_IMAGE, &reply, sizeof(reply),
+                           pixels, size);
+    free(pixels);
+    if (!ret) {
+        pthread_mutex_lock(&s->lock);
+        record(s, monotonic_seconds() - received, &reply);
+        pthread_mutex_unlock(&s->lock);
+    }
+    return ret;
+}
+
+static void *serve_client(void *arg)
+{
+    client *c = arg;
+    render_request r;
+
+    while (!recv_message(c->fd, MSG_RENDER, &r, sizeof(r)) &&
+           !answer(c->srv, c->fd, &r, monotonic_seconds()))
+        ;
+
+    pthread_mutex_lock(&c->srv->lock);
+    c->finished = 1;
+    pthread_mutex_unlock(&c->srv->lock);
+    return NULL;
+}
+
+static void accept_client(server *s, int listen_fd,
+                          const server_hello *hello)
+{
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    int fd = accept(listen_fd, (struct sockaddr *) &addr, &len);
+    if (fd < 0)
+        return;
+    set_nodelay(fd, addr.ss_family);
+    set_send_timeout(fd, SERVER_SEND_TIMEOUT);
+
+    client *c = NULL;
+    for (int i = 0; i < SERVER_MAX_CLIENTS && !c; i++)
+        if (!s->clients[i].used)
+            c = &s->clients[i];
+    if (!c || send_message(fd, MSG_HELLO, hello, sizeof(*hello),
+                           NULL, 0) < 0) {
+        close(fd);
+        return;
+    }
+    *c = (client) { .srv = s, .fd = fd, .used = 1 };
+    if (pthread_create(&c->thread, NULL, serve_client, c)) {
+        c->used = 0;
+        close(fd);
+    }
+}
+
+/* join the threads of clients that have gone, or of all of them */
+static void reap_clients(server *s, int all)
+{
+    for (int i = 0; i < SERVER_MAX_CLIENTS; i++) {
+        client *c = &s->clients[i];
+        if (!c->used)
+            continue;
+        pthread_mutex_lock(&s->lock);
+        int finished = c->finished;
+        pthread_mutex_unlock(&s->lock);
+        if (!finished && !all)
+            continue;
+        if (!finished)
+            shutdown(c->fd, SHUT_RDWR);
+        pthread_join(c->thread, NULL);
+        close(c->fd);
+        c->used = 0;
+    }
+}
+
+static int compare_seconds(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/* nearest rank percentile p of n sorted values */
+static double percentile(const double *sorted, int n, double p)
+{
+    int rank = (int) (p / 100.0 * n + 0.999999);
+    return sorted[rank < 1 ? 0 : rank > n ? n - 1 : rank - 1];
+}
+
+static void report(server *s, double seconds, FILE *log)
+{
+    int n = s->answered;
+
+    fprintf(log, "# Served %d requests in %lf sec, %d refused\n",
+            n, seconds, s->refused);
+    if (!n)
+        return;
+    qsort(s->latencies, n, sizeof(double), compare_seconds);
+    fprintf(log, "# Latency ms: p50 %.3f, p90 %.3f, p99 %.3f, max %.3f; "
+            "mean queued %.3f, mean render %.3f\n",
+            1000 * percentile(s->latencies, n, 50),
+            1000 * percentile(s->latencies, n, 90),
+            1000 * percentile(s->latencies, n, 99),
+            1000 * s->latencies[n - 1],
+            1000 * s->queued / n, 1000 * s->render / n);
+}
+
+int server_run(const char *address, color background_color,
+               const scene *scn, const viewpoint *view,
+               int width, int height, const render_options *options,
+               FILE *log)
+{
+    server_hello hello = {
+        .magic = SERVER_MAGIC,
+        .version = SERVER_VERSION,
+        .real_size = sizeof(real),
+        .info = { .view = *view, .width = width, .height = height },
+    };
+    struct sigaction stop = { .sa_handler = request_stop }, old_int, old_term;
+    int listen_fd = listen_on(address, SERVER_MAX_CLIENTS);
+    if (listen_fd < 0)
+        return -1;
+
+    server *s = calloc(1, sizeof(server));
+    if (!s) {
+        fprintf(stderr, "out of memory\n");
+        close(listen_fd);
+        return -1;
+    }
+    s->scn = scn;
+    COPY_COLOR(s->background, background_color);
+    s->options = *options;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->turn, NULL);
+
+    /* no SA_RESTART: poll returns early on a stop */
+    stop_requested = 0;
+    sigaction(SIGINT, &stop, &old_int);
+    sigaction(SIGTERM, &stop, &old_term);
+    if (log)
+        fprintf(log, "# Serving on %s, %d thread(s)\n", address,
+                options->nthreads);
+
+    double start = monotonic_seconds();
+    while (!stop_requested) {
+        struct pollfd p = { .fd = listen_fd, .events = POLLIN };
+        if (poll(&p, 1, SERVER_POLL_MS) > 0)
+            accept_client(s, listen_fd, &hello);
+        reap_clients(s, 0);
+    }
+    reap_clients(s, 1);
+    close(listen_fd);
+    sigaction(SIGINT, &old_int, NULL);
+    sigaction(SIGTERM, &old_term, NULL);
+
+    if (log)
+        report(s, monotonic_seconds() - start, log);
+    pthread_cond_destroy(&s->turn);
+    pthread_mutex_destroy(&s->lock);
+    free(s->latencies);
+    free(s);
+    return 0;
+}
+
+int server_connect(const char *address, server_info *info)
+{
+    server_hello hello;
+    int fd = connect_to(address, 0);
+
+    if (fd < 0)
+        return -1;
+    if (recv_message(fd, MSG_HELLO, &hello, sizeof(hello)) < 0 ||
+            hello.magic != SERVER_MAGIC ||
+            hello.version != SERVER_VERSION ||
+            hello.real_size != sizeof(real)) {
+        fprintf(stderr, "%s: not a render server of this build\n",
+                address);
+        close(fd);
+        return -1;
+    }
+    *info = hello.info;
+    return fd;
+}
+
+int server_render(int fd, const render_request *request,
+                  uint8_t *pixels, render_reply *reply)
+{
+    message_header h;
+    const tile *t = &request->region;
+    size_t size = t->width && t->height ?
+                  (size_t) t->width * t->height * 3 :
+                  (size_t) request->width * request->height * 3;
+
+    if (send_message(fd, MSG_RENDER, request, sizeof(*request),
+                     NULL, 0) < 0 ||
+            read_full(fd, &h, sizeof(h)) < 0 || h.type != MSG_IMAGE ||
+            read_full(fd, reply, sizeof(*reply)) < 0)
+        return -1;
+    if (reply->status < 0)
+        return h.size == sizeof(*reply) ? 0 : -1;
+    if (h.size != sizeof(*reply) + size)
+        return -1;
+    return read_full(fd, pixels, size);
+}
@@ -0,0 +1,77 @@
+#ifndef __RAY_SERVER_H
+#define __RAY_SERVER_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "raytracing.h"
+
+/* A render server keeps one scene loaded and its BVH built, and renders
+ * what clients connected on unix:PATH or [HOST]:PORT ask for: a view,
+ * resolution, sample count and region per request, answered with the
+ * pixels of that region. Each connection may send any number of
+ * requests. Requests are rendered one at a time, in the order they
+ * arrived, each on all of the server's threads; the others queue.
+ *
+ * Messages are raw structs, so clients must be built with the same
+ * precision on machines of the same byte order.
+ */
+
+#define SERVER_MAX_CLIENTS 64
+
+/* largest image edge a request may ask for */
+#define SERVER_MAX_SIZE 16384
+
+/* seconds a reply may wait for a client to read it before the client is
+ * dropped
+ */
+#define SERVER_SEND_TIMEOUT 10.0
+
+typedef struct {
+    viewpoint view;
+    int32_t width, height;
+    int32_t samples; /**< adaptive, up to this many per pixel; 0: fixed */
+    tile region;     /**< of the image to render; empty: all of it */
+} render_request;
+
+typedef struct {
+    /* 0, or -1 when the request was refused: smaller than 2x2, a
+     * region outside the image, or a view with vpn or vup x vpn zero or
+     * not finite
+     */
+    int32_t status;
+    double queued;   /**< seconds waiting behind other requests */
+    double render;   /**< seconds rendering */
+} render_reply;
+
+/* what a server says on connecting: its scene's camera and the
+ * resolution it was started with, as defaults for requests
+ */
+typedef struct {
+    viewpoint view;
+    int32_t width, height;
+} server_info;
+
+/* Serve the scene until SIGINT or SIGTERM, then log how many requests
+ * were answered and percentiles of their latency.
+ * @param options used for every request but max_samples
+ * @return 0 on success, -1 on error (reported on stderr)
+ */
+int server_run(const char *address, color background_color,
+               const scene *scn, const viewpoint *view,
+               int width, int height, const render_options *options,
+               FILE *log);
+
+/* @return a connection to the server at address, -1 on error (reported
+ *         on stderr); info receives its defaults
+ */
+int server_connect(const char *address, server_info *info);
+
+/* Render request on the server behind fd; pixels must hold the region,
+ * row by row. A refused request leaves them untouched.
+ * @return 0 on success, -1 when the connection failed
+ */
+int server_render(int fd, const render_request *request,
+                  uint8_t *pixels, render_reply *reply);
+
+#endif
@@ -0,0 +1,82 @@
+#include "stats.h"
+
+#if RAY_STATS
+__thread render_counters *stats_current;
+#endif
+
+static const char *counter_names[STAT_COUNTERS] = {
+    [STAT_NODE_TESTS] = "node_tests",
+    [STAT_SPHERE_TESTS] = "sphere_tests",
+    [STAT_RECTANGULAR_TESTS] = "rectangular_tests",
+    [STAT_MESH_TESTS] = "mesh_tests",
+    [STAT_PACKET_NODE_TESTS] = "packet_node_tests",
+    [STAT_PACKET_PRIM_TESTS] = "packet_prim_tests",
+    [STAT_OCCLUDER_HITS] = "occluder_cache_hits",
+    [STAT_BOUNCE_LIMIT] = "bounce_limit",
+    [STAT_LIGHTS_CULLED] = "lights_culled",
+};
+
+static const char *stage_names[STAGE_COUNT] = {
+    [STAGE_PRIMARY] = "primary",
+    [STAGE_INTERSECT] = "intersect",
+    [STAGE_SHADOW] = "shadow",
+    [STAGE_RENDER] = "render",
+};
+
+void stats_merge(render_counters *dst, const render_counters *src)
+{
+    for (int i = 0; i < STAT_COUNTERS; i++)
+        dst->count[i] += src->count[i];
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        dst->cycles[i] += src->cycles[i];
+        dst->calls[i] += src->calls[i];
+    }
+}
+
+/* cycles of the render not spent in any other stage */
+static uint64_t shading_cycles(const render_counters *c)
+{
+    uint64_t rest = c->cycles[STAGE_RENDER];
+    for (int i = 0; i < STAGE_RENDER; i++)
+        rest = rest > c->cycles[i] ? rest - c->cycles[i] : 0;
+    return rest;
+}
+
+void stats_print(FILE *out, const render_counters *c)
+{
+    for (int i = 0; i < STAT_COUNTERS; i++)
+        fprintf(out, "# %-20s %llu\n", counter_names[i],
+                (unsigned long long) c->count[i]);
+    if (RAY_STATS < 2)
+        return;
+
+    double total = c->cycles[STAGE_RENDER] ? c->cycles[STAGE_RENDER] : 1;
+    for (int i = 0; i < STAGE_RENDER; i++)
+        fprintf(out, "# stage %-14s %14llu cycles %5.1f%%, "
+                "%.0f per call\n", stage_names[i],
+                (unsigned long long) c->cycles[i], 100.0 * c->cycles[i] /
+                total, c->calls[i] ? (double) c->cycles[i] / c->calls[i]
+                : 0.0);
+    fprintf(out, "# stage %-14s %14llu cycles %5.1f%%\n", "shading",
+            (unsigned long long) shading_cycles(c),
+            100.0 * shading_cycles(c) / total);
+    fprintf(out, "# stage %-14s %14llu cycles\n", "render",
+            (unsigned long long) c->cycles[STAGE_RENDER]);
+}
+
+void stats_print_json(FILE *out, const render_counters *c)
+{
+    fprintf(out, "{");
+    for (int i = 0; i < STAT_COUNTERS; i++)
+        fprintf(out, "%s\"%s\": %llu", i ? ", " : "", counter_names[i],
+                (unsigned long long) c->count[i]);
+    if (RAY_STATS >= 2) {
+        fprintf(out, ", \"cycles\": {");
+        for (int i = 0; i < STAGE_COUNT; i++)
+            fprintf(out, "\"%s\": %llu, ", stage_names[i],
+                    (unsigned long long) c->cycles[i]);
+        fprintf(out, "\"shading\": %llu}",
+                (unsigned long long) shading_cycles(c));
+    }
+    fprintf(out, "}");
+}
@@ -0,0 +1,91 @@
+#ifndef __RAY_STATS_H
+#define __RAY_STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* Hot-path instrumentation. Build with `make STATS=1` for event counters
+ * or `make STATS=2` for counters plus per-stage cycle timers; otherwise
+ * RAY_STATS is 0 and every STATS_* macro expands to nothing.
+ *
+ * Each worker counts into its own render_counters, reached through the
+ * thread-local stats_current, and raytracing() merges them at the end.
+ */
+
+#ifndef RAY_STATS
+#define RAY_STATS 0
+#endif
+
+typedef enum {
+    STAT_NODE_TESTS,        /**< BVH boxes tested by single rays */
+    STAT_SPHERE_TESTS,
+    STAT_RECTANGULAR_TESTS,
+    STAT_MESH_TESTS,        /**< rays descending into a mesh's own BVH */
+    STAT_PACKET_NODE_TESTS, /**< BVH boxes tested by whole packets */
+    STAT_PACKET_PRIM_TESTS, /**< primitives tested by whole packets */
+    STAT_OCCLUDER_HITS,     /**< shadow rays stopped by the cached blocker */
+    STAT_BOUNCE_LIMIT,      /**< rays cut off by the bounce limit */
+    STAT_LIGHTS_CULLED,     /**< many-light: lights not reaching a hit */
+    STAT_COUNTERS
+} stat_counter;
+
+/* stages are exclusive; shading is the rest of the render time */
+typedef enum {
+    STAGE_PRIMARY,   /**< nearest hits of primary ray packets */
+    STAGE_INTERSECT, /**< nearest hits of single rays */
+    STAGE_SHADOW,    /**< occlusion queries */
+    STAGE_RENDER,    /**< whole tiles, everything included */
+    STAGE_COUNT
+} stat_stage;
+
+typedef struct {
+    uint64_t count[STAT_COUNTERS];
+    uint64_t cycles[STAGE_COUNT];
+    uint64_t calls[STAGE_COUNT];
+} render_counters;
+
+void stats_merge(render_counters *dst, const render_counters *src);
+
+/* human readable summary, one line per counter and stage */
+void stats_print(FILE *out, const render_counters *c);
+
+/* the same as one JSON object, without a trailing newline */
+void stats_print_json(FILE *out, const render_counters *c);
+
+#if RAY_STATS
+extern __thread render_counters *stats_current;
+
+#define STATS_BIND(c) (stats_current = (c))
+#define STATS_INC(c) (stats_current->count[c]++)
+#define STATS_ADD(c, n) (stats_current->count[c] += (n))
+#else
+#define STATS_BIND(c) ((void) 0)
+#define STATS_INC(c) ((void) 0)
+#define STATS_ADD(c, n) ((void) 0)
+#endif
+
+/* cycles of the time stamp counter, or nanoseconds where there is none */
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define stats_clock() __rdtsc()
+#else
+#include <time.h>
+static inline uint64_t stats_clock(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+#endif
+
+#if RAY_STATS >= 2
+#define STATS_TIMER_START(name) uint64_t name = stats_clock()
+#define STATS_TIMER_STOP(stage, name) { \
+    stats_current->cycles[stage] += stats_clock() - (name); \
+    stats_current->calls[stage]++; }
+#else
+#define STATS_TIMER_START(name) ((void) 0)
+#define STATS_TIMER_STOP(stage, name) ((void) 0)
+#endif
+
+#endif